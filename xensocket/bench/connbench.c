@@ -0,0 +1,466 @@
+/* connbench.c
+ *
+ * Connection rate benchmark: client threads open a connection, wait for
+ * the server to accept and close it, and close their end, over and over
+ * for a fixed time.  Each run reports connections per second, the
+ * latency of connect() and of the whole cycle, and, for AF_XEN, where
+ * the module spent the time, from the per-phase setup counters in
+ * /proc/net/xensocket_setup:
+ *   resolve, grant, publish, wait    the connecting side;
+ *   watch, map, bind                 the accepting side.
+ * The phase columns are mean microseconds per connection.  wait minus
+ * watch is roughly the trip through xenstored and back.
+ *
+ * A run is repeated for every client count given with -n.  AF_UNIX and
+ * TCP loopback runs (-f) give the rate the host manages without any
+ * hypervisor work.
+ *
+ * Without -s or -c the listener runs inside the process, so both sides'
+ * phases come from the same counters.  Across domains, run "connbench
+ * -s" in the listening domain, which prints its own phases when
+ * interrupted, and "connbench -c" in the other.
+ *
+ * Results go to stdout as CSV, one line per run.  Notes go to stderr.
+ *
+ * Usage: connbench [-s | -c] [-f xen|unix|tcp] [-S service] [-H host]
+ *                  [-p port] [-t seconds] [-n clients,...]
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../xensocket.h"
+
+#define MAX_CLIENTS      256
+#define MAX_RUNS         32
+#define SETUP_STATS      "/proc/net/xensocket_setup"
+
+/************************************************************************
+ * Latency histogram: 16 buckets per power of two.
+ ************************************************************************/
+
+#define HIST_SUB_BITS    4
+#define HIST_SUB         (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     (64 * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static unsigned int hist_index(uint64_t v) {
+    unsigned int msb;
+
+    if (v < HIST_SUB)
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(unsigned int i) {
+    unsigned int group = i / HIST_SUB, sub = i % HIST_SUB;
+
+    if (group == 0)
+        return i;
+    return (uint64_t)(HIST_SUB + sub) << (group - 1);
+}
+
+static void hist_add(struct hist *h, uint64_t v) {
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from) {
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        to->bucket[i] += from->bucket[i];
+    to->count += from->count;
+    to->sum += from->sum;
+}
+
+/* microseconds */
+static double hist_percentile(const struct hist *h, double p) {
+    uint64_t rank = (uint64_t)(h->count * p / 100.0), seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen > rank)
+            return hist_value(i) / 1e3;
+    }
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/************************************************************************
+ * Module setup counters.
+ ************************************************************************/
+
+enum { PHASE_RESOLVE, PHASE_GRANT, PHASE_PUBLISH, PHASE_WAIT,
+       PHASE_WATCH, PHASE_MAP, PHASE_BIND, PHASES };
+
+static const char *phase_names[PHASES] = {
+    "resolve", "grant", "publish", "wait", "watch", "map", "bind",
+};
+
+struct phases {
+    unsigned long long count[PHASES];
+    unsigned long long total_ns[PHASES];
+};
+
+/* 0 if the module does not keep the counters */
+static int read_phases(struct phases *p) {
+    FILE *f = fopen(SETUP_STATS, "r");
+    char  name[32];
+    unsigned long long count, total, max;
+    int   i;
+
+    memset(p, 0, sizeof(*p));
+    if (!f)
+        return 0;
+    fscanf(f, "%*[^\n]\n");
+    while (fscanf(f, "%31s %llu %llu %llu", name, &count, &total, &max) == 4) {
+        for (i = 0; i < PHASES; i++) {
+            if (!strcmp(name, phase_names[i])) {
+                p->count[i] = count;
+                p->total_ns[i] = total;
+            }
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+/* mean microseconds of each phase between @before and @after */
+static void phase_means(const struct phases *before, const struct phases *after, double *mean) {
+    int i;
+
+    for (i = 0; i < PHASES; i++) {
+        unsigned long long n = after->count[i] - before->count[i];
+
+        mean[i] = n ? (after->total_ns[i] - before->total_ns[i]) / 1e3 / n : 0;
+    }
+}
+
+/************************************************************************
+ * Address families.
+ ************************************************************************/
+
+enum { FAM_XEN, FAM_UNIX, FAM_TCP, FAM_COUNT };
+
+static const char *family_names[FAM_COUNT] = { "xen", "unix", "tcp" };
+
+static int         family = FAM_XEN;
+static const char *service = "connbench";
+static const char *tcp_host = "127.0.0.1";
+static int         tcp_port = 5302;
+
+union address {
+    struct sockaddr     sa;
+    struct sockaddr_xe  xe;
+    struct sockaddr_un  un;
+    struct sockaddr_in  in;
+};
+
+static socklen_t make_address(union address *a) {
+    memset(a, 0, sizeof(*a));
+    switch (family) {
+    case FAM_XEN:
+        a->xe.sxe_family = AF_XEN;
+        strncpy(a->xe.service, service, sizeof(a->xe.service) - 1);
+        return sizeof(a->xe);
+    case FAM_UNIX:
+        a->un.sun_family = AF_UNIX;
+        snprintf(a->un.sun_path + 1, sizeof(a->un.sun_path) - 1, "connbench.%s", service);
+        return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(a->un.sun_path + 1);
+    default:
+        a->in.sin_family = AF_INET;
+        a->in.sin_port = htons(tcp_port);
+        if (inet_pton(AF_INET, tcp_host, &a->in.sin_addr) != 1) {
+            fprintf(stderr, "bad host %s\n", tcp_host);
+            exit(EXIT_FAILURE);
+        }
+        return sizeof(a->in);
+    }
+}
+
+static int open_socket(void) {
+    return socket(family == FAM_XEN ? AF_XEN : family == FAM_UNIX ? AF_UNIX : AF_INET,
+                  SOCK_STREAM, 0);
+}
+
+/************************************************************************
+ * Server.
+ ************************************************************************/
+
+static void *accept_loop(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+                continue;
+            perror("accept");
+            return NULL;
+        }
+        /* the client waits for this */
+        close(fd);
+    }
+}
+
+static int start_server(void) {
+    union address a;
+    socklen_t     len = make_address(&a);
+    int           fd = open_socket();
+    int           one = 1;
+
+    if (fd < 0)
+        return -1;
+    if (family == FAM_TCP) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        a.in.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    if (bind(fd, &a.sa, len) < 0 || listen(fd, 2 * MAX_CLIENTS) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static volatile sig_atomic_t interrupted;
+
+static void on_interrupt(int sig) {
+    interrupted = 1;
+}
+
+/* Accept until interrupted, then print the accepting side's phases */
+static void serve(void) {
+    struct phases before, after;
+    double        mean[PHASES];
+    pthread_t     t;
+    int           lfd, i;
+
+    if ((lfd = start_server()) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    read_phases(&before);
+    pthread_create(&t, NULL, accept_loop, (void *)(intptr_t)lfd);
+    pthread_detach(t);
+
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+    fprintf(stderr, "# accepting on %s, interrupt to print the phases\n", family_names[family]);
+    while (!interrupted)
+        pause();
+
+    read_phases(&after);
+    phase_means(&before, &after, mean);
+    printf("phase,count,mean_us\n");
+    for (i = PHASE_WATCH; i < PHASES; i++)
+        printf("%s,%llu,%.2f\n", phase_names[i], after.count[i] - before.count[i], mean[i]);
+}
+
+/************************************************************************
+ * Clients.
+ ************************************************************************/
+
+struct client {
+    double             secs;
+    pthread_barrier_t *start;
+    struct hist        connect;
+    struct hist        cycle;
+    unsigned long      errors;
+};
+
+static void *run_client(void *arg) {
+    struct client *c = arg;
+    union address  a;
+    socklen_t      len = make_address(&a);
+    uint64_t       t0, t1, deadline;
+
+    pthread_barrier_wait(c->start);
+    deadline = now_ns() + (uint64_t)(c->secs * 1e9);
+    do {
+        char byte;
+        int  fd;
+
+        t0 = now_ns();
+        if ((fd = open_socket()) < 0 || connect(fd, &a.sa, len) < 0) {
+            if (fd >= 0)
+                close(fd);
+            c->errors++;
+            t1 = now_ns();
+            continue;
+        }
+        t1 = now_ns();
+        hist_add(&c->connect, t1 - t0);
+
+        /* end of file once the server has accepted and closed */
+        if (recv(fd, &byte, 1, 0) != 0)
+            c->errors++;
+        close(fd);
+        t1 = now_ns();
+        hist_add(&c->cycle, t1 - t0);
+    } while (t1 < deadline);
+    return NULL;
+}
+
+static void run(int clients, double secs) {
+    static struct client c[MAX_CLIENTS];
+    pthread_t         t[MAX_CLIENTS];
+    pthread_barrier_t start;
+    struct hist       connect, cycle;
+    struct phases     before, after;
+    double            mean[PHASES];
+    unsigned long     errors = 0;
+    uint64_t          begin, end;
+    int               have_phases = family == FAM_XEN && read_phases(&before);
+    int               i;
+
+    memset(c, 0, sizeof(c));
+    memset(mean, 0, sizeof(mean));
+    memset(&connect, 0, sizeof(connect));
+    memset(&cycle, 0, sizeof(cycle));
+    pthread_barrier_init(&start, NULL, clients + 1);
+
+    for (i = 0; i < clients; i++) {
+        c[i].secs = secs;
+        c[i].start = &start;
+        pthread_create(&t[i], NULL, run_client, &c[i]);
+    }
+    pthread_barrier_wait(&start);
+    begin = now_ns();
+    for (i = 0; i < clients; i++) {
+        pthread_join(t[i], NULL);
+        hist_merge(&connect, &c[i].connect);
+        hist_merge(&cycle, &c[i].cycle);
+        errors += c[i].errors;
+    }
+    end = now_ns();
+    pthread_barrier_destroy(&start);
+
+    if (have_phases) {
+        read_phases(&after);
+        phase_means(&before, &after, mean);
+    }
+
+    printf("%s,%d,%.3f,%llu,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%lu",
+           family_names[family], clients, (end - begin) / 1e9,
+           (unsigned long long)cycle.count, cycle.count / ((end - begin) / 1e9),
+           connect.count ? connect.sum / 1e3 / connect.count : 0,
+           hist_percentile(&connect, 50), hist_percentile(&connect, 99),
+           hist_percentile(&connect, 99.9),
+           hist_percentile(&cycle, 50), hist_percentile(&cycle, 99), errors);
+    for (i = 0; i < PHASES; i++) {
+        if (have_phases)
+            printf(",%.2f", mean[i]);
+        else
+            printf(",");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s | -c] [-f xen|unix|tcp] [-S service] [-H host] [-p port]\n"
+            "       [-t seconds] [-n clients,...]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int    client_counts[MAX_RUNS] = { 1, 4, 16, 64 };
+    int    runs = 4;
+    double secs = 2;
+    int    server_only = 0, client_only = 0;
+    int    opt, i;
+
+    while ((opt = getopt(argc, argv, "scf:S:H:p:t:n:")) != -1) {
+        switch (opt) {
+        case 's': server_only = 1; break;
+        case 'c': client_only = 1; break;
+        case 'f':
+            for (family = 0; family < FAM_COUNT; family++)
+                if (!strcmp(optarg, family_names[family]))
+                    break;
+            if (family == FAM_COUNT)
+                usage(argv[0]);
+            break;
+        case 'S': service = optarg; break;
+        case 'H': tcp_host = optarg; break;
+        case 'p': tcp_port = atoi(optarg); break;
+        case 't': secs = atof(optarg); break;
+        case 'n': {
+            char *s = optarg, *end;
+
+            for (runs = 0; runs < MAX_RUNS && *s; s = end + 1) {
+                client_counts[runs] = strtol(s, &end, 10);
+                if (client_counts[runs] < 1 || client_counts[runs] > MAX_CLIENTS)
+                    usage(argv[0]);
+                runs++;
+                if (*end != ',')
+                    break;
+            }
+            break;
+        }
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || (server_only && client_only) || secs <= 0)
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (server_only) {
+        serve();
+        return 0;
+    }
+    if (!client_only) {
+        pthread_t t;
+        int       lfd = start_server();
+
+        if (lfd < 0) {
+            fprintf(stderr, "# %s: cannot listen (%s)\n", family_names[family], strerror(errno));
+            return EXIT_FAILURE;
+        }
+        pthread_create(&t, NULL, accept_loop, (void *)(intptr_t)lfd);
+        pthread_detach(t);
+    }
+    if (family == FAM_XEN && access(SETUP_STATS, R_OK) != 0)
+        fprintf(stderr, "# %s missing, no phase breakdown\n", SETUP_STATS);
+
+    printf("family,clients,secs,connections,conns_per_sec,"
+           "connect_mean_us,connect_p50_us,connect_p99_us,connect_p999_us,"
+           "cycle_p50_us,cycle_p99_us,errors");
+    for (i = 0; i < PHASES; i++)
+        printf(",%s_us", phase_names[i]);
+    printf("\n");
+
+    for (i = 0; i < runs; i++)
+        run(client_counts[i], secs);
+    return 0;
+}
@@ -0,0 +1,253 @@
+/* libbench.c
+ *
+ * Microbenchmarks for the userspace ring library in ../lib: streaming
+ * throughput over a sweep of message sizes, and cross-core round trip
+ * latency, each with the sleeping receiver woken through its eventfd
+ * and with busy polling.  The two ends run as threads pinned to
+ * different CPUs, each with its own attachment to the channel, exactly
+ * as two processes would.
+ *
+ * Besides the rates, the throughput runs report how many doorbells were
+ * rung and how many the event indices saved, which is what most tuning
+ * of the notification scheme is about.
+ *
+ * Usage: libbench [cpu_a cpu_b [megabytes]]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/libxensocket.h"
+
+#define RING_SIZE      (32 * XS_PAGE_SIZE)
+#define ROUND_TRIPS    100000
+
+struct end {
+    struct xs_channel ch;
+    int               cpu;
+    size_t            msg_size;
+    size_t            total;
+};
+
+static void pin(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Set up both ends of a fresh channel, as a fork() would hand it over */
+static void open_pair(struct end *a, struct end *b, unsigned int busy_poll) {
+    if (xs_channel_create(&a->ch, RING_SIZE) < 0) {
+        perror("xs_channel_create");
+        exit(EXIT_FAILURE);
+    }
+    if (xs_channel_attach(&b->ch, fcntl(a->ch.memfd, F_DUPFD_CLOEXEC, 0),
+                          fcntl(a->ch.efd[0], F_DUPFD_CLOEXEC, 0),
+                          fcntl(a->ch.efd[1], F_DUPFD_CLOEXEC, 0), 1) < 0) {
+        perror("xs_channel_attach");
+        exit(EXIT_FAILURE);
+    }
+    xs_set_busy_poll(&a->ch, busy_poll);
+    xs_set_busy_poll(&b->ch, busy_poll);
+}
+
+static void send_all(struct xs_channel *c, const void *buf, size_t len) {
+    if (xs_send(c, buf, len, 0) != (ssize_t)len) {
+        perror("xs_send");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void recv_all(struct xs_channel *c, void *buf, size_t len) {
+    while (len) {
+        ssize_t n = xs_recv(c, buf, len, 0);
+
+        if (n <= 0) {
+            fprintf(stderr, "xs_recv: %s\n", n ? strerror(errno) : "end of file");
+            exit(EXIT_FAILURE);
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+}
+
+/************************************************************************
+ * Throughput.
+ ************************************************************************/
+
+static void *stream_sender(void *arg) {
+    struct end *e = arg;
+    char       *msg = malloc(e->msg_size);
+    size_t      sent;
+
+    pin(e->cpu);
+    memset(msg, 'x', e->msg_size);
+    for (sent = 0; sent < e->total; sent += e->msg_size)
+        send_all(&e->ch, msg, e->msg_size);
+    free(msg);
+    return NULL;
+}
+
+static void *stream_receiver(void *arg) {
+    struct end *e = arg;
+    char       *msg = malloc(e->msg_size);
+    size_t      received = 0;
+
+    pin(e->cpu);
+    while (received < e->total) {
+        ssize_t n = xs_recv(&e->ch, msg, e->msg_size, 0);
+
+        if (n <= 0) {
+            perror("xs_recv");
+            exit(EXIT_FAILURE);
+        }
+        received += n;
+    }
+    free(msg);
+    return NULL;
+}
+
+static void stream(size_t msg_size, size_t total, int cpu_a, int cpu_b, unsigned int busy_poll) {
+    struct end a, b;
+    pthread_t  ta, tb;
+    double     start, secs;
+    unsigned long sent, avoided, waits;
+
+    open_pair(&a, &b, busy_poll);
+    a.cpu = cpu_a;
+    b.cpu = cpu_b;
+    a.msg_size = b.msg_size = msg_size;
+    a.total = b.total = total;
+
+    start = now();
+    pthread_create(&tb, NULL, stream_receiver, &b);
+    pthread_create(&ta, NULL, stream_sender, &a);
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+    secs = now() - start;
+
+    sent = a.ch.stats.notifications_sent + b.ch.stats.notifications_sent;
+    avoided = a.ch.stats.notifications_avoided + b.ch.stats.notifications_avoided;
+    waits = a.ch.stats.waits + b.ch.stats.waits;
+    printf("%-10zu %-6s %12.1f %12lu %12lu %10lu\n", msg_size, busy_poll ? "poll" : "sleep",
+           total / secs / (1024.0 * 1024.0), sent, avoided, waits);
+
+    xs_channel_close(&a.ch);
+    xs_channel_close(&b.ch);
+}
+
+/************************************************************************
+ * Latency.
+ ************************************************************************/
+
+static void *echo(void *arg) {
+    struct end *e = arg;
+    char        buf[XS_PAGE_SIZE];
+    int         i;
+
+    pin(e->cpu);
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        recv_all(&e->ch, buf, e->msg_size);
+        send_all(&e->ch, buf, e->msg_size);
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void ping_pong(size_t msg_size, int cpu_a, int cpu_b, unsigned int busy_poll) {
+    struct end a, b;
+    pthread_t  tb;
+    double    *rtt = malloc(ROUND_TRIPS * sizeof(*rtt));
+    char       buf[XS_PAGE_SIZE];
+    double     sum = 0;
+    int        i;
+
+    open_pair(&a, &b, busy_poll);
+    a.msg_size = b.msg_size = msg_size;
+    b.cpu = cpu_b;
+    pthread_create(&tb, NULL, echo, &b);
+    pin(cpu_a);
+
+    memset(buf, 'x', msg_size);
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        double start = now();
+
+        send_all(&a.ch, buf, msg_size);
+        recv_all(&a.ch, buf, msg_size);
+        rtt[i] = (now() - start) * 1e9;
+        sum += rtt[i];
+    }
+    pthread_join(tb, NULL);
+    pin(-1);
+
+    qsort(rtt, ROUND_TRIPS, sizeof(*rtt), cmp_double);
+    printf("%-10zu %-6s %10.0f %10.0f %10.0f %10.0f\n", msg_size, busy_poll ? "poll" : "sleep",
+           sum / ROUND_TRIPS, rtt[ROUND_TRIPS / 2], rtt[ROUND_TRIPS * 99 / 100],
+           rtt[ROUND_TRIPS * 999 / 1000]);
+
+    free(rtt);
+    xs_channel_close(&a.ch);
+    xs_channel_close(&b.ch);
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+    static const size_t rr_sizes[] = { 1, 64, 1024 };
+    int    cpu_a = 0, cpu_b = 1;
+    size_t megabytes = 256;
+    size_t i;
+
+    if (argc >= 3) {
+        cpu_a = atoi(argv[1]);
+        cpu_b = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        megabytes = strtoul(argv[3], NULL, 10);
+
+    if (cpu_a == cpu_b || sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        printf("# warning: both ends share a CPU, results are not representative\n");
+
+    printf("# ring %d bytes, cpus %d and %d, %zu MiB per run\n", RING_SIZE, cpu_a, cpu_b, megabytes);
+    printf("%-10s %-6s %12s %12s %12s %10s\n", "msg_size", "wait", "MiB/s", "notified", "avoided", "sleeps");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        /* keep small-message runs to a sensible duration */
+        size_t total = megabytes << 20;
+
+        if (sizes[i] < 1024)
+            total /= 1024 / sizes[i];
+        stream(sizes[i], total, cpu_a, cpu_b, 0);
+        stream(sizes[i], total, cpu_a, cpu_b, 50);
+    }
+
+    printf("# %d round trips, nanoseconds\n", ROUND_TRIPS);
+    printf("%-10s %-6s %10s %10s %10s %10s\n", "msg_size", "wait", "mean", "p50", "p99", "p999");
+    for (i = 0; i < sizeof(rr_sizes) / sizeof(rr_sizes[0]); i++) {
+        ping_pong(rr_sizes[i], cpu_a, cpu_b, 0);
+        ping_pong(rr_sizes[i], cpu_a, cpu_b, 50);
+    }
+    return 0;
+}
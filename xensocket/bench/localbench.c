@@ -0,0 +1,249 @@
+/* localbench.c
+ *
+ * Compares AF_XEN between two sockets of the same domain with AF_UNIX.
+ * The module connects such sockets through its same-domain fast path
+ * (shared kernel pages and direct wakeups instead of grants and event
+ * channels), so this shows what is left of the transport's own cost.
+ *
+ * For each family a connected stream pair is set up within this process,
+ * then:
+ *   - a sender thread streams data in messages of several sizes to a
+ *     receiver thread, and the wall-clock throughput is reported;
+ *   - one byte is bounced back and forth, and the mean round trip time
+ *     is reported.
+ *
+ * The AF_XEN runs need the module loaded; under Xen with
+ * same_domain_fast_path=0 they measure the grant and event channel path
+ * instead, which makes for a direct comparison.
+ *
+ * Usage: localbench [service [megabytes]]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../xensocket.h"
+
+#define ROUND_TRIPS    20000
+
+struct stream {
+    int    fd;
+    size_t msg_size;
+    size_t total;
+};
+
+struct listener {
+    int fd;
+    int conn;
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, 0);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void read_all(int fd, char *buf, size_t len) {
+    while (len) {
+        ssize_t n = recv(fd, buf, len, 0);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "recv: %s\n", n ? strerror(errno) : "connection closed");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void *accept_one(void *arg) {
+    struct listener *l = arg;
+
+    l->conn = accept(l->fd, NULL, NULL);
+    return NULL;
+}
+
+/* Connect two AF_XEN sockets through @service; 0 if the module is missing */
+static int xen_pair(const char *service, int fds[2]) {
+    struct sockaddr_xe addr;
+    struct listener    l;
+    pthread_t          t;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sxe_family = AF_XEN;
+    strncpy(addr.service, service, sizeof(addr.service) - 1);
+
+    if ((l.fd = socket(AF_XEN, SOCK_STREAM, 0)) < 0)
+        return 0;
+    bind(l.fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (listen(l.fd, 1) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    pthread_create(&t, NULL, accept_one, &l);
+
+    if ((fds[0] = socket(AF_XEN, SOCK_STREAM, 0)) < 0 ||
+        connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    pthread_join(t, NULL);
+    if (l.conn < 0) {
+        perror("accept");
+        exit(EXIT_FAILURE);
+    }
+    fds[1] = l.conn;
+    close(l.fd);
+    return 1;
+}
+
+static void *stream_receiver(void *arg) {
+    struct stream *s = arg;
+    char          *buf = malloc(s->msg_size);
+    size_t         received = 0;
+
+    while (received < s->total) {
+        ssize_t n = recv(s->fd, buf, s->msg_size, 0);
+
+        if (n <= 0) {
+            perror("recv");
+            exit(EXIT_FAILURE);
+        }
+        received += n;
+    }
+    /* tell the sender everything arrived */
+    write_all(s->fd, "", 1);
+    free(buf);
+    return NULL;
+}
+
+static double stream(int fds[2], size_t msg_size, size_t total) {
+    struct stream s = { fds[1], msg_size, total };
+    pthread_t     t;
+    char         *buf = malloc(msg_size);
+    size_t        sent;
+    double        start, secs;
+    char          done;
+
+    memset(buf, 'x', msg_size);
+    pthread_create(&t, NULL, stream_receiver, &s);
+
+    start = now();
+    for (sent = 0; sent < total; sent += msg_size)
+        write_all(fds[0], buf, msg_size);
+    read_all(fds[0], &done, 1);
+    secs = now() - start;
+
+    pthread_join(t, NULL);
+    free(buf);
+    return total / secs / (1024.0 * 1024.0);
+}
+
+static void *echo(void *arg) {
+    int  fd = *(int *)arg;
+    char c;
+    int  i;
+
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        read_all(fd, &c, 1);
+        write_all(fd, &c, 1);
+    }
+    return NULL;
+}
+
+/* mean round trip in microseconds */
+static double ping_pong(int fds[2]) {
+    pthread_t t;
+    double    start, secs;
+    char      c = 'x';
+    int       i;
+
+    pthread_create(&t, NULL, echo, &fds[1]);
+    start = now();
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        write_all(fds[0], &c, 1);
+        read_all(fds[0], &c, 1);
+    }
+    secs = now() - start;
+    pthread_join(t, NULL);
+    return secs / ROUND_TRIPS * 1e6;
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 64, 1024, 4096, 16384, 65536 };
+    const char *service = "localbench";
+    size_t      megabytes = 256;
+    int         unix_fds[2], xen_fds[2];
+    int         have_xen;
+    size_t      i;
+
+    if (argc >= 2)
+        service = argv[1];
+    if (argc >= 3)
+        megabytes = strtoul(argv[2], NULL, 10);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, unix_fds) < 0) {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+    have_xen = xen_pair(service, xen_fds);
+    if (!have_xen)
+        printf("# AF_XEN unavailable (%s), reporting AF_UNIX only\n", strerror(errno));
+
+    printf("# %zu MiB per run, %d round trips\n", megabytes, ROUND_TRIPS);
+    printf("%-10s %12s %12s %8s\n", "msg_size", "unix_MiB/s", "xen_MiB/s", "ratio");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t total = megabytes << 20;
+        double u, x = 0;
+
+        /* keep small-message runs to a sensible duration */
+        if (sizes[i] < 1024)
+            total /= 1024 / sizes[i];
+        total -= total % sizes[i];
+        u = stream(unix_fds, sizes[i], total);
+        if (have_xen)
+            x = stream(xen_fds, sizes[i], total);
+        printf("%-10zu %12.1f %12.1f %7.2fx\n", sizes[i], u, x, x / u);
+    }
+
+    printf("%-10s %12s %12s\n", "rtt", "unix_usec", "xen_usec");
+    {
+        double u = ping_pong(unix_fds);
+        double x = have_xen ? ping_pong(xen_fds) : 0;
+
+        printf("%-10s %12.2f %12.2f\n", "1", u, x);
+    }
+
+    close(unix_fds[0]);
+    close(unix_fds[1]);
+    if (have_xen) {
+        close(xen_fds[0]);
+        close(xen_fds[1]);
+    }
+    return 0;
+}
@@ -0,0 +1,267 @@
+/* ringbench.c
+ *
+ * Userspace model of the XenSocket ring, used to compare the cross-core
+ * cost of the version 1 descriptor layout (offsets, byte totals and the
+ * avail_bytes atomic sharing one cache line) with the version 2 layout
+ * (free-running producer and consumer indices on separate cache lines,
+ * release/acquire ordering, power-of-two masking).
+ *
+ * A producer thread and a consumer thread, pinned to different CPUs,
+ * stream data through a ring of the module's default size using the same
+ * copy and index update sequence as xen_sendmsg()/xen_recvmsg().  Neither
+ * side ever sleeps, so the result isolates the cost of the shared
+ * indices.
+ *
+ * Usage: ringbench [producer_cpu consumer_cpu [megabytes]]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_ORDER     5
+#define PAGE_SIZE      4096
+#define RING_SIZE      ((1 << RING_ORDER) * PAGE_SIZE)
+#define INDEX_ALIGN    128
+
+/* Version 1: everything on one line, as in the original descriptor_page */
+struct desc_v1 {
+    unsigned int send_offset;
+    unsigned int recv_offset;
+    unsigned int total_bytes_sent;
+    unsigned int total_bytes_received;
+    int          avail_bytes;
+} __attribute__((aligned(INDEX_ALIGN)));
+
+/* Version 2: each index alone on its own line */
+struct desc_v2 {
+    unsigned int prod __attribute__((aligned(INDEX_ALIGN)));
+    unsigned int cons __attribute__((aligned(INDEX_ALIGN)));
+};
+
+struct bench {
+    int             version;
+    int             cpu;
+    size_t          msg_size;
+    size_t          total;
+    unsigned char  *ring;
+    struct desc_v1 *d1;
+    struct desc_v2 *d2;
+};
+
+static void pin(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* set when both threads share a CPU, where spinning only burns the slice */
+static int yield_when_idle;
+
+static inline void cpu_relax(void) {
+    if (yield_when_idle) {
+        sched_yield();
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* Copy into the ring at offset, wrapping around as xen_sendmsg() does */
+static void ring_put(unsigned char *ring, unsigned int off, const unsigned char *src, unsigned int len) {
+    if (off + len > RING_SIZE) {
+        unsigned int seg1 = RING_SIZE - off;
+        memcpy(ring + off, src, seg1);
+        memcpy(ring, src + seg1, len - seg1);
+    } else {
+        memcpy(ring + off, src, len);
+    }
+}
+
+static void ring_get(const unsigned char *ring, unsigned int off, unsigned char *dst, unsigned int len) {
+    if (off + len > RING_SIZE) {
+        unsigned int seg1 = RING_SIZE - off;
+        memcpy(dst, ring + off, seg1);
+        memcpy(dst + seg1, ring, len - seg1);
+    } else {
+        memcpy(dst, ring + off, len);
+    }
+}
+
+static void *producer(void *arg) {
+    struct bench  *b = arg;
+    unsigned char *msg = malloc(b->msg_size);
+    size_t         sent = 0;
+
+    memset(msg, 'x', b->msg_size);
+    pin(b->cpu);
+
+    while (sent < b->total) {
+        unsigned int want = b->msg_size;
+        unsigned int bytes;
+
+        if (b->version == 1) {
+            struct desc_v1 *d = b->d1;
+            unsigned int avail = __atomic_load_n(&d->avail_bytes, __ATOMIC_RELAXED);
+
+            bytes = want < avail ? want : avail;
+            if (!bytes) {
+                cpu_relax();
+                continue;
+            }
+            ring_put(b->ring, d->send_offset, msg, bytes);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            d->send_offset = (d->send_offset + bytes) % RING_SIZE;
+            d->total_bytes_sent += bytes;
+            __atomic_fetch_sub(&d->avail_bytes, bytes, __ATOMIC_SEQ_CST);
+        } else {
+            struct desc_v2 *d = b->d2;
+            unsigned int cons = __atomic_load_n(&d->cons, __ATOMIC_ACQUIRE);
+            unsigned int avail = RING_SIZE - (d->prod - cons);
+
+            bytes = want < avail ? want : avail;
+            if (!bytes) {
+                cpu_relax();
+                continue;
+            }
+            ring_put(b->ring, d->prod & (RING_SIZE - 1), msg, bytes);
+            __atomic_store_n(&d->prod, d->prod + bytes, __ATOMIC_RELEASE);
+        }
+        sent += bytes;
+    }
+    free(msg);
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    struct bench  *b = arg;
+    unsigned char *msg = malloc(b->msg_size);
+    size_t         received = 0;
+
+    pin(b->cpu);
+
+    while (received < b->total) {
+        unsigned int want = b->msg_size;
+        unsigned int bytes;
+
+        if (b->version == 1) {
+            struct desc_v1 *d = b->d1;
+            unsigned int avail = RING_SIZE - __atomic_load_n(&d->avail_bytes, __ATOMIC_RELAXED);
+
+            bytes = want < avail ? want : avail;
+            if (!bytes) {
+                cpu_relax();
+                continue;
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            ring_get(b->ring, d->recv_offset, msg, bytes);
+            d->recv_offset = (d->recv_offset + bytes) % RING_SIZE;
+            d->total_bytes_received += bytes;
+            __atomic_fetch_add(&d->avail_bytes, bytes, __ATOMIC_SEQ_CST);
+        } else {
+            struct desc_v2 *d = b->d2;
+            unsigned int prod = __atomic_load_n(&d->prod, __ATOMIC_ACQUIRE);
+            unsigned int avail = prod - d->cons;
+
+            bytes = want < avail ? want : avail;
+            if (!bytes) {
+                cpu_relax();
+                continue;
+            }
+            ring_get(b->ring, d->cons & (RING_SIZE - 1), msg, bytes);
+            __atomic_store_n(&d->cons, d->cons + bytes, __ATOMIC_RELEASE);
+        }
+        received += bytes;
+    }
+    free(msg);
+    return NULL;
+}
+
+static double run(int version, size_t msg_size, size_t total, int pcpu, int ccpu) {
+    struct bench    pb, cb;
+    pthread_t       pt, ct;
+    struct timespec start, end;
+    unsigned char  *ring;
+    struct desc_v1 *d1;
+    struct desc_v2 *d2;
+    double          secs;
+
+    if (posix_memalign((void **)&ring, PAGE_SIZE, RING_SIZE) ||
+        posix_memalign((void **)&d1, PAGE_SIZE, PAGE_SIZE) ||
+        posix_memalign((void **)&d2, PAGE_SIZE, PAGE_SIZE)) {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+    memset(ring, 0, RING_SIZE);
+    memset(d1, 0, sizeof(*d1));
+    memset(d2, 0, sizeof(*d2));
+    d1->avail_bytes = RING_SIZE;
+
+    pb.version = cb.version = version;
+    pb.msg_size = cb.msg_size = msg_size;
+    pb.total = cb.total = total;
+    pb.ring = cb.ring = ring;
+    pb.d1 = cb.d1 = d1;
+    pb.d2 = cb.d2 = d2;
+    pb.cpu = pcpu;
+    cb.cpu = ccpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&ct, NULL, consumer, &cb);
+    pthread_create(&pt, NULL, producer, &pb);
+    pthread_join(pt, NULL);
+    pthread_join(ct, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    free(ring);
+    free(d1);
+    free(d2);
+    return total / secs / (1024.0 * 1024.0);
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+    int    pcpu = 0, ccpu = 1;
+    size_t megabytes = 512;
+    size_t i;
+
+    if (argc >= 3) {
+        pcpu = atoi(argv[1]);
+        ccpu = atoi(argv[2]);
+    }
+    if (argc >= 4) {
+        megabytes = strtoul(argv[3], NULL, 10);
+    }
+
+    if (pcpu == ccpu || sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        yield_when_idle = 1;
+        printf("# warning: producer and consumer share a CPU, results are not representative\n");
+    }
+
+    printf("# ring %d bytes, producer cpu %d, consumer cpu %d, %zu MiB per run\n",
+           RING_SIZE, pcpu, ccpu, megabytes);
+    printf("%-10s %12s %12s %8s\n", "msg_size", "v1_MiB/s", "v2_MiB/s", "speedup");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        /* keep small-message runs to a sensible duration */
+        size_t total = megabytes << 20;
+        double v1, v2;
+
+        if (sizes[i] < 1024)
+            total /= 1024 / sizes[i];
+        v1 = run(1, sizes[i], total, pcpu, ccpu);
+        v2 = run(2, sizes[i], total, pcpu, ccpu);
+        printf("%-10zu %12.1f %12.1f %7.2fx\n", sizes[i], v1, v2, v2 / v1);
+    }
+    return 0;
+}
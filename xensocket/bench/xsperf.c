@@ -0,0 +1,612 @@
+/* xsperf.c
+ *
+ * Throughput and latency benchmark for AF_XEN sockets, in the manner of
+ * iperf and netperf, with the same runs over AF_UNIX and TCP loopback
+ * for comparison.  Every run is timed by the wall clock.  A run is one
+ * of:
+ *   stream    one connection streams messages of a given size for a
+ *             fixed time; throughput counts what the server received;
+ *   rr        one connection bounces a message of a given size back and
+ *             forth; round trips per second and latency percentiles;
+ *   parallel  like stream, over several connections at once, each with
+ *             its own thread on both sides; aggregate throughput.
+ *
+ * Each run also reports the CPU time both sides spent per GB moved, from
+ * getrusage(RUSAGE_THREAD) of the threads driving the connections.  Work
+ * the kernel does in interrupt context is charged to whatever thread it
+ * interrupted, so on an idle machine this is close to, but not exactly,
+ * the cost of the transport.
+ *
+ * Latencies go into a log-linear histogram with 16 buckets per power of
+ * two, so percentiles are exact to within 1/16.
+ *
+ * Results are written to stdout, one line per run, as CSV (default) or
+ * as JSON objects (-o json).  Notes go to stderr.
+ *
+ * Without -s or -c, a server for each family runs inside the process.
+ * Across domains, run "xsperf -s" in the listening domain and
+ * "xsperf -c" in the other.
+ *
+ * Usage: xsperf [-s | -c] [-f xen,unix,tcp] [-S service] [-H host]
+ *               [-p port] [-t seconds] [-T stream,rr,parallel]
+ *               [-m sizes] [-r sizes] [-P streams] [-M size] [-o csv|json]
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../xensocket.h"
+
+#define XSPERF_MAGIC     0x58535046U   /* "XSPF" */
+#define MAX_STREAMS      64
+#define MAX_SIZES        32
+
+enum { TEST_STREAM = 1, TEST_RR = 2 };
+
+/* First thing a client sends on each connection */
+struct request {
+    uint32_t magic;
+    uint32_t test;
+    uint32_t msg_size;
+    uint32_t reserved;
+};
+
+/* Last thing the server sends, once the client has shut down */
+struct reply {
+    uint64_t bytes;       /* received by the server */
+    uint64_t cpu_usec;    /* server thread CPU time for the connection */
+};
+
+/************************************************************************
+ * Latency histogram.
+ ************************************************************************/
+
+#define HIST_SUB_BITS    4
+#define HIST_SUB         (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     (64 * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static unsigned int hist_index(uint64_t v) {
+    unsigned int msb;
+
+    if (v < HIST_SUB)
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* lowest value that lands in bucket @i */
+static uint64_t hist_value(unsigned int i) {
+    unsigned int group = i / HIST_SUB, sub = i % HIST_SUB;
+
+    if (group == 0)
+        return i;
+    return (uint64_t)(HIST_SUB + sub) << (group - 1);
+}
+
+static void hist_add(struct hist *h, uint64_t v) {
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from) {
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        to->bucket[i] += from->bucket[i];
+    to->count += from->count;
+    to->sum += from->sum;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double p) {
+    uint64_t rank = (uint64_t)(h->count * p / 100.0), seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return 0;
+}
+
+/************************************************************************
+ * Helpers.
+ ************************************************************************/
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_usec(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_THREAD, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL
+        + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, 0);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* 1 when @len bytes were read, 0 on end of file before any, -1 on error */
+static int read_all(int fd, void *buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = recv(fd, (char *)buf + got, len - got, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0 && got == 0)
+                return 0;
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        got += n;
+    }
+    return 1;
+}
+
+/* Parse a comma separated list of numbers; returns how many */
+static int parse_list(const char *s, size_t *out, int max) {
+    int n = 0;
+
+    while (*s && n < max) {
+        char *end;
+
+        out[n++] = strtoul(s, &end, 10);
+        if (*end != ',')
+            break;
+        s = end + 1;
+    }
+    return n;
+}
+
+/************************************************************************
+ * Address families.
+ ************************************************************************/
+
+enum { FAM_XEN, FAM_UNIX, FAM_TCP, FAM_COUNT };
+
+static const char *family_names[FAM_COUNT] = { "xen", "unix", "tcp" };
+
+static const char *service = "xsperf";
+static const char *tcp_host = "127.0.0.1";
+static int         tcp_port = 5301;
+
+union address {
+    struct sockaddr     sa;
+    struct sockaddr_xe  xe;
+    struct sockaddr_un  un;
+    struct sockaddr_in  in;
+};
+
+static socklen_t make_address(int family, union address *a) {
+    memset(a, 0, sizeof(*a));
+    switch (family) {
+    case FAM_XEN:
+        a->xe.sxe_family = AF_XEN;
+        strncpy(a->xe.service, service, sizeof(a->xe.service) - 1);
+        return sizeof(a->xe);
+    case FAM_UNIX:
+        /* abstract name, nothing to clean up */
+        a->un.sun_family = AF_UNIX;
+        snprintf(a->un.sun_path + 1, sizeof(a->un.sun_path) - 1, "xsperf.%s", service);
+        return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(a->un.sun_path + 1);
+    default:
+        a->in.sin_family = AF_INET;
+        a->in.sin_port = htons(tcp_port);
+        if (inet_pton(AF_INET, tcp_host, &a->in.sin_addr) != 1) {
+            fprintf(stderr, "bad host %s\n", tcp_host);
+            exit(EXIT_FAILURE);
+        }
+        return sizeof(a->in);
+    }
+}
+
+static int open_socket(int family) {
+    int fd = socket(family == FAM_XEN ? AF_XEN : family == FAM_UNIX ? AF_UNIX : AF_INET,
+                    SOCK_STREAM, 0);
+    int one = 1;
+
+    if (fd >= 0 && family == FAM_TCP) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int connect_to(int family) {
+    union address a;
+    socklen_t     len = make_address(family, &a);
+    int           fd = open_socket(family);
+
+    if (fd < 0 || connect(fd, &a.sa, len) < 0) {
+        perror("connect");
+        return -1;
+    }
+    return fd;
+}
+
+/************************************************************************
+ * Server.
+ ************************************************************************/
+
+static void *serve(void *arg) {
+    int            fd = (int)(intptr_t)arg;
+    struct request req;
+    struct reply   rep = { 0, 0 };
+    uint64_t       cpu = thread_cpu_usec();
+    char          *buf = NULL;
+
+    if (read_all(fd, &req, sizeof(req)) != 1 || req.magic != XSPERF_MAGIC
+        || req.msg_size == 0 || req.msg_size > (64 << 20))
+        goto out;
+    buf = malloc(req.msg_size);
+
+    if (req.test == TEST_STREAM) {
+        ssize_t n;
+
+        while ((n = recv(fd, buf, req.msg_size, 0)) != 0) {
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                goto out;
+            }
+            rep.bytes += n;
+        }
+    } else {
+        int rc;
+
+        while ((rc = read_all(fd, buf, req.msg_size)) == 1) {
+            if (write_all(fd, buf, req.msg_size) < 0)
+                goto out;
+            rep.bytes += req.msg_size;
+        }
+        if (rc < 0)
+            goto out;
+    }
+
+    rep.cpu_usec = thread_cpu_usec() - cpu;
+    write_all(fd, &rep, sizeof(rep));
+out:
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void *accept_loop(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+
+    for (;;) {
+        int       fd = accept(lfd, NULL, NULL);
+        pthread_t t;
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return NULL;
+        }
+        if (pthread_create(&t, NULL, serve, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(t);
+    }
+}
+
+/* Listen for @family; -1 if the family is unavailable */
+static int start_server(int family) {
+    union address a;
+    socklen_t     len = make_address(family, &a);
+    int           fd = open_socket(family);
+
+    if (fd < 0)
+        return -1;
+    if (family == FAM_TCP)
+        a.in.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, &a.sa, len) < 0 || listen(fd, MAX_STREAMS) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/************************************************************************
+ * Client.
+ ************************************************************************/
+
+struct worker {
+    int                fd;
+    int                test;
+    size_t             msg_size;
+    double             secs;
+    pthread_barrier_t *start;
+    /* results */
+    int                failed;
+    uint64_t           bytes;
+    uint64_t           client_cpu_usec;
+    uint64_t           server_cpu_usec;
+    double             end;
+    struct hist        rtt;
+};
+
+static void *run_worker(void *arg) {
+    struct worker *w = arg;
+    struct request req = { XSPERF_MAGIC, w->test, w->msg_size, 0 };
+    struct reply   rep;
+    char          *buf = malloc(w->msg_size);
+    uint64_t       cpu;
+    double         deadline;
+
+    memset(buf, 'x', w->msg_size);
+    if (write_all(w->fd, &req, sizeof(req)) < 0)
+        w->failed = 1;
+    pthread_barrier_wait(w->start);
+    if (w->failed)
+        goto out;
+
+    cpu = thread_cpu_usec();
+    deadline = now() + w->secs;
+    if (w->test == TEST_STREAM) {
+        do {
+            if (write_all(w->fd, buf, w->msg_size) < 0)
+                goto fail;
+        } while (now() < deadline);
+    } else {
+        uint64_t t = now_ns(), deadline_ns = (uint64_t)(deadline * 1e9);
+
+        do {
+            uint64_t t0 = t;
+
+            if (write_all(w->fd, buf, w->msg_size) < 0 ||
+                read_all(w->fd, buf, w->msg_size) != 1)
+                goto fail;
+            t = now_ns();
+            hist_add(&w->rtt, t - t0);
+        } while (t < deadline_ns);
+    }
+
+    /* the reply comes once the server has seen everything */
+    shutdown(w->fd, SHUT_WR);
+    if (read_all(w->fd, &rep, sizeof(rep)) != 1)
+        goto fail;
+    w->end = now();
+    w->client_cpu_usec = thread_cpu_usec() - cpu;
+    w->server_cpu_usec = rep.cpu_usec;
+    w->bytes = w->test == TEST_STREAM ? rep.bytes : 2 * rep.bytes;
+    goto out;
+
+fail:
+    perror(w->test == TEST_STREAM ? "stream" : "rr");
+    w->failed = 1;
+out:
+    free(buf);
+    close(w->fd);
+    return NULL;
+}
+
+static int output_json;
+
+static void report(int family, const char *test, size_t msg_size, int streams, double secs,
+                   uint64_t bytes, uint64_t client_cpu, uint64_t server_cpu, const struct hist *h) {
+    double gb = bytes / 1e9;
+    double mib_s = bytes / secs / (1024.0 * 1024.0);
+    double trans_s = h->count / secs;
+    double mean = h->count ? h->sum / 1e3 / h->count : 0;
+    double p50 = hist_percentile(h, 50) / 1e3;
+    double p99 = hist_percentile(h, 99) / 1e3;
+    double p999 = hist_percentile(h, 99.9) / 1e3;
+    double ccpu = gb ? client_cpu / 1e6 / gb : 0;
+    double scpu = gb ? server_cpu / 1e6 / gb : 0;
+
+    if (output_json)
+        printf("{\"family\":\"%s\",\"test\":\"%s\",\"msg_size\":%zu,\"streams\":%d,"
+               "\"secs\":%.3f,\"bytes\":%llu,\"mib_per_sec\":%.1f,\"trans_per_sec\":%.0f,"
+               "\"rtt_mean_us\":%.2f,\"rtt_p50_us\":%.2f,\"rtt_p99_us\":%.2f,\"rtt_p999_us\":%.2f,"
+               "\"client_cpu_s_per_gb\":%.3f,\"server_cpu_s_per_gb\":%.3f}\n",
+               family_names[family], test, msg_size, streams, secs, (unsigned long long)bytes,
+               mib_s, trans_s, mean, p50, p99, p999, ccpu, scpu);
+    else
+        printf("%s,%s,%zu,%d,%.3f,%llu,%.1f,%.0f,%.2f,%.2f,%.2f,%.2f,%.3f,%.3f\n",
+               family_names[family], test, msg_size, streams, secs, (unsigned long long)bytes,
+               mib_s, trans_s, mean, p50, p99, p999, ccpu, scpu);
+    fflush(stdout);
+}
+
+static int run(int family, const char *name, int test, size_t msg_size, int streams, double secs) {
+    static struct worker w[MAX_STREAMS];
+    pthread_t         t[MAX_STREAMS];
+    pthread_barrier_t start;
+    struct hist       rtt;
+    uint64_t          bytes = 0, ccpu = 0, scpu = 0;
+    double            begin, end = 0;
+    int               i, failed = 0;
+
+    memset(w, 0, sizeof(w));
+    memset(&rtt, 0, sizeof(rtt));
+    pthread_barrier_init(&start, NULL, streams + 1);
+
+    /* connect everything first, so setup stays out of the timing */
+    for (i = 0; i < streams; i++) {
+        w[i].fd = connect_to(family);
+        if (w[i].fd < 0) {
+            while (i--)
+                close(w[i].fd);
+            pthread_barrier_destroy(&start);
+            return -1;
+        }
+        w[i].test = test;
+        w[i].msg_size = msg_size;
+        w[i].secs = secs;
+        w[i].start = &start;
+    }
+    for (i = 0; i < streams; i++)
+        pthread_create(&t[i], NULL, run_worker, &w[i]);
+
+    pthread_barrier_wait(&start);
+    begin = now();
+    for (i = 0; i < streams; i++) {
+        pthread_join(t[i], NULL);
+        failed |= w[i].failed;
+        bytes += w[i].bytes;
+        ccpu += w[i].client_cpu_usec;
+        scpu += w[i].server_cpu_usec;
+        if (w[i].end > end)
+            end = w[i].end;
+        hist_merge(&rtt, &w[i].rtt);
+    }
+    pthread_barrier_destroy(&start);
+    if (failed)
+        return -1;
+
+    report(family, name, msg_size, streams, end - begin, bytes, ccpu, scpu, &rtt);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s | -c] [-f xen,unix,tcp] [-S service] [-H host] [-p port]\n"
+            "       [-t seconds] [-T stream,rr,parallel] [-m sizes] [-r sizes]\n"
+            "       [-P streams] [-M size] [-o csv|json]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    size_t stream_sizes[MAX_SIZES] = { 64, 256, 1024, 4096, 16384, 65536 };
+    size_t rr_sizes[MAX_SIZES] = { 1, 64, 1024 };
+    size_t parallel[MAX_SIZES] = { 2, 4, 8 };
+    int    n_stream = 6, n_rr = 3, n_parallel = 3;
+    size_t parallel_size = 16384;
+    double secs = 2;
+    int    server_only = 0, client_only = 0, family_given = 0;
+    int    families[FAM_COUNT] = { 1, 1, 1 };
+    const char *tests = "stream,rr,parallel";
+    int    opt, f, i;
+
+    while ((opt = getopt(argc, argv, "scf:S:H:p:t:T:m:r:P:M:o:")) != -1) {
+        switch (opt) {
+        case 's': server_only = 1; break;
+        case 'c': client_only = 1; break;
+        case 'f':
+            family_given = 1;
+            for (f = 0; f < FAM_COUNT; f++)
+                families[f] = strstr(optarg, family_names[f]) != NULL;
+            break;
+        case 'S': service = optarg; break;
+        case 'H': tcp_host = optarg; break;
+        case 'p': tcp_port = atoi(optarg); break;
+        case 't': secs = atof(optarg); break;
+        case 'T': tests = optarg; break;
+        case 'm': n_stream = parse_list(optarg, stream_sizes, MAX_SIZES); break;
+        case 'r': n_rr = parse_list(optarg, rr_sizes, MAX_SIZES); break;
+        case 'P': n_parallel = parse_list(optarg, parallel, MAX_SIZES); break;
+        case 'M': parallel_size = strtoul(optarg, NULL, 10); break;
+        case 'o': output_json = !strcmp(optarg, "json"); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || (server_only && client_only) || secs <= 0)
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* a remote run is AF_XEN unless told otherwise */
+    if (client_only && !family_given)
+        families[FAM_UNIX] = families[FAM_TCP] = 0;
+
+    if (!client_only) {
+        for (f = 0; f < FAM_COUNT; f++) {
+            pthread_t t;
+            int       lfd;
+
+            if (!families[f])
+                continue;
+            if ((lfd = start_server(f)) < 0) {
+                fprintf(stderr, "# %s: cannot listen (%s), skipped\n", family_names[f], strerror(errno));
+                families[f] = 0;
+                continue;
+            }
+            pthread_create(&t, NULL, accept_loop, (void *)(intptr_t)lfd);
+            pthread_detach(t);
+        }
+        if (server_only) {
+            fprintf(stderr, "# serving service %s, tcp port %d\n", service, tcp_port);
+            for (;;)
+                pause();
+        }
+    }
+
+    if (!output_json)
+        printf("family,test,msg_size,streams,secs,bytes,mib_per_sec,trans_per_sec,"
+               "rtt_mean_us,rtt_p50_us,rtt_p99_us,rtt_p999_us,"
+               "client_cpu_s_per_gb,server_cpu_s_per_gb\n");
+
+    for (f = 0; f < FAM_COUNT; f++) {
+        if (!families[f])
+            continue;
+        if (strstr(tests, "stream"))
+            for (i = 0; i < n_stream; i++)
+                if (run(f, "stream", TEST_STREAM, stream_sizes[i], 1, secs) < 0)
+                    goto next;
+        if (strstr(tests, "rr"))
+            for (i = 0; i < n_rr; i++)
+                if (run(f, "rr", TEST_RR, rr_sizes[i], 1, secs) < 0)
+                    goto next;
+        if (strstr(tests, "parallel"))
+            for (i = 0; i < n_parallel; i++)
+                if (parallel[i] > 0 && parallel[i] <= MAX_STREAMS &&
+                    run(f, "parallel", TEST_STREAM, parallel_size, parallel[i], secs) < 0)
+                    goto next;
+        continue;
+next:
+        fprintf(stderr, "# %s: run failed, skipping the rest of this family\n", family_names[f]);
+    }
+    return 0;
+}
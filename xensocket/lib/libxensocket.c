@@ -0,0 +1,438 @@
+/* libxensocket.c
+ *
+ * Userspace implementation of the XenSocket ring protocol over a memfd,
+ * with eventfds for doorbells.  See libxensocket.h.
+ *
+ * The copy, index and event handling follow xen_sendmsg(),
+ * xen_recvmsg(), notify_peer(), arm_receive_event() and
+ * arm_send_event() in xensocket.c, so that a change tried here carries
+ * over to the module as is.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "libxensocket.h"
+
+#define load_acquire(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define load_once(p)         __atomic_load_n((p), __ATOMIC_RELAXED)
+#define store_once(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define full_barrier()       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/************************************************************************
+ * Layout of the shared area.
+ *
+ * Descriptor of direction 0 (side 0 to side 1), descriptor of direction
+ * 1, then the ring of each direction.
+ ************************************************************************/
+
+static size_t area_size(unsigned int ring_size) {
+    return 2 * XS_PAGE_SIZE + 2 * (size_t)ring_size;
+}
+
+static void setup_rings(struct xs_channel *c, unsigned int ring_size) {
+    unsigned char  *base = c->area;
+    struct xs_ring *dir[2] = { &c->tx, &c->rx };
+    int             i;
+
+    /* side 0 sends on direction 0, side 1 on direction 1 */
+    if (c->side) {
+        dir[0] = &c->rx;
+        dir[1] = &c->tx;
+    }
+    for (i = 0; i < 2; i++) {
+        dir[i]->desc = (struct xs_desc *)(base + i * XS_PAGE_SIZE);
+        dir[i]->data = base + 2 * XS_PAGE_SIZE + (size_t)i * ring_size;
+        dir[i]->size = ring_size;
+    }
+}
+
+static void init_desc(struct xs_desc *d, unsigned int ring_size) {
+    memset(d, 0, sizeof(*d));
+    d->ring_version = XS_RING_MAGIC | XS_RING_VERSION;
+    d->ring_size = ring_size;
+    d->send_event = 0;
+    d->recv_event = 1;
+}
+
+/************************************************************************
+ * Channel setup.
+ ************************************************************************/
+
+int xs_channel_create(struct xs_channel *c, size_t ring_size) {
+    size_t size = XS_PAGE_SIZE;
+    int    err;
+
+    if (!ring_size || ring_size > (1U << 30)) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (size < ring_size)
+        size <<= 1;
+
+    memset(c, 0, sizeof(*c));
+    c->side = 0;
+    c->memfd = c->efd[0] = c->efd[1] = -1;
+    c->area = MAP_FAILED;
+
+    if ((c->memfd = memfd_create("xensocket", MFD_CLOEXEC)) < 0 ||
+        (c->efd[0] = eventfd(0, EFD_CLOEXEC)) < 0 ||
+        (c->efd[1] = eventfd(0, EFD_CLOEXEC)) < 0)
+        goto err;
+
+    c->area_size = area_size(size);
+    if (ftruncate(c->memfd, c->area_size) < 0)
+        goto err;
+    c->area = mmap(NULL, c->area_size, PROT_READ | PROT_WRITE, MAP_SHARED, c->memfd, 0);
+    if (c->area == MAP_FAILED)
+        goto err;
+
+    setup_rings(c, size);
+    init_desc(c->tx.desc, size);
+    init_desc(c->rx.desc, size);
+    return 0;
+
+err:
+    err = errno;
+    xs_channel_close(c);
+    errno = err;
+    return -1;
+}
+
+int xs_channel_attach(struct xs_channel *c, int memfd, int efd0, int efd1, int side) {
+    struct xs_desc *d;
+    struct stat     st;
+    int             err;
+
+    memset(c, 0, sizeof(*c));
+    c->side = !!side;
+    c->memfd = memfd;
+    c->efd[0] = efd0;
+    c->efd[1] = efd1;
+    c->area = MAP_FAILED;
+
+    if (fstat(memfd, &st) < 0)
+        goto err;
+    if ((size_t)st.st_size < 2 * XS_PAGE_SIZE) {
+        errno = EINVAL;
+        goto err;
+    }
+    c->area_size = st.st_size;
+    c->area = mmap(NULL, c->area_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (c->area == MAP_FAILED)
+        goto err;
+
+    /* check the creator's descriptor before trusting its size */
+    d = c->area;
+    if (d->ring_version != (XS_RING_MAGIC | XS_RING_VERSION) ||
+        d->ring_size < XS_PAGE_SIZE || (d->ring_size & (d->ring_size - 1)) ||
+        area_size(d->ring_size) != c->area_size) {
+        errno = EPROTO;
+        goto err;
+    }
+    setup_rings(c, d->ring_size);
+    return 0;
+
+err:
+    err = errno;
+    xs_channel_close(c);
+    errno = err;
+    return -1;
+}
+
+int xs_channel_send(struct xs_channel *c, int sock) {
+    int             fds[3] = { c->memfd, c->efd[0], c->efd[1] };
+    char            cbuf[CMSG_SPACE(sizeof(fds))];
+    char            byte = 0;
+    struct iovec    iov = { &byte, 1 };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+int xs_channel_recv(struct xs_channel *c, int sock) {
+    int             fds[3];
+    char            cbuf[CMSG_SPACE(sizeof(fds))];
+    char            byte;
+    struct iovec    iov = { &byte, 1 };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    return xs_channel_attach(c, fds[0], fds[1], fds[2], 1);
+}
+
+void xs_set_busy_poll(struct xs_channel *c, unsigned int usecs) {
+    c->busy_poll_usecs = usecs;
+}
+
+/************************************************************************
+ * Doorbells and notification suppression.
+ ************************************************************************/
+
+static void kick(struct xs_channel *c) {
+    uint64_t one = 1;
+
+    while (write(c->efd[!c->side], &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+/* Kick the peer if moving our index from @old_idx to @new_idx crossed
+ * the @event index it asked to be woken at.
+ */
+static void notify_peer(struct xs_channel *c, unsigned int new_idx, unsigned int old_idx, unsigned int event) {
+    if ((unsigned int)(new_idx - event) < (unsigned int)(new_idx - old_idx)) {
+        kick(c);
+        c->stats.notifications_sent++;
+    } else if (new_idx != old_idx) {
+        c->stats.notifications_avoided++;
+    }
+}
+
+static int sleep_on_doorbell(struct xs_channel *c) {
+    uint64_t count;
+
+    c->stats.waits++;
+    while (read(c->efd[c->side], &count, sizeof(count)) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static inline unsigned int ring_used(struct xs_ring *r) {
+    return load_acquire(&r->desc->prod) - load_acquire(&r->desc->cons);
+}
+
+static int is_readable(struct xs_ring *r) {
+    return ring_used(r) || load_acquire(&r->desc->sender_has_shutdown);
+}
+
+static int is_writeable(struct xs_ring *r) {
+    return ring_used(r) < r->size || load_acquire(&r->desc->force_sender_shutdown);
+}
+
+static int busy_poll(struct xs_channel *c, int (*ready)(struct xs_ring *), struct xs_ring *r) {
+    struct timespec start, now;
+
+    if (!c->busy_poll_usecs)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        if (ready(r))
+            return 1;
+        cpu_relax();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 < (long)c->busy_poll_usecs);
+    return 0;
+}
+
+/* Ask to be woken as soon as the sender publishes more data; rechecked
+ * after arming so that data sent before the sender saw the new event
+ * index is not missed.
+ */
+static int wait_readable(struct xs_channel *c) {
+    struct xs_ring *r = &c->rx;
+
+    while (!is_readable(r)) {
+        if (busy_poll(c, is_readable, r))
+            break;
+        store_once(&r->desc->recv_event, r->desc->cons + 1);
+        full_barrier();
+        if (is_readable(r))
+            break;
+        if (sleep_on_doorbell(c) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Ask to be woken once the receiver has drained a quarter of the ring,
+ * rather than on every byte it frees.
+ */
+static int wait_writeable(struct xs_channel *c) {
+    struct xs_ring *r = &c->tx;
+
+    while (!is_writeable(r)) {
+        if (busy_poll(c, is_writeable, r))
+            break;
+        store_once(&r->desc->send_event, load_acquire(&r->desc->cons) + (r->size >> 2));
+        full_barrier();
+        if (is_writeable(r))
+            break;
+        if (sleep_on_doorbell(c) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/************************************************************************
+ * Data transfer.
+ ************************************************************************/
+
+/* Copy into the ring at @off, wrapping around as xen_sendmsg() does */
+static void ring_put(struct xs_ring *r, unsigned int off, const unsigned char *src, unsigned int len) {
+    if (off + len > r->size) {
+        unsigned int seg1 = r->size - off;
+
+        memcpy(r->data + off, src, seg1);
+        memcpy(r->data, src + seg1, len - seg1);
+    } else {
+        memcpy(r->data + off, src, len);
+    }
+}
+
+static void ring_get(struct xs_ring *r, unsigned int off, unsigned char *dst, unsigned int len) {
+    if (off + len > r->size) {
+        unsigned int seg1 = r->size - off;
+
+        memcpy(dst, r->data + off, seg1);
+        memcpy(dst + seg1, r->data, len - seg1);
+    } else {
+        memcpy(dst, r->data + off, len);
+    }
+}
+
+ssize_t xs_send(struct xs_channel *c, const void *buf, size_t len, int flags) {
+    struct xs_ring *r = &c->tx;
+    struct xs_desc *d = r->desc;
+    size_t          sent = 0;
+
+    while (sent < len) {
+        unsigned int prod = d->prod;
+        unsigned int space = r->size - (prod - load_acquire(&d->cons));
+        unsigned int bytes;
+
+        if (load_once(&d->sender_has_shutdown) || load_acquire(&d->force_sender_shutdown)) {
+            if (sent)
+                break;
+            errno = EPIPE;
+            return -1;
+        }
+        if (!space) {
+            if (flags & XS_DONTWAIT) {
+                if (sent)
+                    break;
+                errno = EAGAIN;
+                return -1;
+            }
+            if (wait_writeable(c) < 0)
+                return sent ? (ssize_t)sent : -1;
+            continue;
+        }
+
+        bytes = len - sent < space ? len - sent : space;
+        ring_put(r, prod & (r->size - 1), (const unsigned char *)buf + sent, bytes);
+        store_release(&d->prod, prod + bytes);
+        full_barrier();   /* publish the producer index before reading recv_event */
+        notify_peer(c, prod + bytes, prod, load_once(&d->recv_event));
+        sent += bytes;
+    }
+    return sent;
+}
+
+ssize_t xs_recv(struct xs_channel *c, void *buf, size_t len, int flags) {
+    struct xs_ring *r = &c->rx;
+    struct xs_desc *d = r->desc;
+    unsigned int    cons = d->cons;
+    unsigned int    avail;
+    unsigned int    bytes;
+
+    if (!len)
+        return 0;
+
+    while (!(avail = load_acquire(&d->prod) - cons)) {
+        /* the sender publishes its last data before shutting down */
+        if (load_acquire(&d->sender_has_shutdown)) {
+            if ((avail = load_acquire(&d->prod) - cons))
+                break;
+            return 0;
+        }
+        if (flags & XS_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (wait_readable(c) < 0)
+            return -1;
+    }
+
+    bytes = len < avail ? len : avail;
+    ring_get(r, cons & (r->size - 1), buf, bytes);
+    store_release(&d->cons, cons + bytes);
+    full_barrier();   /* publish the consumer index before reading send_event */
+    notify_peer(c, cons + bytes, cons, load_once(&d->send_event));
+    return bytes;
+}
+
+void xs_shutdown(struct xs_channel *c) {
+    if (!c->tx.desc || load_once(&c->tx.desc->sender_has_shutdown))
+        return;
+    store_release(&c->tx.desc->sender_has_shutdown, 1);
+    kick(c);
+}
+
+void xs_channel_close(struct xs_channel *c) {
+    if (c->area != MAP_FAILED && c->area) {
+        /* wake a peer blocked on either direction; not if attaching
+         * failed before the rings were set up
+         */
+        if (c->tx.desc) {
+            store_release(&c->tx.desc->sender_has_shutdown, 1);
+            store_release(&c->rx.desc->force_sender_shutdown, 1);
+            if (c->efd[!c->side] >= 0)
+                kick(c);
+        }
+        munmap(c->area, c->area_size);
+    }
+    c->area = MAP_FAILED;
+    c->tx.desc = c->rx.desc = NULL;
+    if (c->memfd >= 0)
+        close(c->memfd);
+    if (c->efd[0] >= 0)
+        close(c->efd[0]);
+    if (c->efd[1] >= 0)
+        close(c->efd[1]);
+    c->memfd = c->efd[0] = c->efd[1] = -1;
+}
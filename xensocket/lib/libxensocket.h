@@ -0,0 +1,111 @@
+/* libxensocket.h
+ *
+ * Userspace implementation of the XenSocket ring protocol, for profiling
+ * and tuning the ring algorithms without loading the module.
+ *
+ * A channel is a full-duplex connection between two processes or
+ * threads.  As in the module, each direction has a descriptor page and a
+ * power-of-two ring, with the version 2 layout: a free-running producer
+ * index and consumer index, each alone on its own cache line, published
+ * with release and read with acquire ordering.  The four areas live in
+ * one memfd.  Each side has an eventfd that stands in for its end of the
+ * event channel, and the notification suppression of the module is kept:
+ * a side about to sleep publishes in recv_event or send_event the index
+ * at which it wants to be woken, and the other side only writes the
+ * eventfd when it moves its own index past that point.
+ *
+ * The side that calls xs_channel_create() is side 0.  The other side
+ * gets the memfd and both eventfds, by fork() or with xs_channel_send(),
+ * and calls xs_channel_attach() as side 1.
+ *
+ * Functions return -1 and set errno on failure, as the socket calls do.
+ */
+
+#ifndef __LIBXENSOCKET_H__
+#define __LIBXENSOCKET_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XS_PAGE_SIZE      4096
+#define XS_INDEX_ALIGN    128   /* keep adjacent-line prefetch apart too */
+#define XS_RING_MAGIC     0x58530000U
+#define XS_RING_VERSION   2
+
+/* One direction of a channel, as in struct descriptor_page. */
+struct xs_desc {
+    unsigned int    ring_version;  /* XS_RING_MAGIC | version */
+    unsigned int    ring_size;     /* bytes, a power of two */
+    unsigned int    send_event;    /* receiver signals when cons passes this */
+    unsigned int    recv_event;    /* sender signals when prod passes this */
+    int             sender_has_shutdown;
+    int             force_sender_shutdown;  /* the receiver has gone */
+    unsigned int    prod __attribute__((aligned(XS_INDEX_ALIGN)));  /* written by sender */
+    unsigned int    cons __attribute__((aligned(XS_INDEX_ALIGN)));  /* written by receiver */
+};
+
+struct xs_ring {
+    struct xs_desc *desc;
+    unsigned char  *data;
+    unsigned int    size;
+};
+
+struct xs_stats {
+    unsigned long   notifications_sent;
+    unsigned long   notifications_avoided;
+    unsigned long   waits;          /* times a call blocked on its eventfd */
+};
+
+struct xs_channel {
+    int             side;
+    int             memfd;
+    int             efd[2];         /* doorbell of each side */
+    void           *area;
+    size_t          area_size;
+    struct xs_ring  tx;
+    struct xs_ring  rx;
+    unsigned int    busy_poll_usecs;
+    struct xs_stats stats;
+};
+
+/* xs_send()/xs_recv() flags */
+#define XS_DONTWAIT    1
+
+/* Create a channel with rings of @ring_size bytes, rounded up to a power
+ * of two number of pages, and attach to it as side 0.
+ */
+int xs_channel_create (struct xs_channel *c, size_t ring_size);
+
+/* Attach to the channel in @memfd as @side, taking over the three fds. */
+int xs_channel_attach (struct xs_channel *c, int memfd, int efd0, int efd1, int side);
+
+/* Pass the channel to, or take it from, the other end of the AF_UNIX
+ * socket @sock.  The receiver attaches as side 1.
+ */
+int xs_channel_send (struct xs_channel *c, int sock);
+int xs_channel_recv (struct xs_channel *c, int sock);
+
+/* Spin this long for the peer before sleeping on the eventfd. */
+void xs_set_busy_poll (struct xs_channel *c, unsigned int usecs);
+
+/* Stream semantics, as on an AF_XEN SOCK_STREAM socket: xs_send() only
+ * returns early with XS_DONTWAIT, and xs_recv() returns what is there, 0
+ * once the peer has shut down and the ring is drained.
+ */
+ssize_t xs_send (struct xs_channel *c, const void *buf, size_t len, int flags);
+ssize_t xs_recv (struct xs_channel *c, void *buf, size_t len, int flags);
+
+/* Stop sending; the peer reads the rest and then end of file. */
+void xs_shutdown (struct xs_channel *c);
+
+void xs_channel_close (struct xs_channel *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBXENSOCKET_H__ */
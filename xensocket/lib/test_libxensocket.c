@@ -0,0 +1,328 @@
+/* test_libxensocket.c
+ *
+ * Unit tests for the userspace ring library: data and index wraparound,
+ * event-index notification suppression, XS_DONTWAIT on a full or empty
+ * ring, shutdown and close by the peer, and passing a channel over an
+ * AF_UNIX socket.  Both sides of a channel run in this process, as the
+ * benchmarks do; the blocking cases use a second thread.
+ *
+ * Usage: test_libxensocket    (or "make check")
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libxensocket.h"
+
+#define RING_SIZE    XS_PAGE_SIZE
+
+static int failures;
+
+#define CHECK(cond) do {                                                  \
+        if (!(cond)) {                                                    \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n",              \
+                    __FILE__, __LINE__, __func__, #cond);                 \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+/* Side 0 in @a, side 1 in @b, as after a fork() */
+static void open_pair(struct xs_channel *a, struct xs_channel *b) {
+    if (xs_channel_create(a, RING_SIZE) < 0 ||
+        xs_channel_attach(b, fcntl(a->memfd, F_DUPFD_CLOEXEC, 0),
+                          fcntl(a->efd[0], F_DUPFD_CLOEXEC, 0),
+                          fcntl(a->efd[1], F_DUPFD_CLOEXEC, 0), 1) < 0) {
+        perror("open_pair");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void close_pair(struct xs_channel *a, struct xs_channel *b) {
+    xs_channel_close(a);
+    xs_channel_close(b);
+}
+
+static void fill_pattern(unsigned char *buf, size_t len, unsigned int seed) {
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (unsigned char)(seed + i * 7);
+}
+
+/* Spin until @p reads @v, as set by a thread about to block */
+static void wait_for(const unsigned int *p, unsigned int v) {
+    while (__atomic_load_n(p, __ATOMIC_ACQUIRE) != v)
+        usleep(100);
+}
+
+/************************************************************************
+ * Tests.
+ ************************************************************************/
+
+static void test_create_rounds_up(void) {
+    struct xs_channel a;
+
+    CHECK(xs_channel_create(&a, 5000) == 0);
+    CHECK(a.tx.size == 2 * XS_PAGE_SIZE && a.rx.size == 2 * XS_PAGE_SIZE);
+    xs_channel_close(&a);
+
+    errno = 0;
+    CHECK(xs_channel_create(&a, 0) < 0 && errno == EINVAL);
+}
+
+static void test_attach_rejects_foreign_memfd(void) {
+    struct xs_channel c;
+    int               fd = memfd_create("not-a-channel", MFD_CLOEXEC);
+
+    CHECK(fd >= 0 && ftruncate(fd, 4 * XS_PAGE_SIZE) == 0);
+    errno = 0;
+    CHECK(xs_channel_attach(&c, fd, -1, -1, 1) < 0 && errno == EPROTO);
+}
+
+static void test_both_directions(void) {
+    struct xs_channel a, b;
+    char              buf[16];
+
+    open_pair(&a, &b);
+    CHECK(xs_send(&a, "ping", 4, 0) == 4);
+    CHECK(xs_recv(&b, buf, sizeof(buf), 0) == 4 && !memcmp(buf, "ping", 4));
+    CHECK(xs_send(&b, "pong", 4, 0) == 4);
+    CHECK(xs_recv(&a, buf, sizeof(buf), 0) == 4 && !memcmp(buf, "pong", 4));
+    close_pair(&a, &b);
+}
+
+/* Messages that straddle the end of the ring come out whole */
+static void test_data_wraparound(void) {
+    struct xs_channel a, b;
+    unsigned char     in[1000], out[1000];
+    unsigned int      i;
+
+    open_pair(&a, &b);
+    for (i = 0; i < 3 * RING_SIZE / sizeof(in); i++) {
+        fill_pattern(in, sizeof(in), i);
+        CHECK(xs_send(&a, in, sizeof(in), XS_DONTWAIT) == sizeof(in));
+        CHECK(xs_recv(&b, out, sizeof(out), XS_DONTWAIT) == sizeof(out));
+        CHECK(!memcmp(in, out, sizeof(in)));
+    }
+    CHECK(a.tx.desc->prod == 3 * RING_SIZE / sizeof(in) * sizeof(in));
+    close_pair(&a, &b);
+}
+
+/* The free-running indices wrap at 2^32 without losing track of the
+ * space and data in the ring
+ */
+static void test_index_wraparound(void) {
+    struct xs_channel a, b;
+    unsigned char     in[RING_SIZE], out[RING_SIZE];
+    unsigned int      start = 0xffffffffU - RING_SIZE / 2;
+    unsigned int      i;
+
+    open_pair(&a, &b);
+    a.tx.desc->prod = a.tx.desc->cons = start;
+    a.tx.desc->recv_event = start + 1;
+
+    for (i = 0; i < 4; i++) {
+        fill_pattern(in, sizeof(in), i);
+        CHECK(xs_send(&a, in, sizeof(in), XS_DONTWAIT) == sizeof(in));
+        /* full: no space is left even though prod < cons numerically */
+        CHECK(xs_send(&a, in, 1, XS_DONTWAIT) < 0 && errno == EAGAIN);
+        CHECK(xs_recv(&b, out, sizeof(out), XS_DONTWAIT) == sizeof(out));
+        CHECK(!memcmp(in, out, sizeof(in)));
+        CHECK(xs_recv(&b, out, 1, XS_DONTWAIT) < 0 && errno == EAGAIN);
+    }
+    CHECK(a.tx.desc->prod == start + 4 * RING_SIZE);
+    CHECK(a.tx.desc->prod < start);
+    close_pair(&a, &b);
+}
+
+static void test_dontwait(void) {
+    struct xs_channel a, b;
+    unsigned char     buf[RING_SIZE + 100];
+
+    open_pair(&a, &b);
+    errno = 0;
+    CHECK(xs_recv(&b, buf, 1, XS_DONTWAIT) < 0 && errno == EAGAIN);
+
+    /* a partial send reports what fit, the next one EAGAIN */
+    CHECK(xs_send(&a, buf, sizeof(buf), XS_DONTWAIT) == RING_SIZE);
+    errno = 0;
+    CHECK(xs_send(&a, buf, 1, XS_DONTWAIT) < 0 && errno == EAGAIN);
+
+    CHECK(xs_recv(&b, buf, 100, XS_DONTWAIT) == 100);
+    CHECK(xs_send(&a, buf, sizeof(buf), XS_DONTWAIT) == 100);
+    CHECK(xs_recv(&b, buf, sizeof(buf), XS_DONTWAIT) == RING_SIZE);
+    close_pair(&a, &b);
+}
+
+struct blocked {
+    struct xs_channel *c;
+    size_t             len;
+    ssize_t            rc;
+    int                err;
+    unsigned char      buf[RING_SIZE];
+};
+
+static void *blocked_recv(void *arg) {
+    struct blocked *t = arg;
+
+    t->rc = xs_recv(t->c, t->buf, t->len, 0);
+    t->err = errno;
+    return NULL;
+}
+
+static void *blocked_send(void *arg) {
+    struct blocked *t = arg;
+
+    t->rc = xs_send(t->c, t->buf, t->len, 0);
+    t->err = errno;
+    return NULL;
+}
+
+/* The sender only rings the doorbell when the receiver asked for it */
+static void test_receive_suppression(void) {
+    struct xs_channel a, b;
+    struct blocked    t = { &b, 16 };
+    pthread_t         thread;
+    char              buf[16];
+
+    open_pair(&a, &b);
+
+    /* the first byte crosses the initial recv_event; later ones do not */
+    CHECK(xs_send(&a, "x", 1, 0) == 1);
+    CHECK(a.stats.notifications_sent == 1);
+    CHECK(xs_send(&a, "y", 1, 0) == 1);
+    CHECK(xs_send(&a, "z", 1, 0) == 1);
+    CHECK(a.stats.notifications_sent == 1 && a.stats.notifications_avoided == 2);
+    CHECK(xs_recv(&b, buf, sizeof(buf), 0) == 3);
+
+    /* a sleeping receiver arms recv_event at cons + 1 and is woken */
+    pthread_create(&thread, NULL, blocked_recv, &t);
+    wait_for(&b.rx.desc->recv_event, b.rx.desc->cons + 1);
+    CHECK(xs_send(&a, "w", 1, 0) == 1);
+    pthread_join(thread, NULL);
+    CHECK(t.rc == 1 && t.buf[0] == 'w');
+    CHECK(a.stats.notifications_sent == 2);
+    close_pair(&a, &b);
+}
+
+/* A sender blocked on a full ring is woken once a quarter of it has been
+ * drained, not for every read
+ */
+static void test_send_suppression(void) {
+    struct xs_channel a, b;
+    struct blocked    t = { &a, 1 };
+    pthread_t         thread;
+    unsigned char     buf[RING_SIZE];
+    unsigned long     sent;
+
+    open_pair(&a, &b);
+    CHECK(xs_send(&a, buf, RING_SIZE, XS_DONTWAIT) == RING_SIZE);
+
+    pthread_create(&thread, NULL, blocked_send, &t);
+    wait_for(&a.tx.desc->send_event, RING_SIZE / 4);
+
+    sent = b.stats.notifications_sent;
+    CHECK(xs_recv(&b, buf, RING_SIZE / 8, 0) == RING_SIZE / 8);
+    CHECK(b.stats.notifications_sent == sent);
+    CHECK(xs_recv(&b, buf, RING_SIZE / 8, 0) == RING_SIZE / 8);
+    CHECK(b.stats.notifications_sent == sent + 1);
+
+    pthread_join(thread, NULL);
+    CHECK(t.rc == 1);
+    CHECK(a.stats.waits >= 1);
+    close_pair(&a, &b);
+}
+
+/* After xs_shutdown() the receiver drains what is left, then reads end
+ * of file; the shut down side can no longer send
+ */
+static void test_shutdown(void) {
+    struct xs_channel a, b;
+    char              buf[16];
+
+    open_pair(&a, &b);
+    CHECK(xs_send(&a, "last", 4, 0) == 4);
+    xs_shutdown(&a);
+    CHECK(xs_recv(&b, buf, 2, 0) == 2);
+    CHECK(xs_recv(&b, buf, sizeof(buf), 0) == 2 && !memcmp(buf, "st", 2));
+    CHECK(xs_recv(&b, buf, sizeof(buf), 0) == 0);
+    CHECK(xs_recv(&b, buf, sizeof(buf), XS_DONTWAIT) == 0);
+
+    errno = 0;
+    CHECK(xs_send(&a, "x", 1, 0) < 0 && errno == EPIPE);
+    /* the other direction is still open */
+    CHECK(xs_send(&b, "ok", 2, 0) == 2);
+    CHECK(xs_recv(&a, buf, sizeof(buf), 0) == 2);
+    close_pair(&a, &b);
+}
+
+/* Closing one side wakes the other, whether it waits to read or to write */
+static void test_peer_close(void) {
+    struct xs_channel a, b;
+    struct blocked    r = { &b, 16 }, s = { &b, 1 };
+    pthread_t         thread;
+    unsigned char     buf[RING_SIZE];
+
+    open_pair(&a, &b);
+    pthread_create(&thread, NULL, blocked_recv, &r);
+    wait_for(&b.rx.desc->recv_event, b.rx.desc->cons + 1);
+    xs_channel_close(&a);
+    pthread_join(thread, NULL);
+    CHECK(r.rc == 0);
+    xs_channel_close(&b);
+
+    open_pair(&a, &b);
+    CHECK(xs_send(&b, buf, RING_SIZE, XS_DONTWAIT) == RING_SIZE);
+    pthread_create(&thread, NULL, blocked_send, &s);
+    wait_for(&b.tx.desc->send_event, RING_SIZE / 4);
+    xs_channel_close(&a);
+    pthread_join(thread, NULL);
+    CHECK(s.rc < 0 && s.err == EPIPE);
+    xs_channel_close(&b);
+}
+
+static void test_pass_over_socket(void) {
+    struct xs_channel a, b;
+    int               sv[2];
+    char              buf[16];
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CHECK(xs_channel_create(&a, RING_SIZE) == 0);
+    CHECK(xs_channel_send(&a, sv[0]) == 0);
+    CHECK(xs_channel_recv(&b, sv[1]) == 0);
+    CHECK(b.side == 1);
+    CHECK(xs_send(&b, "hi", 2, 0) == 2);
+    CHECK(xs_recv(&a, buf, sizeof(buf), 0) == 2 && !memcmp(buf, "hi", 2));
+    close_pair(&a, &b);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(void) {
+    test_create_rounds_up();
+    test_attach_rejects_foreign_memfd();
+    test_both_directions();
+    test_data_wraparound();
+    test_index_wraparound();
+    test_dontwait();
+    test_receive_suppression();
+    test_send_suppression();
+    test_shutdown();
+    test_peer_close();
+    test_pass_over_socket();
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,127 @@
+/* mmapclose.c
+ *
+ * Closes a connecting socket while its rings are still mapped, then
+ * checks that the stale mapping cannot reach a later connection: the
+ * old tx ring is filled with garbage and the index pages are read, while
+ * a new connection to the same service, which would get the pooled
+ * rings if they had gone back on close(), carries a message intact.
+ * After munmap() a third connection must work as usual.
+ *
+ * Listener and connector run in this process, so this needs the module
+ * with its same-domain path or the loopback backend.
+ *
+ * Usage: mmapclose [service]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../xensocket.h"
+
+static struct sockaddr_xe addr;
+static int                listener;
+
+static void fail(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/* Echo every accepted connection back until it closes */
+static void *serve(void *arg) {
+    for (;;) {
+        char    buf[256];
+        ssize_t n;
+        int     fd = accept(listener, NULL, NULL);
+
+        if (fd < 0)
+            return NULL;
+        while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+            send(fd, buf, n, 0);
+        close(fd);
+    }
+}
+
+static int connect_service(void) {
+    int fd = socket(AF_XEN, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        fail("socket");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        fail("connect");
+    return fd;
+}
+
+/* 0 if "hello" makes the round trip unharmed */
+static int round_trip(int fd) {
+    char buf[16] = { 0 };
+    int  got = 0;
+
+    if (send(fd, "hello", 5, 0) != 5)
+        return -1;
+    while (got < 5) {
+        int n = recv(fd, buf + got, 5 - got, 0);
+
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return memcmp(buf, "hello", 5);
+}
+
+int main(int argc, char **argv) {
+    struct xen_ring_map map;
+    socklen_t           len = sizeof(map);
+    unsigned char      *tx, *idx;
+    pthread_t           t;
+    int                 fd, fd2, fd3;
+
+    addr.sxe_family = AF_XEN;
+    strncpy(addr.service, argc > 1 ? argv[1] : "mmapclose", sizeof(addr.service) - 1);
+
+    if ((listener = socket(AF_XEN, SOCK_STREAM, 0)) < 0)
+        fail("socket");
+    bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+    if (listen(listener, 4) < 0)
+        fail("listen");
+    pthread_create(&t, NULL, serve, NULL);
+
+    fd = connect_service();
+    if (getsockopt(fd, SOL_XEN, XEN_RING_MAP, &map, &len) < 0)
+        fail("getsockopt(XEN_RING_MAP)");
+    tx = mmap(NULL, map.tx_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, XEN_MMAP_TX_RING);
+    idx = mmap(NULL, 2 * 4096, PROT_READ, MAP_SHARED, fd, XEN_MMAP_INDEX);
+    if (tx == MAP_FAILED || idx == MAP_FAILED)
+        fail("mmap");
+
+    /* close with both mappings alive */
+    close(fd);
+    printf("closed with the rings mapped\n");
+
+    fd2 = connect_service();
+    memset(tx, 0xaa, map.tx_size);
+    printf("stale index page reads %08x\n", *(volatile unsigned int *)(idx + map.tx_prod));
+    if (round_trip(fd2) != 0) {
+        printf("FAIL: the stale mapping reached a new connection\n");
+        return EXIT_FAILURE;
+    }
+    close(fd2);
+
+    munmap(tx, map.tx_size);
+    munmap(idx, 2 * 4096);
+    fd3 = connect_service();
+    if (round_trip(fd3) != 0) {
+        printf("FAIL: connection after munmap()\n");
+        return EXIT_FAILURE;
+    }
+    close(fd3);
+
+    printf("PASS\n");
+    return 0;
+}
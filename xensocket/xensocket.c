@@ -16,6 +16,23 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/delay.h>
+#include <linux/errqueue.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/highmem.h>
+#include <linux/idr.h>
+#include <linux/interrupt.h>
+#include <linux/irq_work.h>
+#include <linux/jhash.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 
 #include <net/compat.h>
@@ -24,15 +41,19 @@
 
 //#include <xen/driver_util.h>
 //#include <xen/gnttab.h>
-#include <xen/events.h>
 #include <xen/grant_table.h>
 #include <xen/interface/event_channel.h>
 #include <xen/interface/grant_table.h>
 #include <xen/interface/xen.h>
-#include <xen/evtchn.h>
 #include <xen/xenbus.h>
 
+#ifdef CONFIG_XEN
+#include <xen/events.h>
+#include <xen/evtchn.h>
+#include <xen/xen.h>
+
 #include <asm/xen/page.h>
+#endif
 
 #include "xensocket.h"
 
@@ -49,60 +70,315 @@
 #define TRACE_ERROR printk(KERN_CRIT "Exiting (ERROR) %s\n", __func__)
 
 struct descriptor_page;
+struct xen_ring;
 struct xen_sock;
+struct xen_pool_entry;
+struct xen_bulk;
+struct xen_queue;
+struct xen_ctrl;
 
 static void initialize_descriptor_page (struct descriptor_page *d);
+static void initialize_xen_ring (struct xen_ring *r);
 static void initialize_xen_sock (struct xen_sock *x);
 
 static int xen_create (struct net *net, struct socket *sock, int protocol, int kern);
 static int xen_bind (struct socket *sock, struct sockaddr *uaddr, int addr_len);
 static int xen_release (struct socket *sock);
+static void xen_release_sock (struct sock *sk);
 static int xen_shutdown (struct socket *sock, int how);
 static int xen_connect (struct socket *sock, struct sockaddr *uaddr, int addr_len, int flags);
 static int xen_sendmsg (struct socket *sock, struct msghdr *m, size_t len);
 static int xen_recvmsg (struct socket *sock, struct msghdr *m, size_t size, int flags);
+static int xen_seqpacket_sendmsg (struct socket *sock, struct msghdr *m, size_t len);
+static int xen_seqpacket_recvmsg (struct socket *sock, struct msghdr *m, size_t size, int flags);
 static int xen_accept (struct socket *sock, struct socket *newsock, int flags);
 static int xen_getname(struct socket *sock, struct sockaddr *addr, int *sockaddr_len, int peer);
 static int xen_listen (struct socket *sock, int backlog);
-
-static void xen_watch_accept(struct xenbus_watch *xbw, const char **vec, unsigned int len);
+static unsigned int xen_poll (struct file *file, struct socket *sock, poll_table *wait);
+static int xen_setsockopt (struct socket *sock, int level, int optname, char __user *optval, unsigned int optlen);
+static int xen_getsockopt (struct socket *sock, int level, int optname, char __user *optval, int __user *optlen);
+static int xen_ring_order (struct xen_sock *x, int for_tx);
+static int xen_mmap (struct file *file, struct socket *sock, struct vm_area_struct *vma);
+static int xen_ioctl (struct socket *sock, unsigned int cmd, unsigned long arg);
+static int xen_send_bulk (struct xen_sock *x, struct msghdr *msg, size_t len, long *timeo, u32 zc_id, int *zc_deferred);
+static void xen_zerocopy_work (struct work_struct *work);
+static int xen_recv_bulk (struct xen_sock *x, struct msghdr *msg, size_t size);
+static void xen_bulk_release (struct xen_sock *x);
+static ssize_t xen_sendpage (struct socket *sock, struct page *page, int offset, size_t size, int flags);
+static ssize_t xen_splice_read (struct socket *sock, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+
+static void xen_accept_work (struct work_struct *work);
+static int xen_accept_full (struct xen_sock *x);
+static int xen_accept_one (struct xen_sock *x, int gref, domid_t domid);
+static void xen_accept_queue_purge (struct xen_sock *x);
 static void xen_watch_connect(struct xenbus_watch *xbw, const char **vec, unsigned int len);
-static int server_allocate_descriptor_page (struct xen_sock *x);
-static int server_allocate_event_channel (struct xen_sock *x);
-static int server_allocate_buffer_pages (struct xen_sock *x);
-static int client_map_descriptor_page (struct xen_sock *x);
-static int client_bind_event_channel (struct xen_sock *x);
-static int client_map_buffer_pages (struct xen_sock *x);
-static inline int is_writeable (struct descriptor_page *d);
-static long send_data_wait (struct sock *sk, long timeo);
+static int xen_connect_abort (struct xen_sock *x);
+static void xen_connect_refuse_work (struct work_struct *work);
+static void xen_connect_withdraw_refused (struct xen_sock *x);
+static void xen_watch_listen(struct xenbus_watch *xbw, const char **vec, unsigned int len);
+static int server_allocate_descriptor_page (domid_t otherend_id, struct xen_ring *r);
+static int server_allocate_event_channel (struct xen_pool_entry *e);
+static int server_allocate_buffer_pages (domid_t otherend_id, struct xen_ring *r, int order);
+static struct xen_pool_entry *xen_pool_take (struct xen_sock *x, int version, int tx_order, int rx_order);
+static void xen_sock_detach_pool_entry (struct xen_sock *x);
+static void xen_sock_abandon_pool_entry (struct xen_sock *x);
+static int client_map_descriptor_page (struct xen_sock *x, struct xen_ring *r);
+static int client_bind_event_channel (struct xen_sock *x, struct xen_ring *rx, struct xen_ring *tx, unsigned int *irq);
+static int xen_connect_queues (struct xen_sock *x, int version);
+static int xen_accept_queues (struct xen_sock *x);
+static void xen_unmap_queues (struct xen_sock *x);
+static void xen_follow_reader (struct xen_sock *x, int q);
+static void unbind_evtchn_irq (unsigned int irq, void *dev_id);
+static int xen_service_lookup (const char *name, int *domid, int *version, int *type, int *flags);
+static void xen_service_init (void);
+static void xen_service_exit (void);
+static void xen_setup_account (int phase, u64 ns);
+static void xen_setup_init (void);
+static void xen_setup_exit (void);
+static struct xen_ctrl *xen_ctrl_get (domid_t otherend_id);
+static void xen_ctrl_put (struct xen_ctrl *c);
+static int xen_ctrl_connect (struct xen_sock *x, struct xen_ctrl *c, const char *service);
+static int xen_ctrl_withdraw (struct xen_sock *x);
+static void xen_ctrl_listen (struct xen_sock *x);
+static void xen_ctrl_unlisten (struct xen_sock *x);
+static void xen_ctrl_accept_requests (struct xen_sock *x);
+static int xen_service_flags (void);
+static void xen_ctrl_init (void);
+static void xen_ctrl_exit (void);
+static void xen_sock_event (struct xen_sock *x, int irq);
+static void xen_defer_cancel (struct xen_sock *x);
+static void xen_defer_revive (struct xen_sock *x);
+static int client_map_buffer_pages (struct xen_sock *x, struct xen_ring *r);
+static inline int is_writeable (struct xen_ring *r);
+static long send_data_wait (struct sock *sk, struct xen_ring *r, long timeo);
 static irqreturn_t client_interrupt (int irq, void *dev_id);
-static inline int is_readable (struct descriptor_page *d);
+static inline int is_readable (struct xen_ring *r);
 static long receive_data_wait (struct sock *sk, long timeo);
 static irqreturn_t server_interrupt (int irq, void *dev_id);
-static int local_memcpy_toiovecend (const struct iovec *iov, unsigned char *kdata, int offset, int len);
-static void server_unallocate_buffer_pages (struct xen_sock *x);
-static void server_unallocate_descriptor_page (struct xen_sock *x);
-static void client_unmap_buffer_pages (struct xen_sock *x);
-static void client_unmap_descriptor_page (struct xen_sock *x);
+static void xen_sock_wake (struct sock *sk);
+static void server_unallocate_buffer_pages (struct xen_ring *r);
+static void server_unallocate_descriptor_page (struct xen_ring *r);
+static void client_unmap_buffer_pages (struct xen_ring *r);
+static void client_unmap_descriptor_page (struct xen_ring *r);
 static int __init xensocket_init (void);
 static void __exit xensocket_exit (void);
 
+/************************************************************************
+ * Backend interface.
+ *
+ * Everything the module needs from Xen goes through the backend: grant
+ * references and the mapping and copying of granted pages, event
+ * channels and their irqs, and the xenstore tree that addresses are
+ * looked up in.  The Xen backend passes each call on to Xen; the
+ * loopback backend emulates them within one kernel.  See the backend
+ * implementations near the end of this file.
+ ************************************************************************/
+
+struct xensocket_backend {
+	const char     *name;
+	int   (*init)(void);
+	void  (*exit)(void);
+
+	/* Granting our own pages.  A page is named by its frame, and
+	 * claim_grefs() takes either all @count references or none.
+	 */
+	unsigned long (*frame)(struct page *page);
+	int   (*claim_grefs)(domid_t domid, int count, int *grefs);
+	void  (*grant_ref)(int gref, domid_t domid, unsigned long frame, int readonly);
+	int   (*end_grant)(int gref, int readonly);    /* 1 if ended, 0 if still in use */
+	void  (*end_grant_page)(int gref, int readonly, unsigned long page);
+
+	/* Using the peer's pages.  map() returns where they are mapped or
+	 * an ERR_PTR, in which case nothing is left mapped.
+	 */
+	void *(*map)(domid_t domid, const int *grefs, int count, int readonly, grant_handle_t *handles, void **area);
+	void  (*unmap)(void *addr, void *area, grant_handle_t *handles, int count);
+	void  (*copy)(struct gnttab_copy *ops, unsigned int count);
+
+	/* Event channels.  Irqs returned by bind_irq() are only good for
+	 * the calls below.
+	 */
+	int   (*alloc_evtchn)(domid_t domid, unsigned int *port);
+	int   (*bind_evtchn)(domid_t domid, unsigned int remote_port, unsigned int *port);
+	int   (*evtchn_unbound)(unsigned int port);
+	int   (*bind_irq)(unsigned int port, irq_handler_t handler, const char *name, void *dev_id);
+	void  (*unbind_irq)(unsigned int irq, void *dev_id);
+	void  (*notify)(unsigned int port);
+	void  (*mask_irq)(unsigned int irq);
+	void  (*unmask_irq)(unsigned int irq);
+	int   (*set_irq_cpu)(unsigned int irq, int cpu);  /* -1 drops the hint */
+	void  (*sync_irq)(unsigned int irq);
+
+	/* The store, with the semantics of the xenbus calls. */
+	int   (*transaction_start)(struct xenbus_transaction *t);
+	int   (*transaction_end)(struct xenbus_transaction t, int abort);
+	void *(*read)(struct xenbus_transaction t, const char *dir, const char *node, unsigned int *len);
+	int   (*write)(struct xenbus_transaction t, const char *dir, const char *node, const char *string);
+	int   (*rm)(struct xenbus_transaction t, const char *dir, const char *node);
+	int   (*exists)(struct xenbus_transaction t, const char *dir, const char *node);
+	char **(*directory)(struct xenbus_transaction t, const char *dir, const char *node, unsigned int *num);
+	int   (*register_watch)(struct xenbus_watch *watch);
+	void  (*unregister_watch)(struct xenbus_watch *watch);
+};
+
+static const struct xensocket_backend *backend;
+
+
+/* Grant one page, like gnttab_grant_foreign_access(). */
+static int
+grant_page (domid_t domid, unsigned long frame, int readonly) {
+	int gref;
+
+	if (backend->claim_grefs(domid, 1, &gref) < 0) {
+		return -ENOSPC;
+	}
+	backend->grant_ref(gref, domid, frame, readonly);
+	return gref;
+}
+
+static unsigned long
+virt_to_frame (void *addr) {
+	return backend->frame(virt_to_page(addr));
+}
+
+
+/* Like xenbus_scanf(), through the backend's store. */
+static __scanf(4, 5) int
+store_scanf (struct xenbus_transaction t, const char *dir, const char *node, const char *fmt, ...) {
+	va_list ap;
+	char *val;
+	int rc;
+
+	val = backend->read(t, dir, node, NULL);
+	if (IS_ERR(val)) {
+		return PTR_ERR(val);
+	}
+
+	va_start(ap, fmt);
+	rc = vsscanf(val, fmt, ap);
+	va_end(ap);
+	kfree(val);
+
+	return rc ? rc : -ERANGE;
+}
+
+/* Like xenbus_printf(), through the backend's store. */
+static __printf(4, 5) int
+store_printf (struct xenbus_transaction t, const char *dir, const char *node, const char *fmt, ...) {
+	va_list ap;
+	char *val;
+	int rc;
+
+	va_start(ap, fmt);
+	val = kvasprintf(GFP_NOIO | __GFP_HIGH, fmt, ap);
+	va_end(ap);
+	if (!val) {
+		return -ENOMEM;
+	}
+
+	rc = backend->write(t, dir, node, val);
+	kfree(val);
+
+	return rc;
+}
+
 /************************************************************************
  * Data structures for internal recordkeeping and shared memory.
  ************************************************************************/
 
+/* struct descriptor_page:
+ *
+ * One descriptor page describes one direction of a connection.  The
+ * connecting side grants two of them: the forward ring (connector to
+ * acceptor), whose gref is published in xenstore, and the reverse ring
+ * (acceptor to connector), whose gref is stored in the forward
+ * descriptor.  The event channel is shared by both directions.
+ *
+ * Protocol version 1 tracks the ring with send_offset/recv_offset, the
+ * byte totals and the avail_bytes atomic, all of which sit on one cache
+ * line written by both domains on every operation.  Version 2 instead
+ * uses a free-running producer index and consumer index, each alone on
+ * its own cache line and written only by its owner, published with
+ * release and read with acquire ordering.  The ring size is always a
+ * power of two, so v2 offsets are the indices masked by size - 1.
+ *
+ * The listener advertises its highest version next to its domid in
+ * xenstore; the connector picks the version for both rings and stores it
+ * in ring_version before publishing the descriptor.  Version 1 is the
+ * full-duplex layout below; the original one-way xensocket shares only
+ * the first few fields with it.  Peers that predate versioning, whose
+ * pages do not carry XENSOCKET_RING_MAGIC and whose service nodes hold
+ * only a domid, are refused rather than misread.
+ *
+ * Version 3 adds bulk transfers: instead of pushing a large send through
+ * the ring, the sender grants the user pages holding it, lists their
+ * grefs in its bulk list page and posts the transfer with the bulk_*
+ * fields; the receiver pulls the data with grant copies and reports
+ * progress in bulk_done.  A transfer is only posted while the ring is
+ * empty and the ring is not written again until it completes, so the
+ * byte stream keeps its order.  Both ends update bulk_done with
+ * compare-and-swap: the receiver to commit what it copied, the sender
+ * to withdraw the rest of a transfer by moving bulk_done up to
+ * bulk_posted.  A copy that loses that race is discarded.
+ *
+ * Version 4 adds multi-queue connections.  The connector may grant up to
+ * XENSOCKET_MAX_QUEUES ring pairs, each with its own event channel; the
+ * forward descriptor of the first pair lists the forward descriptor
+ * grefs of the others in queue_grefs and their number in queue_count.
+ * Records keep their order within a queue, not across queues.
+ */
+#define XENSOCKET_RING_MAGIC       0x58530000U
+#define XENSOCKET_RING_V1          1
+#define XENSOCKET_RING_V2          2
+#define XENSOCKET_RING_V3          3  /* v2 plus bulk transfer by grant copy */
+#define XENSOCKET_RING_V4          4  /* v3 plus multiple queues */
+#define XENSOCKET_RING_VERSION     XENSOCKET_RING_V4
+#define XENSOCKET_INDEX_ALIGN      128  /* keep adjacent-line prefetch apart too */
+
+/* flags after the socket type in a service node */
+#define XEN_SERVICE_CONTROL     1       /* takes requests over control channels */
+
+/* Version 2 rings list their buffer grefs in indirect pages rather than
+ * chaining them through the buffer pages themselves.
+ */
+#define XENSOCKET_GREFS_PER_PAGE   (PAGE_SIZE / sizeof(int))
+#define XENSOCKET_MAX_INDIRECT     8
+
+/* Sized so that the version 4 fields still end before prod. */
+#define XENSOCKET_MAX_QUEUES       8
+
 struct descriptor_page {
 	uint32_t        server_evtchn_port;
 	int             buffer_order; /* num_pages = (1 << buffer_order) */
 	int             buffer_first_gref;
+	int             reverse_descriptor_gref; /* forward descriptor only */
 	unsigned int    send_offset;
 	unsigned int    recv_offset;
 	unsigned int    total_bytes_sent;
 	unsigned int    total_bytes_received;
-	unsigned int    sender_is_blocking;
+	unsigned int    send_event;   /* receiver signals when total_bytes_received passes this */
+	unsigned int    recv_event;   /* sender signals when total_bytes_sent passes this */
 	atomic_t        avail_bytes;
 	atomic_t        sender_has_shutdown;
 	atomic_t        force_sender_shutdown;
+	uint32_t        ring_version; /* XENSOCKET_RING_MAGIC | version */
+	/* version 2 only */
+	int             buffer_indirect_count;
+	int             buffer_indirect_grefs[XENSOCKET_MAX_INDIRECT];
+	/* version 3 only */
+	int             bulk_list_gref;
+	/* version 4 only, forward descriptor of the first queue */
+	int             queue_count;
+	int             queue_grefs[XENSOCKET_MAX_QUEUES - 1];
+	unsigned int    prod __aligned(XENSOCKET_INDEX_ALIGN); /* written by sender */
+	unsigned int    bulk_posted;  /* free-running bytes posted, written by sender */
+	unsigned int    bulk_len;     /* current transfer: bytes */
+	unsigned int    bulk_offset;  /* current transfer: offset into first page */
+	unsigned int    bulk_pages;   /* current transfer: grefs in the list page */
+	atomic_t        unmapped;     /* set by the accepting side as it unmaps the page */
+	unsigned int    cons __aligned(XENSOCKET_INDEX_ALIGN); /* written by receiver */
+	unsigned int    bulk_done;    /* free-running bytes pulled, written by receiver */
+	unsigned int    bulk_refused; /* receiver has the ring mmapped: post no bulk transfers */
 };
 
 	static void
@@ -111,36 +387,343 @@ initialize_descriptor_page (struct descriptor_page *d)
 	d->server_evtchn_port = -1;
 	d->buffer_order = -1;
 	d->buffer_first_gref = -ENOSPC;
+	d->reverse_descriptor_gref = -ENOSPC;
 	d->send_offset = 0;
 	d->recv_offset = 0;
 	d->total_bytes_sent = 0;
 	d->total_bytes_received = 0;
-	d->sender_is_blocking = 0;
+	d->send_event = 0;
+	d->recv_event = 1;
 	atomic_set(&d->avail_bytes, 0);
 	atomic_set(&d->sender_has_shutdown, 0);
 	atomic_set(&d->force_sender_shutdown, 0);
+	atomic_set(&d->unmapped, 0);
+	d->ring_version = XENSOCKET_RING_MAGIC | XENSOCKET_RING_V1;
+	d->buffer_indirect_count = 0;
+	d->bulk_list_gref = -ENOSPC;
+	d->queue_count = 1;
+	d->prod = 0;
+	d->bulk_posted = 0;
+	d->bulk_len = 0;
+	d->bulk_offset = 0;
+	d->bulk_pages = 0;
+	d->cons = 0;
+	d->bulk_done = 0;
+	d->bulk_refused = 0;
+}
+
+/* Version of the ring protocol recorded in a descriptor page by the
+ * granting side, limited to what this module implements, or -EPROTO for
+ * a page without one.
+ */
+static inline int
+descriptor_ring_version (struct descriptor_page *d) {
+	uint32_t v = d->ring_version;
+
+	if ((v & 0xffff0000U) != XENSOCKET_RING_MAGIC || (v & 0xffff) < XENSOCKET_RING_V1) {
+		return -EPROTO;
+	}
+	return min_t(int, v & 0xffff, XENSOCKET_RING_VERSION);
+}
+
+/* struct xen_ring:
+ *
+ * Local bookkeeping for one shared ring (a descriptor page plus its
+ * buffer pages).  The connecting side allocates and grants both rings of
+ * a connection ("server" functions); the accepting side maps them
+ * ("client" functions).
+ */
+struct xen_ring {
+	struct descriptor_page *descriptor_addr;    /* server and client */
+	int                     descriptor_gref;    /* server and client */
+	void                   *descriptor_area;    /* client only */
+	grant_handle_t          descriptor_handle;  /* client only */
+	unsigned long           buffer_addr;    /* server and client */
+	int                    *buffer_grefs;   /* server */
+	void                   *buffer_area;    /* client */
+	grant_handle_t         *buffer_handles; /* client */
+	int                     buffer_order;
+	int                     version;        /* ring protocol version */
+	unsigned long           indirect_addr;  /* server, v2 only */
+	int                     indirect_pages; /* server, v2 only */
+	int                     indirect_grefs[XENSOCKET_MAX_INDIRECT]; /* server, v2 only */
+	unsigned int            evtchn_port;    /* local port that kicks the peer */
+	int                     irq_cpu;        /* rx: CPU its interrupt was moved to */
+};
+
+static void
+initialize_xen_ring (struct xen_ring *r) {
+	r->descriptor_addr = NULL;
+	r->descriptor_gref = -ENOSPC;
+	r->descriptor_area = NULL;
+	r->descriptor_handle = -1;
+	r->buffer_addr = 0;
+	r->buffer_grefs = NULL;
+	r->buffer_area = NULL;
+	r->buffer_handles = NULL;
+	r->buffer_order = -1;
+	r->version = XENSOCKET_RING_V1;
+	r->indirect_addr = 0;
+	r->indirect_pages = 0;
+	r->evtchn_port = -1;
+	r->irq_cpu = -1;
+}
+
+/************************************************************************
+ * Ring index accessors.  These hide the difference between protocol
+ * version 1 and version 2 from the data path.  ring_produced() and
+ * ring_consumed() are free-running byte counts in both versions and are
+ * what the event indices are compared against.
+ ************************************************************************/
+
+static inline unsigned int
+ring_size (struct xen_ring *r) {
+	return (1 << r->buffer_order) * PAGE_SIZE;
+}
+
+static inline unsigned int
+ring_produced (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version >= XENSOCKET_RING_V2) {
+		return READ_ONCE(d->prod);
+	}
+	return d->total_bytes_sent;
+}
+
+static inline unsigned int
+ring_consumed (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version >= XENSOCKET_RING_V2) {
+		return READ_ONCE(d->cons);
+	}
+	return d->total_bytes_received;
+}
+
+/* Receiver's view: bytes published and not yet consumed. */
+static inline unsigned int
+ring_readable (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version >= XENSOCKET_RING_V2) {
+		return smp_load_acquire(&d->prod) - d->cons;
+	}
+	return ring_size(r) - atomic_read(&d->avail_bytes);
+}
+
+/* Sender's view: bytes of free space. */
+static inline unsigned int
+ring_writeable (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version >= XENSOCKET_RING_V2) {
+		return ring_size(r) - (d->prod - smp_load_acquire(&d->cons));
+	}
+	return atomic_read(&d->avail_bytes);
+}
+
+static inline unsigned int
+ring_send_offset (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version >= XENSOCKET_RING_V2) {
+		return d->prod & (ring_size(r) - 1);
+	}
+	return d->send_offset;
+}
+
+static inline unsigned int
+ring_recv_offset (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version >= XENSOCKET_RING_V2) {
+		return d->cons & (ring_size(r) - 1);
+	}
+	return d->recv_offset;
+}
+
+/* Publish @bytes just copied into the ring. */
+static inline void
+ring_produce (struct xen_ring *r, unsigned int bytes) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version >= XENSOCKET_RING_V2) {
+		smp_store_release(&d->prod, d->prod + bytes);
+		return;
+	}
+	smp_wmb();
+	d->send_offset = (d->send_offset + bytes) % ring_size(r);
+	d->total_bytes_sent += bytes;
+	atomic_sub(bytes, &d->avail_bytes);
+}
+
+/* Hand back @bytes just copied out of the ring. */
+static inline void
+ring_consume (struct xen_ring *r, unsigned int bytes) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version >= XENSOCKET_RING_V2) {
+		smp_store_release(&d->cons, d->cons + bytes);
+		return;
+	}
+	smp_mb();
+	d->recv_offset = (d->recv_offset + bytes) % ring_size(r);
+	d->total_bytes_received += bytes;
+	atomic_add(bytes, &d->avail_bytes);
+}
+
+/* Receiver's view: a bulk transfer is posted and not yet fully pulled. */
+static inline int
+ring_bulk_pending (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (r->version < XENSOCKET_RING_V3) {
+		return 0;
+	}
+	return smp_load_acquire(&d->bulk_posted) != d->bulk_done;
+}
+
+/* Sender's view: a bulk transfer may be posted.  Checked again after
+ * posting, see xen_send_bulk().
+ */
+static inline int
+ring_bulk_allowed (struct xen_ring *r) {
+	return r->version >= XENSOCKET_RING_V3 && !READ_ONCE(r->descriptor_addr->bulk_refused);
 }
 
+/* xen_sock.ctrl_state */
+enum {
+	XEN_CTRL_NONE = 0,      /* not connecting over a control channel */
+	XEN_CTRL_PENDING,
+	XEN_CTRL_ACCEPTED,
+	XEN_CTRL_REFUSED,
+	XEN_CTRL_GONE,          /* withdrawn */
+};
+
+/* Phases of connection setup, timed for /proc/net/xensocket_setup */
+enum {
+	XEN_SETUP_RESOLVE = 0,  /* connector: service lookup */
+	XEN_SETUP_GRANT,        /* connector: rings, grants and event channel */
+	XEN_SETUP_PUBLISH,      /* connector: request written out */
+	XEN_SETUP_WAIT,         /* connector: request published until claimed */
+	XEN_SETUP_WATCH,        /* acceptor: request noticed until claimed */
+	XEN_SETUP_MAP,          /* acceptor: rings mapped */
+	XEN_SETUP_BIND,         /* acceptor: event channel bound */
+	XEN_SETUP_PHASES,
+};
+
 /* struct xen_sock:
  *
  * @sk: this must be the first element in the structure.
+ * @tx: ring this socket sends into.
+ * @rx: ring this socket receives from.
+ * @listen_watch: listening sockets only; fires when connect requests
+ *                appear or are consumed under the service node.
+ * @connect_watch: connecting sockets only; fires when the acceptor
+ *                 removes our request, or refuses it, until close().
+ * @busy_poll_ns: current adaptive spin budget before sleeping (0 = not
+ *                yet sized).
+ * @ring_order: ring size chosen with XEN_RING_SIZE (-1 = not set).
+ * @pool_entry: connecting side only; the pooled connection this socket
+ *              is using.  @tx, @rx and @evtchn_local_port are copies of
+ *              its bookkeeping, the entry owns the memory and the irq.
+ * @mmap_count: user mappings of the rings (see xen_mmap()).
+ * @ring_refs: connecting side; one for the open socket and one per user
+ *             mapping.  The last one gives @pool_entry back, so pages
+ *             a process still has mapped never reach another connection.
+ * @rings_abandoned: close() gave up waiting for the peer to unmap the
+ *                   rings, so they are to be leaked, not pooled.
+ * @tx_notify_pending: a sendpage() followed by more pages has put data
+ *                     in @tx without notifying, starting at
+ *                     @tx_notify_from.
+ * @bulk_list_addr: page listing the grefs of a bulk send, granted to the
+ *                  peer read-only as @bulk_list_gref (0 = none yet).
+ * @bulk_grefs: local copy of the peer's bulk list while receiving.
+ * @zerocopy: XEN_ZEROCOPY is set, so MSG_ZEROCOPY is honoured.
+ * @zc_next_id: id of the next MSG_ZEROCOPY send.
+ * @zc_bulk: MSG_ZEROCOPY transfer not yet pulled by the peer, finished
+ *           by @zc_work once the peer signals.
+ * @want_queues: queue count asked for with XEN_QUEUES.
+ * @queue_steering: XEN_STEER_FLOW or XEN_STEER_CPU.
+ * @nr_queues: queues of the connection; @tx and @rx are queue 0 and
+ *             @queues holds the other nr_queues - 1.
+ * @tx_notify_queue: queue that @tx_notify_pending refers to.
+ * @defer_list: on a CPU's list of sockets waiting for a deferred wakeup.
+ * @defer_queued: on such a list (and holding a reference).
+ * @defer_dead: between connections or being torn down, so events wake
+ *              directly.
+ * @defer_masked: queues whose irq stays disabled until the wakeup.
+ * @accept_queue: listening sockets only; connections mapped and waiting
+ *                for accept(), linked through their @accept_list.
+ * @accept_work: fills @accept_queue when @listen_watch fires.
+ * @ctrl: control channel a connect request went over, or NULL.
+ * @ctrl_id: id of that request, the forward descriptor gref.
+ * @ctrl_state: XEN_CTRL_PENDING until the listener answers.
+ * @ctrl_list: on @ctrl's list of pending requests.
+ * @refuse_work: withdraws a refused connect request, see
+ *               xen_connect_refuse_work().
+ * @connect_mutex: serializes xen_connect_abort().
+ * @listen_list: listening sockets only, on the list of listeners that
+ *               control channel requests are matched against.
+ * @ctrl_requests: requests from control channels waiting for room in
+ *                 @accept_queue.
+ * @published_ns: connecting sockets only; when the connect request went
+ *                out, for XEN_SETUP_WAIT.
+ * @watch_fired_ns: listening sockets only; when @listen_watch last fired
+ *                  with nobody looking at it yet (0 = none since).
  */
 struct xen_sock {
 	struct sock             sk;
 	unsigned char           is_server, is_client;
 	domid_t                 otherend_id;
     char                    service[XENSRVLEN];
-	struct descriptor_page *descriptor_addr;    /* server and client */
-	int                     descriptor_gref;    /* server only */
-	struct vm_struct       *descriptor_area;    /* client only */
-	grant_handle_t          descriptor_handle;  /* client only */
+	struct xen_ring         tx;
+	struct xen_ring         rx;
 	unsigned int            evtchn_local_port;
 	unsigned int            irq;
-	unsigned long           buffer_addr;    /* server and client */
-	int                    *buffer_grefs;   /* server */
-	struct vm_struct       *buffer_area;    /* client */
-	grant_handle_t         *buffer_handles; /* client */
-	int                     buffer_order;
+	struct xenbus_watch     listen_watch;
+	struct xenbus_watch     connect_watch;
+	atomic_t                pending_connections;
+	u64                     busy_poll_ns;
+	int                     ring_order;
+	struct xen_pool_entry  *pool_entry;
+	atomic_t                mmap_count;
+	atomic_t                ring_refs;
+	int                     rings_abandoned;
+	int                     tx_notify_pending;
+	unsigned int            tx_notify_from;
+	unsigned long           bulk_list_addr;
+	int                     bulk_list_gref;
+	unsigned long           bulk_grefs;
+	int                     zerocopy;
+	u32                     zc_next_id;
+	struct xen_bulk        *zc_bulk;
+	struct work_struct      zc_work;
+	int                     want_queues;
+	int                     queue_steering;
+	int                     nr_queues;
+	struct xen_queue       *queues;
+	int                     tx_notify_queue;
+	spinlock_t              defer_lock;
+	struct list_head        defer_list;
+	int                     defer_queued;
+	int                     defer_dead;
+	unsigned long           defer_masked;
+	spinlock_t              accept_lock;
+	struct list_head        accept_queue;
+	struct list_head        accept_list;
+	struct work_struct      accept_work;
+	struct xen_ctrl        *ctrl;
+	u32                     ctrl_id;
+	int                     ctrl_state;
+	struct list_head        ctrl_list;
+	struct work_struct      refuse_work;
+	struct mutex            connect_mutex;
+	struct list_head        listen_list;
+	struct list_head        ctrl_requests;
+	u64                     published_ns;
+	atomic64_t              watch_fired_ns;
 };
 
 static void
@@ -148,31 +731,107 @@ initialize_xen_sock (struct xen_sock *x) {
 	x->is_server = 0;
 	x->is_client = 0;
 	x->otherend_id = -1;
-	x->descriptor_addr = NULL;
-	x->descriptor_gref = -ENOSPC;
-	x->descriptor_area = NULL;
-	x->descriptor_handle = -1;
+	initialize_xen_ring(&x->tx);
+	initialize_xen_ring(&x->rx);
 	x->evtchn_local_port = -1;
 	x->irq = -1;
-	x->buffer_addr = 0;
-	x->buffer_area = NULL;
-	x->buffer_handles = NULL;
-	x->buffer_order = -1;
-}
-
-/* struct xensocket_xenbus_watch:
- * 
- * @xbw: this must be the first element in the structure.
- */
-struct xensocket_xenbus_watch {
-    struct xenbus_watch xbw;
-    struct semaphore sem;
-    struct xenbus_transaction xbt;
-    unsigned int path_len;
-    int gref;
-    domid_t domid;
+	x->listen_watch.node = NULL;
+	x->connect_watch.node = NULL;
+	atomic_set(&x->pending_connections, 0);
+	x->busy_poll_ns = 0;
+	x->ring_order = -1;
+	x->pool_entry = NULL;
+	atomic_set(&x->mmap_count, 0);
+	atomic_set(&x->ring_refs, 1);
+	x->rings_abandoned = 0;
+	x->tx_notify_pending = 0;
+	x->bulk_list_addr = 0;
+	x->bulk_list_gref = -ENOSPC;
+	x->bulk_grefs = 0;
+	x->zerocopy = 0;
+	x->zc_next_id = 0;
+	x->zc_bulk = NULL;
+	INIT_WORK(&x->zc_work, xen_zerocopy_work);
+	x->want_queues = 1;
+	x->queue_steering = XEN_STEER_FLOW;
+	x->nr_queues = 1;
+	x->queues = NULL;
+	x->tx_notify_queue = 0;
+	spin_lock_init(&x->defer_lock);
+	INIT_LIST_HEAD(&x->defer_list);
+	x->defer_queued = 0;
+	x->defer_dead = 0;
+	x->defer_masked = 0;
+	spin_lock_init(&x->accept_lock);
+	INIT_LIST_HEAD(&x->accept_queue);
+	INIT_LIST_HEAD(&x->accept_list);
+	INIT_WORK(&x->accept_work, xen_accept_work);
+	x->ctrl = NULL;
+	x->ctrl_id = 0;
+	x->ctrl_state = XEN_CTRL_NONE;
+	INIT_LIST_HEAD(&x->ctrl_list);
+	INIT_WORK(&x->refuse_work, xen_connect_refuse_work);
+	mutex_init(&x->connect_mutex);
+	INIT_LIST_HEAD(&x->listen_list);
+	INIT_LIST_HEAD(&x->ctrl_requests);
+	x->published_ns = 0;
+	atomic64_set(&x->watch_fired_ns, 0);
+}
+
+/* struct xen_queue:
+ *
+ * One of the extra queues of a multi-queue connection: a ring pair with
+ * its own event channel, set up like the socket's own @tx and @rx.
+ */
+struct xen_queue {
+	struct xen_ring         tx;
+	struct xen_ring         rx;
+	unsigned int            irq;            /* accepting side */
+	struct xen_pool_entry  *pool_entry;     /* connecting side */
 };
 
+static void
+initialize_xen_queue (struct xen_queue *q) {
+	initialize_xen_ring(&q->tx);
+	initialize_xen_ring(&q->rx);
+	q->irq = -1;
+	q->pool_entry = NULL;
+}
+
+static inline struct xen_ring *
+queue_tx (struct xen_sock *x, int q) {
+	return q ? &x->queues[q - 1].tx : &x->tx;
+}
+
+static inline struct xen_ring *
+queue_rx (struct xen_sock *x, int q) {
+	return q ? &x->queues[q - 1].rx : &x->rx;
+}
+
+/* Queue a send goes into: the one of the current CPU, or one picked by
+ * hashing the sending thread so that its records stay in order even when
+ * it migrates.
+ */
+static inline int
+xen_tx_queue (struct xen_sock *x) {
+	if (x->nr_queues <= 1) {
+		return 0;
+	}
+	if (x->queue_steering == XEN_STEER_CPU) {
+		return raw_smp_processor_id() % x->nr_queues;
+	}
+	return hash_32(task_pid_nr(current), 16) % x->nr_queues;
+}
+
+/* Queue the current CPU drains first. */
+static inline int
+xen_rx_queue (struct xen_sock *x) {
+	if (x->nr_queues <= 1) {
+		return 0;
+	}
+	return raw_smp_processor_id() % x->nr_queues;
+}
+
 static struct proto xen_proto = {
 	.name           = "XEN",
 	.owner          = THIS_MODULE,
@@ -190,14 +849,39 @@ static const struct proto_ops xen_stream_ops = {
 	.socketpair     = sock_no_socketpair,
 	.accept         = xen_accept,
 	.getname        = xen_getname,
-	.poll           = sock_no_poll,
-	.ioctl          = sock_no_ioctl,
+	.poll           = xen_poll,
+	.ioctl          = xen_ioctl,
 	.listen         = xen_listen,
 	.shutdown       = xen_shutdown,
-	.getsockopt     = sock_no_getsockopt,
-	.setsockopt     = sock_no_setsockopt,
+	.getsockopt     = xen_getsockopt,
+	.setsockopt     = xen_setsockopt,
 	.sendmsg        = xen_sendmsg,
 	.recvmsg        = xen_recvmsg,
+	.mmap           = xen_mmap,
+	.sendpage       = xen_sendpage,
+	.splice_read    = xen_splice_read,
+};
+
+/* Same as xen_stream_ops except for the data path; the ring mapping and
+ * page-based paths only make sense for a byte stream.
+ */
+static const struct proto_ops xen_seqpacket_ops = {
+	.family         = AF_XEN,
+	.owner          = THIS_MODULE,
+	.release        = xen_release,
+	.bind           = xen_bind,
+	.connect        = xen_connect,
+	.socketpair     = sock_no_socketpair,
+	.accept         = xen_accept,
+	.getname        = xen_getname,
+	.poll           = xen_poll,
+	.ioctl          = sock_no_ioctl,
+	.listen         = xen_listen,
+	.shutdown       = xen_shutdown,
+	.getsockopt     = xen_getsockopt,
+	.setsockopt     = xen_setsockopt,
+	.sendmsg        = xen_seqpacket_sendmsg,
+	.recvmsg        = xen_seqpacket_recvmsg,
 	.mmap           = sock_no_mmap,
 	.sendpage       = sock_no_sendpage,
 };
@@ -211,17 +895,32 @@ static struct net_proto_family xen_family_ops = {
 static int
 xen_shutdown (struct socket *sock, int how) {
 	struct sock *sk = sock->sk;
-	struct xen_sock *x;
-	struct descriptor_page *d;
+	struct xen_sock *x = xen_sk(sk);
+	int i;
 
-	x = xen_sk(sk);
-	d = x->descriptor_addr;
+	/* SHUT_RD, SHUT_WR, SHUT_RDWR become RCV_SHUTDOWN, SEND_SHUTDOWN and both */
+	if (how < SHUT_RD || how > SHUT_RDWR) {
+		return -EINVAL;
+	}
+	how++;
 
-	if (x->is_server) {
-		atomic_set(&d->force_sender_shutdown, 1);
+	if (!x->tx.descriptor_addr || !x->rx.descriptor_addr || sock->state != SS_CONNECTED) {
+		return -ENOTCONN;
 	}
 
-	return xen_release(sock);
+	/* Only the direction goes; close() tears the connection down */
+	sk->sk_shutdown |= how;
+	for (i = 0; i < x->nr_queues; i++) {
+		if (how & RCV_SHUTDOWN) {
+			atomic_set(&queue_rx(x, i)->descriptor_addr->force_sender_shutdown, 1);
+		}
+		if (how & SEND_SHUTDOWN) {
+			atomic_set(&queue_tx(x, i)->descriptor_addr->sender_has_shutdown, 1);
+		}
+	}
+	backend->notify(x->evtchn_local_port);
+	xen_sock_wake(sk);
+	return 0;
 }
 
 /************************************************************************
@@ -249,6 +948,9 @@ xen_create (struct net *net, struct socket *res_sock, int protocol, int kern) {
 		case SOCK_STREAM:
 			res_sock->ops = &xen_stream_ops;
 			break;
+		case SOCK_SEQPACKET:
+			res_sock->ops = &xen_seqpacket_ops;
+			break;
 		default:
 			rc = -ESOCKTNOSUPPORT;
 			goto out;
@@ -314,17 +1016,17 @@ xen_bind (struct socket *sock, struct sockaddr *uaddr, int addr_len) {
 	}
 	x->is_server = 1;
 
-	xenbus_transaction_start(&t);
-    if(xenbus_exists(t, "/xensocket/service", sxeaddr->service)) {
+	backend->transaction_start(&t);
+    if(backend->exists(t, "/xensocket/service", sxeaddr->service)) {
         DPRINTK("error: cannot bind(): /xensocket/service/%s is already in use\n", sxeaddr->service);
-        xenbus_transaction_end(t, 0);
+        backend->transaction_end(t, 0);
         goto err;
     }
-	xenbus_transaction_end(t, 0);
+	backend->transaction_end(t, 0);
 
 	TRACE_EXIT;
 
-	return x->descriptor_gref;
+	return x->tx.descriptor_gref;
 
 err:
 	TRACE_ERROR;
@@ -332,23 +1034,23 @@ err:
 }
 
 static int
-server_allocate_descriptor_page (struct xen_sock *x) {
+server_allocate_descriptor_page (domid_t otherend_id, struct xen_ring *r) {
 	TRACE_ENTRY;
 
-	if (x->descriptor_addr) {
+	if (r->descriptor_addr) {
 		DPRINTK("error: already allocated server descriptor page\n");
 		goto err;
 	}
 
-	if (!(x->descriptor_addr = (struct descriptor_page *)__get_free_page(GFP_KERNEL))) {
+	if (!(r->descriptor_addr = (struct descriptor_page *)__get_free_page(GFP_KERNEL))) {
 		DPRINTK("error: cannot allocate free page\n");
 		goto err_unalloc;
 	}
 
-	initialize_descriptor_page(x->descriptor_addr);
+	initialize_descriptor_page(r->descriptor_addr);
 
-	if ((x->descriptor_gref = gnttab_grant_foreign_access(x->otherend_id, virt_to_mfn(x->descriptor_addr), 0)) == -ENOSPC) {
-		DPRINTK("error: cannot share descriptor page %p\n", x->descriptor_addr);
+	if ((r->descriptor_gref = grant_page(otherend_id, virt_to_frame(r->descriptor_addr), 0)) == -ENOSPC) {
+		DPRINTK("error: cannot share descriptor page %p\n", r->descriptor_addr);
 		goto err_unalloc;
 	}
 
@@ -356,7 +1058,7 @@ server_allocate_descriptor_page (struct xen_sock *x) {
 	return 0;
 
 err_unalloc:
-	server_unallocate_descriptor_page(x);
+	server_unallocate_descriptor_page(r);
 
 err:
 	TRACE_ERROR;
@@ -364,34 +1066,35 @@ err:
 }
 
 static int
-server_allocate_event_channel (struct xen_sock *x) {
-	struct evtchn_alloc_unbound op;
+server_allocate_event_channel (struct xen_pool_entry *e) {
+	unsigned int port;
 	int         rc;
 
 	TRACE_ENTRY;
 
-	op.dom = mydomid;
-	op.remote_dom = x->otherend_id;
-	
-	printk(KERN_CRIT "own id: %d\n", op.dom);
-	printk(KERN_CRIT "other end id: %d\n", op.remote_dom);
+	printk(KERN_CRIT "own id: %d\n", mydomid);
+	printk(KERN_CRIT "other end id: %d\n", e->otherend_id);
 
-	if ((rc = HYPERVISOR_event_channel_op(EVTCHNOP_alloc_unbound, &op)) != 0) {
+	if ((rc = backend->alloc_evtchn(e->otherend_id, &port)) != 0) {
 		DPRINTK("Unable to allocate event channel\n");
 		goto err;
 	}
 
-	x->evtchn_local_port = op.port;
-	x->descriptor_addr->server_evtchn_port = x->evtchn_local_port;
+	e->evtchn_local_port = port;
+	e->tx.descriptor_addr->server_evtchn_port = e->evtchn_local_port;
+	e->tx.evtchn_port = e->rx.evtchn_port = e->evtchn_local_port;
 
 	/* Next bind this end of the event channel to our local callback
-	 * function. */
+	 * function.  The handler is bound to the pool entry rather than to a
+	 * socket, so that the binding survives the entry being reused. */
 
-	if ((rc = bind_evtchn_to_irqhandler(x->evtchn_local_port, server_interrupt, 0, "xensocket", x)) <= 0) {
+	if ((rc = backend->bind_irq(e->evtchn_local_port, server_interrupt, "xensocket", e)) <= 0) {
 		DPRINTK("Unable to bind event channel to irqhandler\n");
 		goto err;
 	}
 
+	e->irq = rc;
+
 	TRACE_EXIT;
 	return 0;
 
@@ -401,9 +1104,10 @@ err:
 }
 
 static int
-server_allocate_buffer_pages (struct xen_sock *x) {
-	struct descriptor_page *d = x->descriptor_addr;
+server_allocate_buffer_pages (domid_t otherend_id, struct xen_ring *r, int order) {
+	struct descriptor_page *d = r->descriptor_addr;
 	int    buffer_num_pages;
+	int    indirect_pages = 0;
 	int    i;
 
 	TRACE_ENTRY;
@@ -414,57 +1118,108 @@ server_allocate_buffer_pages (struct xen_sock *x) {
 		goto err;
 	}
 
-	if (x->buffer_addr) {
+	if (r->buffer_addr) {
 		DPRINTK("error: already allocated server buffer pages\n");
 		goto err;
 	}
 
-	x->buffer_order = 5;  //32 pages    /* you can change this as desired */
-	buffer_num_pages = (1 << x->buffer_order);
-
-	if (!(x->buffer_addr = __get_free_pages(GFP_KERNEL, x->buffer_order))) {
-		DPRINTK("error: cannot allocate %d pages\n", buffer_num_pages);
+	/* v2 peers find the grefs in indirect pages, see below */
+	if (r->version >= XENSOCKET_RING_V2 &&
+			DIV_ROUND_UP(1 << order, XENSOCKET_GREFS_PER_PAGE) > XENSOCKET_MAX_INDIRECT) {
+		DPRINTK("error: %d buffer pages need too many indirect pages\n", 1 << order);
 		goto err;
 	}
 
-	if (!(x->buffer_grefs = kmalloc(buffer_num_pages * sizeof(int), GFP_KERNEL))) {
+	/* The ring is physically contiguous.  Large orders fail quietly once
+	 * memory is fragmented, and the ring then gets the largest order that
+	 * is available; the descriptor tells the peer the size.
+	 */
+	while (!(r->buffer_addr = __get_free_pages(order > PAGE_ALLOC_COSTLY_ORDER ?
+					GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN : GFP_KERNEL, order))) {
+		if (order <= PAGE_ALLOC_COSTLY_ORDER) {
+			DPRINTK("error: cannot allocate %d pages\n", 1 << order);
+			goto err;
+		}
+		order--;
+	}
+	r->buffer_order = order;
+	buffer_num_pages = (1 << r->buffer_order);
+	if (r->version >= XENSOCKET_RING_V2) {
+		indirect_pages = DIV_ROUND_UP(buffer_num_pages, XENSOCKET_GREFS_PER_PAGE);
+	}
+
+	if (!(r->buffer_grefs = kmalloc(buffer_num_pages * sizeof(int), GFP_KERNEL))) {
 		DPRINTK("error: unexpected memory allocation failure\n");
 		goto err_unallocate;
 	} 
 	else {
 		/* Success, so first invalidate all the entries */
 		for (i = 0; i < buffer_num_pages; i++) {
-			x->buffer_grefs[i] = -ENOSPC;
+			r->buffer_grefs[i] = -ENOSPC;
 		}
 	}
 
-	printk("x->buffer_addr = %lx  PAGE_SIZE = %li  buffer_num_pages = %d\n", x->buffer_addr, PAGE_SIZE, buffer_num_pages);
-	for (i = 0; i < buffer_num_pages; i++) {
-		if ((x->buffer_grefs[i] = gnttab_grant_foreign_access(x->otherend_id, virt_to_mfn(x->buffer_addr + i * PAGE_SIZE), 0)) == -ENOSPC) {
-			DPRINTK("error: cannot share buffer page #%d\n", i);
+	if (indirect_pages) {
+		r->indirect_pages = indirect_pages;
+		if (!(r->indirect_addr = __get_free_pages(GFP_KERNEL | __GFP_ZERO, get_order(indirect_pages * PAGE_SIZE)))) {
+			DPRINTK("error: cannot allocate %d indirect pages\n", indirect_pages);
 			goto err_unallocate;
 		}
+		for (i = 0; i < XENSOCKET_MAX_INDIRECT; i++) {
+			r->indirect_grefs[i] = -ENOSPC;
+		}
 	}
 
-	/* In this scheme, we initially use each page to hold
-	 * the grant table reference for the next page.  The client maps
-	 * the next page by reading the gref from the current page.
+	/* Reserve all the references for the buffer in one go, then fill in
+	 * the entries locally; this avoids taking the grant table lock and
+	 * searching the free list once per page.
 	 */
+	if (backend->claim_grefs(otherend_id, buffer_num_pages, r->buffer_grefs) < 0) {
+		DPRINTK("error: cannot reserve %d grant references\n", buffer_num_pages);
+		goto err_unallocate;
+	}
+
+	DPRINTK("buffer_addr = %lx  PAGE_SIZE = %li  buffer_num_pages = %d\n", r->buffer_addr, PAGE_SIZE, buffer_num_pages);
+	for (i = 0; i < buffer_num_pages; i++) {
+		backend->grant_ref(r->buffer_grefs[i], otherend_id, virt_to_frame((void *)(r->buffer_addr + i * PAGE_SIZE)), 0);
+	}
 
-	d->buffer_first_gref = x->buffer_grefs[0];
-	for (i = 1; i < buffer_num_pages; i++) {
-		int *next_gref = (int *)(x->buffer_addr + (i-1) * PAGE_SIZE);
-		*next_gref = x->buffer_grefs[i];
+	if (indirect_pages) {
+		/* The full gref array is published in read-only indirect pages
+		 * listed in the descriptor, so the peer can map the whole ring
+		 * with one batched hypercall.
+		 */
+		memcpy((void *)r->indirect_addr, r->buffer_grefs, buffer_num_pages * sizeof(int));
+		if (backend->claim_grefs(otherend_id, indirect_pages, r->indirect_grefs) < 0) {
+			DPRINTK("error: cannot reserve %d grant references\n", indirect_pages);
+			goto err_unallocate;
+		}
+		for (i = 0; i < indirect_pages; i++) {
+			backend->grant_ref(r->indirect_grefs[i], otherend_id, virt_to_frame((void *)(r->indirect_addr + i * PAGE_SIZE)), 1);
+			d->buffer_indirect_grefs[i] = r->indirect_grefs[i];
+		}
+		d->buffer_indirect_count = indirect_pages;
+	}
+	else {
+		/* In this scheme, we initially use each page to hold
+		 * the grant table reference for the next page.  The client maps
+		 * the next page by reading the gref from the current page.
+		 */
+		for (i = 1; i < buffer_num_pages; i++) {
+			int *next_gref = (int *)(r->buffer_addr + (i-1) * PAGE_SIZE);
+			*next_gref = r->buffer_grefs[i];
+		}
 	}
 
-	d->buffer_order = x->buffer_order;
+	d->buffer_first_gref = r->buffer_grefs[0];
+	d->buffer_order = r->buffer_order;
 	atomic_set(&d->avail_bytes, (1 << d->buffer_order) * PAGE_SIZE);
 
 	TRACE_EXIT;
 	return 0;
 
 err_unallocate:
-	server_unallocate_buffer_pages(x);
+	server_unallocate_buffer_pages(r);
 
 err:
 	TRACE_ERROR;
@@ -475,115 +1230,362 @@ err:
  * Client-side connection setup functions.
  ************************************************************************/
 
+/* An acceptor that claimed a connect request but could not map its rings
+ * writes this where the request was, once it has unmapped what it had.
+ */
+#define XEN_REQUEST_REFUSED "refused"
+
+static int
+xen_request_refused (struct xenbus_transaction t, const char *dir, const char *node) {
+	char *val;
+	int   refused;
+
+	val = backend->read(t, dir, node, NULL);
+	if (IS_ERR(val)) {
+		return 0;
+	}
+	refused = !strcmp(val, XEN_REQUEST_REFUSED);
+	kfree(val);
+	return refused;
+}
+
+/* The acceptor refused our request after claiming it.  A connect() still
+ * waiting fails as if a control channel had refused it, and the refusal
+ * is withdrawn with the request.  A socket that already saw the claim is
+ * reset: nobody will ever read or write its rings.
+ */
+static void
+xen_connect_refused (struct xen_sock *x) {
+	struct socket *sock = x->sk.sk_socket;
+	int i;
+
+	if (sock->state == SS_CONNECTING) {
+		x->sk.sk_err = ECONNREFUSED;
+		sock->state = SS_UNCONNECTED;
+		xen_connect_withdraw_refused(x);
+	}
+	else if (sock->state == SS_CONNECTED) {
+		for (i = 0; i < x->nr_queues; i++) {
+			atomic_set(&queue_rx(x, i)->descriptor_addr->sender_has_shutdown, 1);
+			atomic_set(&queue_rx(x, i)->descriptor_addr->unmapped, 1);
+			atomic_set(&queue_tx(x, i)->descriptor_addr->force_sender_shutdown, 1);
+		}
+		x->sk.sk_err = ECONNRESET;
+		backend->rm(XBT_NIL, x->connect_watch.node, "");
+	}
+	xen_sock_wake(&x->sk);
+}
+
 static void xen_watch_connect(struct xenbus_watch *xbw, const char **vec, unsigned int len) {
-    struct xensocket_xenbus_watch *x = (struct xensocket_xenbus_watch*)xbw;
-    int rc = -EINVAL;
+    struct xen_sock *x = container_of(xbw, struct xen_sock, connect_watch);
+    struct socket *sock = x->sk.sk_socket;
 
     TRACE_ENTRY;
-    if(len > 0) {
-        while(len--) {
-            DPRINTK("[%d] %s\n", len, vec[len]);
-        }
-        xenbus_transaction_start(&(x->xbt));
-        rc = xenbus_exists(x->xbt, vec[0], "");
-        xenbus_transaction_end(x->xbt, 0);
-        if(!rc) {
-            DPRINTK("%s was removed!\n", vec[0]);
-            // unregister myself:
-            unregister_xenbus_watch(xbw);
-            // release sem:
-            up(&(x->sem));
-        }
+    // the acceptor removes our request once it has claimed it:
+    if (sock && sock->state == SS_CONNECTING && !backend->exists(XBT_NIL, xbw->node, "")) {
+        DPRINTK("%s was removed!\n", xbw->node);
+        xen_setup_account(XEN_SETUP_WAIT, ktime_get_ns() - x->published_ns);
+        sock->state = SS_CONNECTED;
+        xen_sock_wake(&x->sk);
+    }
+    // and puts a refusal in its place if it then fails to map our rings:
+    else if (sock && xen_request_refused(XBT_NIL, xbw->node, "")) {
+        DPRINTK("%s was refused!\n", xbw->node);
+        xen_connect_refused(x);
     }
     TRACE_EXIT;
 }
 
+/* Withdraw a connect request nobody has claimed yet and stop watching
+ * it, or withdraw it over its control channel.  Returns 1 if it was
+ * withdrawn (or refused), leaving the socket unconnected and its rings
+ * back in the pool, or 0 if an acceptor claimed it first and the socket
+ * is connected after all.
+ */
 static int
-xen_connect (struct socket *sock, struct sockaddr *uaddr, int addr_len, int flags) {
-	int    rc = -EINVAL;
-	struct sock *sk = sock->sk;
-	struct xen_sock *x = xen_sk(sk);
-	struct sockaddr_xe *sxeaddr = (struct sockaddr_xe *)uaddr;
-	char dir[256];
+xen_connect_abort (struct xen_sock *x) {
+	struct socket *sock = x->sk.sk_socket;
 	struct xenbus_transaction t;
-    char gref_str[15];
-    int domid;
-    int otherend_id;
-    struct xensocket_xenbus_watch xsbw;
-
-	TRACE_ENTRY;
-    DPRINTK("sock@%p, service = %s\n", sock, sxeaddr->service);
-
-	if (sxeaddr->sxe_family != AF_XEN) {
-		goto err;
+	int withdrawn;
+
+	mutex_lock(&x->connect_mutex);
+	if (!x->connect_watch.node && !(x->ctrl && x->ctrl_state != XEN_CTRL_ACCEPTED)) {
+		/* withdrawn already, by xen_connect_refuse_work() */
+		withdrawn = !x->is_client;
+		mutex_unlock(&x->connect_mutex);
+		return withdrawn;
 	}
 
-	/* Ensure that connect() is only called once for this socket.
-	 */
-
-	if (x->is_client) {
-		DPRINTK("error: cannot call connect() more than once on a socket\n");
-		goto err;
+	if (x->ctrl) {
+		withdrawn = xen_ctrl_withdraw(x);
 	}
-	if (x->is_server) {
-		DPRINTK("error: cannot call both bind() and connect() on the same socket\n");
-		goto err;
+	else {
+		backend->unregister_watch(&x->connect_watch);
+		do {
+			withdrawn = 0;
+			backend->transaction_start(&t);
+			if (backend->exists(t, x->connect_watch.node, "")) {
+				backend->rm(t, x->connect_watch.node, "");
+				withdrawn = 1;
+			}
+		} while (backend->transaction_end(t, 0) == -EAGAIN);
+		kfree(x->connect_watch.node);
+		x->connect_watch.node = NULL;
 	}
-	x->is_client = 1;
-
-	xenbus_transaction_start(&(xsbw.xbt));
-    // read remote domid from xenstore
-    if((rc = xenbus_scanf(t, "/xensocket/service", sxeaddr->service, "%d", &otherend_id)) < 0) {
-        goto err;
-    }
-    x->otherend_id = otherend_id;
 
-	printk(KERN_CRIT "pfxen: allocating descriptor page...");
-	if ((rc = server_allocate_descriptor_page(x)) != 0) {
-		goto err;
-	}
-	printk(KERN_CRIT "pfxen: allocating event channel...");
-	if ((rc = server_allocate_event_channel(x)) != 0) {
-		goto err;
+	if (withdrawn) {
+		xen_sock_detach_pool_entry(x);
+		x->is_client = 0;
 	}
-	printk(KERN_CRIT "pfxen: allocating buffer pages...");
-	if ((rc = server_allocate_buffer_pages(x)) != 0) {
-		goto err;
+	if (sock) {
+		sock->state = withdrawn ? SS_UNCONNECTED : SS_CONNECTED;
 	}
+	mutex_unlock(&x->connect_mutex);
+	return withdrawn;
+}
 
-    sprintf(dir, "/xensocket/service/%s", sxeaddr->service);
-    sprintf(gref_str, "%d", x->descriptor_gref);
-    if(xenbus_exists(t, dir, gref_str)) {
-        // already exists
-        xenbus_transaction_end(t, 0);
+/* A refused request is withdrawn as soon as the refusal arrives, so its
+ * rings go back to the pool even if the owner only reads SO_ERROR and
+ * closes.  Runs from a work item since the refusal arrives in watch or
+ * control channel context, where the request cannot be withdrawn.
+ */
+static void
+xen_connect_refuse_work (struct work_struct *work) {
+	struct xen_sock *x = container_of(work, struct xen_sock, refuse_work);
+
+	xen_connect_abort(x);
+	sock_put(&x->sk);
+}
+
+static void
+xen_connect_withdraw_refused (struct xen_sock *x) {
+	sock_hold(&x->sk);
+	if (!schedule_work(&x->refuse_work)) {
+		sock_put(&x->sk);
+	}
+}
+
+/* Wait up to @timeo for the acceptor to claim our request.  A timeout
+ * withdraws the request; a signal leaves it pending.  A listener that
+ * answers over a control channel may also refuse it.
+ */
+static int
+xen_connect_wait (struct socket *sock, long timeo) {
+	struct sock *sk = sock->sk;
+	DEFINE_WAIT(wait);
+	int rc = 0;
+
+	if (!timeo) {
+		return -EINPROGRESS;
+	}
+
+	for (;;) {
+		prepare_to_wait(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
+		if (sock->state != SS_CONNECTING) {
+			break;
+		}
+		if (signal_pending(current)) {
+			DPRINTK("connect got interrupted!\n");
+			rc = sock_intr_errno(timeo);
+			break;
+		}
+		if (!timeo) {
+			rc = -ETIMEDOUT;
+			break;
+		}
+		timeo = schedule_timeout(timeo);
+	}
+	finish_wait(sk_sleep(sk), &wait);
+
+	if (rc == 0 && sock->state != SS_CONNECTED) {
+		/* refused; the request may be withdrawn already */
+		xen_connect_abort(xen_sk(sk));
+		sock_error(sk);
+		return -ECONNREFUSED;
+	}
+	if (rc == -ETIMEDOUT && !xen_connect_abort(xen_sk(sk))) {
+		/* claimed just in time */
+		rc = 0;
+	}
+	return rc;
+}
+
+static int
+xen_connect (struct socket *sock, struct sockaddr *uaddr, int addr_len, int flags) {
+	int    rc = -EINVAL;
+	struct sock *sk = sock->sk;
+	struct xen_sock *x = xen_sk(sk);
+	struct sockaddr_xe *sxeaddr = (struct sockaddr_xe *)uaddr;
+	char dir[256];
+	struct xenbus_transaction t;
+    char gref_str[15];
+    int domid;
+    int otherend_id;
+    int peer_version = XENSOCKET_RING_V1;
+    int peer_type = SOCK_STREAM;
+    int peer_flags = 0;
+	struct xen_pool_entry *e;
+	struct xen_ctrl *c = NULL;
+	u64    start;
+
+	TRACE_ENTRY;
+    DPRINTK("sock@%p, service = %s\n", sock, sxeaddr->service);
+
+	if (sxeaddr->sxe_family != AF_XEN) {
+		goto err;
+	}
+
+	/* Ensure that connect() is only called once for this socket.
+	 */
+
+	if (x->is_client) {
+		if (sock->state == SS_CONNECTING) {
+			return (flags & O_NONBLOCK) ? -EALREADY : xen_connect_wait(sock, sock_sndtimeo(sk, 0));
+		}
+		if (sock->state == SS_CONNECTED) {
+			return -EISCONN;
+		}
+		if (sock->state == SS_UNCONNECTED && sk->sk_err == ECONNREFUSED) {
+			/* a non-blocking connect() was refused; report it once */
+			xen_connect_abort(x);
+			sock_error(sk);
+			return -ECONNREFUSED;
+		}
+		DPRINTK("error: cannot call connect() more than once on a socket\n");
+		goto err;
+	}
+	if (sock->state == SS_UNCONNECTED && sk->sk_err == ECONNREFUSED) {
+		/* the same, with the request already withdrawn */
+		sock_error(sk);
+		return -ECONNREFUSED;
+	}
+	if (x->is_server) {
+		DPRINTK("error: cannot call both bind() and connect() on the same socket\n");
+		goto err;
+	}
+	x->is_client = 1;
+
+    // read remote domid (and, from newer listeners, ring version, socket type and flags) from xenstore or the service cache
+    start = ktime_get_ns();
+    if((rc = xen_service_lookup(sxeaddr->service, &otherend_id, &peer_version, &peer_type, &peer_flags)) < 0) {
         goto err;
     }
-    // write own domid to xenstore
-    xenbus_scanf(t, "domid", "", "%d", &domid);
-    if((rc = xenbus_printf(t, dir, gref_str, "%d", domid)) < 0) {
+    xen_setup_account(XEN_SETUP_RESOLVE, ktime_get_ns() - start);
+    if (rc < 2) {
+        DPRINTK("error: %s is served by a module without ring versions\n", sxeaddr->service);
+        rc = -EPROTO;
+        goto err;
+    }
+    if (rc < 3) {
+        peer_type = SOCK_STREAM;
+    }
+    if (rc < 4) {
+        peer_flags = 0;
+    }
+    if (peer_type != sock->type) {
+        DPRINTK("error: %s is not of this socket's type\n", sxeaddr->service);
+        rc = -EPROTOTYPE;
         goto err;
     }
-	xenbus_transaction_end(t, 0);
-
-    // wait for accept:
-    strcat(dir, "/");
-    strcat(dir, gref_str);
-    xsbw.xbw.node = dir;
-    xsbw.xbw.callback = xen_watch_connect;
-    sema_init(&(xsbw.sem), 0);
-    register_xenbus_watch((struct xenbus_watch*)&xsbw);
-    DPRINTK("registered watch on %s\n", xsbw.xbw.node);
-    //down(&(xsbw.sem));
-    if(down_interruptible(&(xsbw.sem))) {
-        DPRINTK("connect got interrupted!\n");
-        rc = -EINTR;
-        unregister_xenbus_watch((struct xenbus_watch*)&xsbw);
+    x->otherend_id = otherend_id;
+
+    // the first connect() to a domain sets up the control channel to it
+    if (peer_flags & XEN_SERVICE_CONTROL) {
+        c = xen_ctrl_get(otherend_id);
+    }
+
+	/* The connecting side grants both directions: tx is the forward
+	 * ring whose descriptor gref goes to xenstore, rx is the reverse
+	 * ring, found by the acceptor through the forward descriptor.  Both
+	 * rings and the event channel come from the pool when a matching
+	 * idle set is there.
+	 */
+	start = ktime_get_ns();
+	e = xen_pool_take(x, clamp_t(int, peer_version, XENSOCKET_RING_V1, XENSOCKET_RING_VERSION),
+			xen_ring_order(x, 1), xen_ring_order(x, 0));
+	if (IS_ERR(e)) {
+		rc = PTR_ERR(e);
+		goto err_put;
+	}
+	x->pool_entry = e;
+	x->tx = e->tx;
+	x->rx = e->rx;
+	x->evtchn_local_port = e->evtchn_local_port;
+	/* a connect() that failed earlier on this socket cancelled deferral */
+	xen_defer_revive(x);
+	if ((rc = xen_connect_queues(x, e->tx.version)) != 0) {
+		goto err_unallocate;
+	}
+	xen_setup_account(XEN_SETUP_GRANT, ktime_get_ns() - start);
+
+	start = ktime_get_ns();
+	if (c) {
+		// ask over the control channel; the answer completes the connect
+		x->published_ns = start;
+		if ((rc = xen_ctrl_connect(x, c, sxeaddr->service)) != 0) {
+			goto err_unallocate;
+		}
+		xen_setup_account(XEN_SETUP_PUBLISH, ktime_get_ns() - start);
+		rc = xen_connect_wait(sock, sock_sndtimeo(sk, flags & O_NONBLOCK));
+		TRACE_EXIT;
+		return rc;
+	}
+
+	backend->transaction_start(&t);
+    sprintf(dir, "/xensocket/service/%s", sxeaddr->service);
+    sprintf(gref_str, "%d", x->tx.descriptor_gref);
+    // a refusal left for a connector that closed first is stale:
+    if(backend->exists(t, dir, gref_str) && !xen_request_refused(t, dir, gref_str)) {
+        // already exists
+        rc = -EEXIST;
+        goto err_end;
+    }
+    // write own domid to xenstore
+    store_scanf(t, "domid", "", "%d", &domid);
+    if((rc = store_printf(t, dir, gref_str, "%d", domid)) < 0) {
+        goto err_end;
+    }
+	backend->transaction_end(t, 0);
+	x->published_ns = ktime_get_ns();
+
+    // wait for accept, which removes the request:
+    sock->state = SS_CONNECTING;
+    x->connect_watch.node = kasprintf(GFP_KERNEL, "%s/%s", dir, gref_str);
+    x->connect_watch.callback = xen_watch_connect;
+    if (!x->connect_watch.node || (rc = backend->register_watch(&x->connect_watch)) != 0) {
+        rc = x->connect_watch.node ? rc : -ENOMEM;
+        kfree(x->connect_watch.node);
+        x->connect_watch.node = NULL;
+        goto err_withdraw;
     }
-    DPRINTK("");
+    DPRINTK("registered watch on %s\n", x->connect_watch.node);
+    xen_setup_account(XEN_SETUP_PUBLISH, ktime_get_ns() - start);
 
-    sock->state = SS_CONNECTED;
+	rc = xen_connect_wait(sock, sock_sndtimeo(sk, flags & O_NONBLOCK));
 	TRACE_EXIT;
-	return 0;
+	return rc;
+
+err_withdraw:
+	backend->transaction_start(&t);
+	backend->rm(t, dir, gref_str);
+	backend->transaction_end(t, 0);
+	sock->state = SS_UNCONNECTED;
+	xen_sock_detach_pool_entry(x);
+	x->is_client = 0;
+	TRACE_ERROR;
+	return rc;
+
+err_end:
+	backend->transaction_end(t, 1);
+
+err_unallocate:
+	/* the peer never saw these rings, so they can go straight back */
+	xen_sock_detach_pool_entry(x);
+
+err_put:
+	if (c) {
+		xen_ctrl_put(c);
+	}
 
 err:
 	TRACE_ERROR;
@@ -592,58 +1594,38 @@ err:
 }
 
 static int
-client_map_descriptor_page (struct xen_sock *x) {
-	struct gnttab_map_grant_ref op;
+client_map_descriptor_page (struct xen_sock *x, struct xen_ring *r) {
+	void   *addr;
 	int    rc = -ENOMEM;
 
 	TRACE_ENTRY;
 
-	if (x->descriptor_addr) {
+	if (r->descriptor_addr) {
 		DPRINTK("error: already allocated client descriptor page\n");
 		goto err;
 	}
 
-	if ((x->descriptor_area = alloc_vm_area(PAGE_SIZE, NULL)) == NULL) {
-		DPRINTK("error: cannot allocate memory for descriptor page\n");
-		goto err;
-	}
-
-	x->descriptor_addr = x->descriptor_area->addr;
-
-	memset(&op, 0, sizeof(op));
-	op.host_addr = (unsigned long)x->descriptor_addr;
-	op.flags = GNTMAP_host_map;
-	op.ref = x->descriptor_gref;
-	op.dom = x->otherend_id;
-
-	//lock_vm_area(x->descriptor_area);
-	rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &op, 1);
-	//unlock_vm_area(x->descriptor_area);
-	if (rc == -ENOSYS) {
-		goto err_unmap;
-	}
-
-	if (op.status < 0) {
+	addr = backend->map(x->otherend_id, &r->descriptor_gref, 1, 0, &r->descriptor_handle, &r->descriptor_area);
+	if (IS_ERR(addr)) {
 		DPRINTK("error: grant table mapping operation failed\n");
-		goto err_unmap;
+		rc = PTR_ERR(addr);
+		goto err;
 	}
 
-	x->descriptor_handle = op.handle;
+	r->descriptor_addr = addr;
 
 	TRACE_EXIT;
 	return 0;
 
-err_unmap:
-	client_unmap_descriptor_page(x);
-
 err:
 	TRACE_ERROR;
 	return rc;
 }
 
 static int
-client_bind_event_channel (struct xen_sock *x) {
-	struct evtchn_bind_interdomain op;
+client_bind_event_channel (struct xen_sock *x, struct xen_ring *rx, struct xen_ring *tx, unsigned int *irq) {
+	unsigned int remote_port = rx->descriptor_addr->server_evtchn_port;
+	unsigned int port;
 	int         rc;
 
 	TRACE_ENTRY;
@@ -651,30 +1633,27 @@ client_bind_event_channel (struct xen_sock *x) {
 	/* Start by binding this end of the event channel to the other
 	 * end of the event channel. */
 
-	op.remote_dom = x->otherend_id;
-	op.remote_port = x->descriptor_addr->server_evtchn_port;
-
-	printk("pfxen: remote dom: %d\n ", op.remote_dom);
-	printk("pfxen: remote_port: %d\n", op.remote_port);
+	printk("pfxen: remote dom: %d\n ", x->otherend_id);
+	printk("pfxen: remote_port: %d\n", remote_port);
 
-	if ((rc = HYPERVISOR_event_channel_op(EVTCHNOP_bind_interdomain, &op)) != 0) {
+	if ((rc = backend->bind_evtchn(x->otherend_id, remote_port, &port)) != 0) {
 		DPRINTK("Unable to bind to server's event channel\n");
 		goto err;
 	}
 
-	x->evtchn_local_port = op.local_port;
+	rx->evtchn_port = tx->evtchn_port = port;
 
-	DPRINTK("Other port is %d\n", x->descriptor_addr->server_evtchn_port);
-	DPRINTK("My port is %d\n", x->evtchn_local_port);
+	DPRINTK("Other port is %d\n", rx->descriptor_addr->server_evtchn_port);
+	DPRINTK("My port is %d\n", rx->evtchn_port);
 
 	/* Next bind this end of the event channel to our local callback
 	 * function. */
-	if ((rc = bind_evtchn_to_irqhandler(x->evtchn_local_port, client_interrupt, 0, "xensocket", x)) <= 0) {
+	if ((rc = backend->bind_irq(rx->evtchn_port, client_interrupt, "xensocket", x)) <= 0) {
 		DPRINTK("Unable to bind event channel to irqhandler\n");
 		goto err;
 	}
 
-	x->irq = rc;
+	*irq = rc;
 
 	TRACE_EXIT;
 	return 0;
@@ -684,13 +1663,36 @@ err:
 	return rc;
 }
 
+/* Fetch the gref array of a version 2 ring from its indirect pages. */
+static int
+client_read_indirect_grefs (struct xen_sock *x, struct descriptor_page *d, int *grefs, int buffer_num_pages) {
+	grant_handle_t    handles[XENSOCKET_MAX_INDIRECT];
+	void             *area;
+	void             *addr;
+	int               count = d->buffer_indirect_count;
+
+	if (count != DIV_ROUND_UP(buffer_num_pages, XENSOCKET_GREFS_PER_PAGE) || count > XENSOCKET_MAX_INDIRECT) {
+		DPRINTK("error: bad indirect page count %d\n", count);
+		return -EINVAL;
+	}
+
+	addr = backend->map(x->otherend_id, d->buffer_indirect_grefs, count, 1, handles, &area);
+	if (IS_ERR(addr)) {
+		return PTR_ERR(addr);
+	}
+	memcpy(grefs, addr, buffer_num_pages * sizeof(int));
+	backend->unmap(addr, area, handles, count);
+
+	return 0;
+}
+
 static int
-client_map_buffer_pages (struct xen_sock *x) {
-	struct descriptor_page *d = x->descriptor_addr;
+client_map_buffer_pages (struct xen_sock *x, struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
 	int    buffer_num_pages;
-	int    *grefp;
+	int    *grefs = NULL;
+	void   *addr;
 	int    i;
-	struct gnttab_map_grant_ref op;
 	int    rc = -ENOMEM;
 
 	TRACE_ENTRY;
@@ -701,7 +1703,7 @@ client_map_buffer_pages (struct xen_sock *x) {
 		goto err;
 	}
 
-	if (x->buffer_area) {
+	if (r->buffer_addr) {
 		DPRINTK("error: already allocated client buffer pages\n");
 		goto err;
 	}
@@ -711,55 +1713,66 @@ client_map_buffer_pages (struct xen_sock *x) {
 		goto err;
 	}
 
-	x->buffer_order = d->buffer_order;
-	buffer_num_pages = (1 << x->buffer_order);
+	r->buffer_order = d->buffer_order;
+	buffer_num_pages = (1 << r->buffer_order);
 
-	if (!(x->buffer_handles = kmalloc(buffer_num_pages * sizeof(grant_handle_t), GFP_KERNEL))) {
+	if (!(r->buffer_handles = kmalloc(buffer_num_pages * sizeof(grant_handle_t), GFP_KERNEL))) {
 		DPRINTK("error: unexpected memory allocation failure\n");
 		goto err;
 	} 
 	else {
 		for (i = 0; i < buffer_num_pages; i++) {
-			x->buffer_handles[i] = -1;
+			r->buffer_handles[i] = -1;
 		}
 	}
 
-	if (!(x->buffer_area = alloc_vm_area(buffer_num_pages * PAGE_SIZE, NULL))) {
-		DPRINTK("error: cannot allocate %d buffer pages\n", buffer_num_pages);
+	if (!(grefs = kmalloc(buffer_num_pages * sizeof(int), GFP_KERNEL))) {
 		goto err_unmap;
 	}
 
-	x->buffer_addr = (unsigned long)x->buffer_area->addr;
-
-	grefp = &d->buffer_first_gref;
-	for (i = 0; i < buffer_num_pages; i++) {
-		memset(&op, 0, sizeof(op));
-		op.host_addr = x->buffer_addr + i * PAGE_SIZE;
-		op.flags = GNTMAP_host_map;
-		op.ref = *grefp;
-		op.dom = x->otherend_id;
-
-		//lock_vm_area(x->buffer_area);
-		rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &op, 1);
-		//unlock_vm_area(x->buffer_area);
-		if (rc == -ENOSYS) {
+	if (r->version >= XENSOCKET_RING_V2) {
+		/* Read the whole gref array from the indirect pages */
+		if ((rc = client_read_indirect_grefs(x, d, grefs, buffer_num_pages)) != 0) {
 			goto err_unmap;
 		}
-
-		if (op.status) {
-			DPRINTK("error: grant table mapping failed\n");
-			goto err_unmap;
+	}
+	else {
+		/* Version 1: each page holds the gref of the next one, so the
+		 * chain is walked through short-lived mappings of one page at
+		 * a time before the ring is mapped as a whole.
+		 */
+		grefs[0] = d->buffer_first_gref;
+		for (i = 1; i < buffer_num_pages; i++) {
+			grant_handle_t handle;
+			void          *area;
+
+			addr = backend->map(x->otherend_id, &grefs[i - 1], 1, 1, &handle, &area);
+			if (IS_ERR(addr)) {
+				rc = PTR_ERR(addr);
+				DPRINTK("error: grant table mapping failed\n");
+				goto err_unmap;
+			}
+			grefs[i] = *(int *)addr;
+			backend->unmap(addr, area, &handle, 1);
 		}
+	}
 
-		x->buffer_handles[i] = op.handle;
-		grefp = (int *)(x->buffer_addr + i * PAGE_SIZE);
+	/* map the ring in one batch */
+	addr = backend->map(x->otherend_id, grefs, buffer_num_pages, 0, r->buffer_handles, &r->buffer_area);
+	if (IS_ERR(addr)) {
+		rc = PTR_ERR(addr);
+		DPRINTK("error: grant table mapping failed\n");
+		goto err_unmap;
 	}
+	r->buffer_addr = (unsigned long)addr;
+	kfree(grefs);
 
 	TRACE_EXIT;
 	return 0;
 
 err_unmap:
-	client_unmap_buffer_pages(x);
+	kfree(grefs);
+	client_unmap_buffer_pages(r);
 
 err:
 	TRACE_ERROR;
@@ -767,251 +1780,1104 @@ err:
 }
 
 /************************************************************************
- * Data transmission functions (client-only in a one-way communication
- * channel).
+ * Event channel notification suppression.
+ *
+ * As in the Xen I/O rings, each side publishes in the descriptor page
+ * the index at which it wants to be woken: recv_event for a receiver
+ * about to sleep on an empty ring, send_event for a sender about to sleep
+ * on a full one.  The other side only kicks the event channel when it
+ * moves its own index past that point, so a peer that is busy draining
+ * or filling the ring is not interrupted.
  ************************************************************************/
 
+static atomic_long_t notifications_sent = ATOMIC_LONG_INIT(0);
+static atomic_long_t notifications_avoided = ATOMIC_LONG_INIT(0);
+
 static int
-xen_sendmsg (struct socket *sock, struct msghdr *msg, size_t len) {
-	int                     rc = -EINVAL;
-	struct sock            *sk = sock->sk;
-	struct xen_sock        *x = xen_sk(sk);
-	struct descriptor_page *d = x->descriptor_addr;
-	unsigned int            max_offset = (1 << x->buffer_order) * PAGE_SIZE;
-	long                    timeo;
-	unsigned int            copied = 0;
-	unsigned int		not_copied = len;
+param_get_notify_stat (char *buffer, const struct kernel_param *kp) {
+	return sprintf(buffer, "%ld\n", atomic_long_read((atomic_long_t *)kp->arg));
+}
 
-	TRACE_ENTRY;
-    DPRINTK("sock@%p\n", sock);
+static const struct kernel_param_ops notify_stat_ops = {
+	.get = param_get_notify_stat,
+};
 
-	timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
+module_param_cb(notifications_sent, &notify_stat_ops, &notifications_sent, 0444);
+MODULE_PARM_DESC(notifications_sent, "Event channel notifications sent to peers");
+module_param_cb(notifications_avoided, &notify_stat_ops, &notifications_avoided, 0444);
+MODULE_PARM_DESC(notifications_avoided, "Notifications suppressed because the peer was not waiting");
 
-	while(not_copied > 0) {
-		unsigned int send_offset = d->send_offset;
-		unsigned int avail_bytes = atomic_read(&d->avail_bytes);
-		unsigned int bytes;
+/* Kick the peer if moving our index from @old_idx to @new_idx crossed
+ * the @event index it asked to be woken at.
+ */
+static inline void
+notify_peer (unsigned int port, unsigned int new_idx, unsigned int old_idx, unsigned int event) {
+	if ((unsigned int)(new_idx - event) < (unsigned int)(new_idx - old_idx)) {
+		backend->notify(port);
+		atomic_long_inc(&notifications_sent);
+	}
+	else if (new_idx != old_idx) {
+		atomic_long_inc(&notifications_avoided);
+	}
+}
 
-		if (atomic_read(&d->force_sender_shutdown) != 0) {
-			rc = xen_release(sock);
-			goto err;
-		}
+static inline void
+notify_receiver (struct xen_sock *x, struct xen_ring *r, unsigned int old_sent) {
+	smp_mb();   /* publish the producer index before reading recv_event */
+	notify_peer(r->evtchn_port, ring_produced(r), old_sent, r->descriptor_addr->recv_event);
+}
 
-		/* Determine the maximum amount that can be written */
-		bytes = not_copied;
-		bytes = min(bytes, avail_bytes);
+static inline void
+notify_sender (struct xen_sock *x, struct xen_ring *r, unsigned int old_received) {
+	smp_mb();   /* publish the consumer index before reading send_event */
+	notify_peer(r->evtchn_port, ring_consumed(r), old_received, r->descriptor_addr->send_event);
+}
 
-		/* Block if no space is available */
-		if (bytes == 0) {
-			timeo = send_data_wait(sk, timeo);
-			if (signal_pending(current)) {
-				rc = sock_intr_errno(timeo);
-				goto err;
-			}
-			continue;
-		}
+/* Ask to be woken as soon as the sender publishes more data.  Returns
+ * whether the ring is readable, rechecked after arming so that data
+ * sent before the sender saw the new event index is not missed.
+ */
+static int
+arm_receive_event (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
 
-		if ((send_offset + bytes) > max_offset) {
-			/* wrap around, need to copy twice */
-			unsigned int bytes_segment1 = max_offset - send_offset;
-			unsigned int bytes_segment2 = bytes - bytes_segment1;
+	if (is_readable(r)) {
+		return 1;
+	}
+	d->recv_event = ring_consumed(r) + 1;
+	smp_mb();
+	return is_readable(r);
+}
 
-			if(copy_from_iter((unsigned char*)(x->buffer_addr + send_offset), bytes_segment1, &(msg->msg_iter)) != bytes_segment1) {
-				DPRINTK("error: copy_from_user failed\n");
-				goto err;
-			}
-			if(copy_from_iter((unsigned char*)(x->buffer_addr), bytes_segment2, &(msg->msg_iter)) != bytes_segment2) {
-				DPRINTK("error: copy_from_user failed\n");
-			}
+/* Ask to be woken once the receiver has drained a quarter of the ring,
+ * rather than on every byte it frees.  Only called with a full ring, so
+ * the receiver always gets that far before it can run out of data.
+ */
+static int
+arm_send_event (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+	unsigned int threshold = ring_size(r) >> 2;
 
-			/*
-			if (memcpy_fromiovecend((unsigned char *)(x->buffer_addr + send_offset), 
-						msg->msg_iov, copied, bytes_segment1) == -EFAULT) {
-				DPRINTK("error: copy_from_user failed\n");
-				goto err;
-			} 
-			if (memcpy_fromiovecend((unsigned char *)(x->buffer_addr), 
-						msg->msg_iov, copied + bytes_segment1, bytes_segment2) == -EFAULT) {
-				DPRINTK("error: copy_from_user failed\n");
-				goto err;
-			}
-			*/
-		} 
-		else {
-            size_t res_bytes = copy_from_iter((unsigned char *)(x->buffer_addr + send_offset), bytes, &(msg->msg_iter));
-            if(res_bytes != bytes) {
-				DPRINTK("error: copy_from_user failed, res_bytes = %d\n", (int)res_bytes);
-				goto err;
-			}
-			/* no need to wrap around
-			if (memcpy_fromiovecend((unsigned char *)(x->buffer_addr + send_offset), 
-						msg->msg_iov, copied, bytes) == -EFAULT) {
-				DPRINTK("error: copy_from_user failed\n");
-				goto err;
-			}
-			*/
-		}
+	if (is_writeable(r)) {
+		return 1;
+	}
+	d->send_event = ring_consumed(r) + threshold;
+	smp_mb();
+	return is_writeable(r);
+}
 
-		/* Update values */
-		copied += bytes;
-		d->send_offset = (send_offset + bytes) % max_offset;
-		d->total_bytes_sent += bytes;
-		atomic_sub(bytes, &d->avail_bytes);
+/* Arm the receive event of each queue in turn until one is readable. */
+static int
+arm_receive_events (struct xen_sock *x) {
+	int i;
+
+	for (i = 0; i < x->nr_queues; i++) {
+		if (arm_receive_event(queue_rx(x, i))) {
+			return 1;
+		}
 	}
+	return 0;
+}
+
+/************************************************************************
+ * Busy polling.
+ *
+ * For latency sensitive traffic the wakeup path (event channel, interrupt,
+ * reschedule) costs more than the transfer itself.  Before arming its
+ * event index and sleeping, a socket with busy polling enabled spins on
+ * the shared indices for up to busy_poll_ns.  The budget halves each
+ * time spinning ends empty handed and doubles back towards the limit each
+ * time it pays off, so sockets whose peer is rarely quick to answer end
+ * up spinning very little.
+ ************************************************************************/
 
-	notify_remote_via_evtchn(x->evtchn_local_port);
+static unsigned int busy_poll_usecs = 0;
+module_param(busy_poll_usecs, uint, 0644);
+MODULE_PARM_DESC(busy_poll_usecs, "Default busy poll limit in microseconds for sockets without SO_BUSY_POLL (0 = off)");
 
-	TRACE_EXIT;
-	return copied;
+static inline u64
+busy_poll_limit_ns (struct sock *sk) {
+	unsigned int usecs = busy_poll_usecs;
 
-err:
-	TRACE_ERROR;
-	return copied; 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	if (sk->sk_ll_usec) {
+		usecs = sk->sk_ll_usec;
+	}
+#endif
+	return (u64)usecs * NSEC_PER_USEC;
 }
 
 static inline int
-is_writeable (struct descriptor_page *d) {
-	unsigned int avail_bytes = atomic_read(&d->avail_bytes);
-	if (avail_bytes > 0) 
-		return 1;
+busy_poll_ready (struct xen_ring *r, int for_write) {
+	struct descriptor_page *d = r->descriptor_addr;
 
-	return 0;
+	if (for_write) {
+		return is_writeable(r) || atomic_read(&d->force_sender_shutdown);
+	}
+	return is_readable(r) || atomic_read(&d->sender_has_shutdown);
 }
 
-static long
-send_data_wait (struct sock *sk, long timeo) {
+/* Spin until the ring becomes readable (or writeable if @for_write) or
+ * the socket's budget runs out.  Returns whether the ring became ready.
+ */
+static int
+xen_busy_poll (struct sock *sk, struct xen_ring *r, int for_write) {
 	struct xen_sock *x = xen_sk(sk);
-	struct descriptor_page *d = x->descriptor_addr;
-	DEFINE_WAIT(wait);
-
-	TRACE_ENTRY;
+	u64              limit = busy_poll_limit_ns(sk);
+	u64              start, elapsed;
 
-	d->sender_is_blocking = 1;
-	notify_remote_via_evtchn(x->evtchn_local_port);
+	if (!limit) {
+		return 0;
+	}
 
-	for (;;) {
-		prepare_to_wait(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
+	if (!x->busy_poll_ns || x->busy_poll_ns > limit) {
+		x->busy_poll_ns = limit;
+	}
 
-		if (is_writeable(d)
-				|| !skb_queue_empty(&sk->sk_receive_queue)
-				|| sk->sk_err
-				|| (sk->sk_shutdown & RCV_SHUTDOWN)
-				|| signal_pending(current)
-				|| !timeo
-				|| atomic_read(&d->force_sender_shutdown)) {
-			break;
+	start = local_clock();
+	do {
+		if (busy_poll_ready(r, for_write)) {
+			x->busy_poll_ns = min(limit, x->busy_poll_ns << 1);
+			return 1;
+		}
+		if (signal_pending(current) || need_resched()) {
+			return 0;
 		}
+		cpu_relax();
+		elapsed = local_clock() - start;
+	} while (elapsed < x->busy_poll_ns);
 
-		timeo = schedule_timeout(timeo);
-	}
+	x->busy_poll_ns = max(limit >> 4, x->busy_poll_ns >> 1);
+	return 0;
+}
+
+/************************************************************************
+ * Bulk transfer by grant copy (ring protocol version 3).
+ *
+ * A send of at least grant_copy_threshold bytes from user memory would
+ * go round the ring many times, with a sleep and a wakeup each time.
+ * Instead, once the ring is empty, the sender pins the user pages,
+ * grants them to the peer read-only and posts the transfer in the
+ * descriptor page.  The receiver copies straight from those pages into
+ * its own buffer with GNTTABOP_copy, as much as each recv() asks for,
+ * and kicks the sender when it has pulled everything.  The sender then
+ * revokes the grants and unpins.  A transfer covers at most one list
+ * page of grefs (XENSOCKET_GREFS_PER_PAGE pages); longer sends post
+ * several in turn.
+ ************************************************************************/
+
+#define XENSOCKET_BULK_RECV_PAGES  256  /* destination pages per grant copy batch */
+
+static unsigned int grant_copy_threshold = 1024 * 1024;
+module_param(grant_copy_threshold, uint, 0644);
+MODULE_PARM_DESC(grant_copy_threshold, "Sends of at least this many bytes are granted instead of copied through the ring (0 = never)");
+
+/* @msg points at user memory that can be pinned, and so take part in a
+ * bulk transfer.  Under KERNEL_DS, as in default_file_splice_read(), an
+ * iovec holds kernel addresses that iov_iter_get_pages() cannot pin.
+ */
+static inline int
+msg_user_pages (struct msghdr *msg) {
+	return iter_is_iovec(&msg->msg_iter) && segment_eq(get_fs(), USER_DS);
+}
+
+/* The ring is empty, so a transfer can be posted; otherwise ask to be
+ * woken when the receiver has caught up.
+ */
+static int
+bulk_drained (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	if (ring_writeable(r) == ring_size(r)) {
+		return 1;
+	}
+	d->send_event = ring_produced(r);
+	smp_mb();
+	return ring_writeable(r) == ring_size(r);
+}
+
+static int
+bulk_completed (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	return smp_load_acquire(&d->bulk_done) == d->bulk_posted;
+}
+
+/* Wait up to @timeo for the ring to drain (@draining) or for the posted
+ * transfer to be pulled.  A transfer the caller stops waiting for must
+ * be withdrawn with bulk_withdraw() before its pages are released.
+ */
+static long
+bulk_send_wait (struct sock *sk, long timeo, int draining) {
+	struct xen_sock        *x = xen_sk(sk);
+	struct descriptor_page *d = x->tx.descriptor_addr;
+	DEFINE_WAIT(wait);
+
+	for (;;) {
+		prepare_to_wait(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
+
+		if (atomic_read(&d->force_sender_shutdown)) {
+			break;
+		}
+		if (draining ? bulk_drained(&x->tx) : bulk_completed(&x->tx)) {
+			break;
+		}
+		if (signal_pending(current) || !timeo) {
+			break;
+		}
 
-	d->sender_is_blocking = 0;
+		timeo = schedule_timeout(timeo);
+	}
 
 	finish_wait(sk_sleep(sk), &wait);
+	return timeo;
+}
+
+/* A bulk transfer posted by the sender. */
+struct xen_bulk {
+	struct page   **pages;
+	int             npages;
+	unsigned int    bytes;
+	unsigned int    posted;     /* bulk_posted including this transfer */
+	unsigned int    withdrawn;  /* bytes taken back before the peer pulled them */
+	u32             zc_id;      /* MSG_ZEROCOPY notification, if not waited for */
+};
+
+/* Pin and grant up to @len bytes of @msg and post them.  The ring must
+ * be empty and no other transfer outstanding.  Does not advance @msg.
+ */
+static int
+bulk_post (struct xen_sock *x, struct msghdr *msg, size_t len, struct xen_bulk *b) {
+	struct descriptor_page *d = x->tx.descriptor_addr;
+	int                    *grefs;
+	size_t                  offset;
+	ssize_t                 bytes;
+	int                     i;
+	int                     rc;
+
+	if (!x->bulk_list_addr) {
+		if (!(x->bulk_list_addr = get_zeroed_page(GFP_KERNEL))) {
+			return -ENOMEM;
+		}
+		if ((x->bulk_list_gref = grant_page(x->otherend_id, virt_to_frame((void *)x->bulk_list_addr), 1)) < 0) {
+			DPRINTK("error: cannot share bulk list page\n");
+			free_page(x->bulk_list_addr);
+			x->bulk_list_addr = 0;
+			return -ENOSPC;
+		}
+		d->bulk_list_gref = x->bulk_list_gref;
+	}
+	grefs = (int *)x->bulk_list_addr;
+
+	if (!(b->pages = kmalloc_array(XENSOCKET_GREFS_PER_PAGE, sizeof(*b->pages), GFP_KERNEL))) {
+		return -ENOMEM;
+	}
+
+	bytes = iov_iter_get_pages(&msg->msg_iter, b->pages, len, XENSOCKET_GREFS_PER_PAGE, &offset);
+	if (bytes <= 0) {
+		rc = bytes ? bytes : -EFAULT;
+		goto err;
+	}
+	b->bytes = bytes;
+	b->npages = DIV_ROUND_UP(offset + bytes, PAGE_SIZE);
+
+	if (backend->claim_grefs(x->otherend_id, b->npages, grefs) < 0) {
+		DPRINTK("error: cannot reserve %d grant references\n", b->npages);
+		rc = -ENOSPC;
+		goto err_put;
+	}
+	for (i = 0; i < b->npages; i++) {
+		backend->grant_ref(grefs[i], x->otherend_id, backend->frame(b->pages[i]), 1);
+	}
+
+	d->bulk_len = bytes;
+	d->bulk_offset = offset;
+	d->bulk_pages = b->npages;
+	b->posted = d->bulk_posted + bytes;
+	b->withdrawn = 0;
+	smp_store_release(&d->bulk_posted, b->posted);
+	backend->notify(x->evtchn_local_port);
+	return 0;
+
+err_put:
+	for (i = 0; i < b->npages; i++) {
+		put_page(b->pages[i]);
+	}
+err:
+	kfree(b->pages);
+	b->pages = NULL;
+	return rc;
+}
+
+/* Take back the part of @b the peer has not pulled yet. */
+static void
+bulk_withdraw (struct xen_sock *x, struct xen_bulk *b) {
+	struct descriptor_page *d = x->tx.descriptor_addr;
+	unsigned int            done = READ_ONCE(d->bulk_done);
+	unsigned int            prev;
+
+	while (done != b->posted && (prev = cmpxchg(&d->bulk_done, done, b->posted)) != done) {
+		done = prev;
+	}
+	b->withdrawn = b->posted - done;
+}
+
+/* Revoke the grants of a posted transfer and unpin its pages.  Returns
+ * how many of its bytes the peer pulled.
+ */
+static unsigned int
+bulk_finish (struct xen_sock *x, struct xen_bulk *b) {
+	struct descriptor_page *d = x->tx.descriptor_addr;
+	int                    *grefs = (int *)x->bulk_list_addr;
+	unsigned int            pending = b->bytes;
+	int                     i;
+
+	/* the ring may already be gone at close */
+	if (d) {
+		pending = b->posted - smp_load_acquire(&d->bulk_done) + b->withdrawn;
+	}
+
+	for (i = 0; i < b->npages; i++) {
+		if (backend->end_grant(grefs[i], 1)) {
+			put_page(b->pages[i]);
+		}
+		else {
+			/* the peer is still copying; never let the page be reused */
+			printk(KERN_WARNING "xensocket: leaking page still granted to domain %d\n", x->otherend_id);
+		}
+	}
+	kfree(b->pages);
+	b->pages = NULL;
+
+	return pending > b->bytes ? 0 : b->bytes - pending;
+}
+
+/* Send up to @len bytes of @msg as one bulk transfer.  Normally this
+ * waits for the peer to pull them; with @zc_deferred set, the final
+ * piece of a MSG_ZEROCOPY send is left outstanding instead and completes
+ * through the error queue with id @zc_id.  Returns the bytes sent or a
+ * negative error.
+ */
+static int
+xen_send_bulk (struct xen_sock *x, struct msghdr *msg, size_t len, long *timeo, u32 zc_id, int *zc_deferred) {
+	struct sock            *sk = &x->sk;
+	struct xen_ring        *r = &x->tx;
+	struct descriptor_page *d = r->descriptor_addr;
+	struct xen_bulk         sync, *b = &sync;
+	unsigned int            sent;
+	int                     rc;
+
+	TRACE_ENTRY;
+
+	/* Whatever is already in the ring goes first */
+	while (!bulk_drained(r)) {
+		if (atomic_read(&d->force_sender_shutdown)) {
+			return -EPIPE;
+		}
+		if (!*timeo) {
+			return -EAGAIN;
+		}
+		*timeo = bulk_send_wait(sk, *timeo, 1);
+		if (signal_pending(current)) {
+			return sock_intr_errno(*timeo);
+		}
+	}
+
+	if (signal_pending(current)) {
+		return sock_intr_errno(*timeo);
+	}
+
+	if (zc_deferred && !(b = kmalloc(sizeof(*b), GFP_KERNEL))) {
+		return -ENOMEM;
+	}
+	if ((rc = bulk_post(x, msg, len, b)) != 0) {
+		goto out;
+	}
 
+	/* xen_mmap() sets bulk_refused before it checks for a posted
+	 * transfer, we post before checking bulk_refused: one of us sees
+	 * the other
+	 */
+	smp_mb();
+	if (READ_ONCE(d->bulk_refused)) {
+		bulk_withdraw(x, b);
+		sent = bulk_finish(x, b);
+		iov_iter_advance(&msg->msg_iter, sent);
+		rc = sent;
+		goto out;
+	}
+
+	if (zc_deferred && b->bytes == len) {
+		b->zc_id = zc_id;
+		*zc_deferred = 1;
+		iov_iter_advance(&msg->msg_iter, b->bytes);
+		rc = b->bytes;
+		WRITE_ONCE(x->zc_bulk, b);
+		/* in case it was pulled before zc_bulk was visible */
+		smp_mb();
+		if (bulk_completed(r)) {
+			schedule_work(&x->zc_work);
+		}
+		TRACE_EXIT;
+		return rc;
+	}
+
+	*timeo = bulk_send_wait(sk, *timeo, 0);
+	if (!bulk_completed(r) && !atomic_read(&d->force_sender_shutdown)) {
+		/* timed out or interrupted; send only what was pulled */
+		bulk_withdraw(x, b);
+	}
+	sent = bulk_finish(x, b);
+
+	iov_iter_advance(&msg->msg_iter, sent);
+	if (sent) {
+		rc = sent;
+	}
+	else if (atomic_read(&d->force_sender_shutdown)) {
+		rc = -EPIPE;
+	}
+	else {
+		rc = *timeo ? sock_intr_errno(*timeo) : -EAGAIN;
+	}
+
+out:
+	if (b != &sync) {
+		kfree(b);
+	}
 	TRACE_EXIT;
-	return timeo;
+	return rc;
 }
 
-static irqreturn_t
-client_interrupt (int irq, void *dev_id) {
-	struct xen_sock *x = dev_id;
-	struct sock     *sk = &x->sk;
+/************************************************************************
+ * MSG_ZEROCOPY.
+ *
+ * With XEN_ZEROCOPY set, a send() flagged MSG_ZEROCOPY hands its pages
+ * to the peer as a bulk transfer and returns without waiting for them
+ * to be pulled.  The user must leave the buffer alone until a
+ * completion for the call shows up on the socket error queue, as with
+ * TCP: one sock_extended_err of origin SO_EE_ORIGIN_ZEROCOPY covering
+ * the ids ee_info..ee_data, numbered per call from 0, with
+ * SO_EE_CODE_ZEROCOPY_COPIED if the data went through the ring after
+ * all.  Only one transfer is outstanding at a time; the next send
+ * waits for it, which keeps the stream in order.
+ ************************************************************************/
+
+/* Queue a completion for @id, merged into the previous one if that
+ * ends at @id - 1 and has the same code.
+ */
+static void
+xen_zerocopy_notify (struct xen_sock *x, u32 id, int copied) {
+	struct sock              *sk = &x->sk;
+	struct sk_buff_head      *q = &sk->sk_error_queue;
+	struct sock_exterr_skb   *serr;
+	struct sk_buff           *skb;
+	unsigned long             flags;
+	u8                        code = copied ? SO_EE_CODE_ZEROCOPY_COPIED : 0;
+
+	spin_lock_irqsave(&q->lock, flags);
+	skb = skb_peek_tail(q);
+	if (skb) {
+		serr = SKB_EXT_ERR(skb);
+		if (serr->ee.ee_origin == SO_EE_ORIGIN_ZEROCOPY && serr->ee.ee_code == code
+				&& serr->ee.ee_data + 1 == id) {
+			serr->ee.ee_data = id;
+			spin_unlock_irqrestore(&q->lock, flags);
+			return;
+		}
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	if (!(skb = alloc_skb(0, GFP_KERNEL))) {
+		return;
+	}
+	serr = SKB_EXT_ERR(skb);
+	memset(serr, 0, sizeof(*serr));
+	serr->ee.ee_errno = 0;
+	serr->ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr->ee.ee_code = code;
+	serr->ee.ee_info = id;
+	serr->ee.ee_data = id;
+	if (sock_queue_err_skb(sk, skb)) {
+		kfree_skb(skb);
+	}
+}
+
+/* Finish the outstanding transfer if the peer has pulled it (or is
+ * gone) and report it.
+ */
+static void
+xen_zerocopy_reap (struct xen_sock *x) {
+	struct xen_bulk *b = READ_ONCE(x->zc_bulk);
+
+	if (!b || !x->tx.descriptor_addr) {
+		return;
+	}
+	if (!bulk_completed(&x->tx) && !atomic_read(&x->tx.descriptor_addr->force_sender_shutdown)) {
+		return;
+	}
+	if (cmpxchg(&x->zc_bulk, b, NULL) != b) {
+		return;
+	}
+	bulk_finish(x, b);
+	xen_zerocopy_notify(x, b->zc_id, 0);
+	kfree(b);
+}
+
+static void
+xen_zerocopy_work (struct work_struct *work) {
+	struct xen_sock *x = container_of(work, struct xen_sock, zc_work);
+
+	xen_zerocopy_reap(x);
+}
+
+/* Wait for the outstanding transfer before anything else is sent. */
+static int
+xen_zerocopy_wait (struct xen_sock *x, long timeo) {
+	if (!READ_ONCE(x->zc_bulk)) {
+		return 0;
+	}
+	if (!timeo && !bulk_completed(&x->tx)) {
+		return -EAGAIN;
+	}
+	timeo = bulk_send_wait(&x->sk, timeo, 0);
+	xen_zerocopy_reap(x);
+	if (!READ_ONCE(x->zc_bulk)) {
+		return 0;
+	}
+	return timeo ? sock_intr_errno(timeo) : -EAGAIN;
+}
+
+/* Report a MSG_ZEROCOPY send that left no transfer outstanding. */
+static void
+xen_zerocopy_done (struct xen_sock *x, u32 id, unsigned int sent, int copied) {
+	if (sent) {
+		xen_zerocopy_notify(x, id, copied);
+	}
+	else if (x->zc_next_id == id + 1) {
+		/* nothing went out, so the id is not used up */
+		x->zc_next_id = id;
+	}
+}
+
+/* At close: nobody is left to notify, just give the pages back.  The
+ * interrupt handler must be gone already.
+ */
+static void
+xen_zerocopy_release (struct xen_sock *x) {
+	struct xen_bulk *b;
+
+	cancel_work_sync(&x->zc_work);
+	if ((b = xchg(&x->zc_bulk, NULL))) {
+		bulk_finish(x, b);
+		kfree(b);
+	}
+	skb_queue_purge(&x->sk.sk_error_queue);
+}
+
+/* Pull up to @size bytes of the posted transfer into @msg.  Returns the
+ * bytes received or a negative error.
+ */
+static int
+xen_recv_bulk (struct xen_sock *x, struct msghdr *msg, size_t size) {
+	struct xen_ring        *r = &x->rx;
+	struct descriptor_page *d = r->descriptor_addr;
+	unsigned int            posted = smp_load_acquire(&d->bulk_posted);
+	unsigned int            done = d->bulk_done;
+	unsigned int            len = d->bulk_len;
+	unsigned int            first = d->bulk_offset;
+	unsigned int            npages = d->bulk_pages;
+	unsigned int            src, src_page, src_count;
+	struct page           **dpages = NULL;
+	struct page            *bounce = NULL;
+	struct gnttab_copy     *ops = NULL;
+	size_t                  doff, dpos;
+	ssize_t                 bytes = 0;
+	int                    *grefs;
+	int                     dcount = 0;
+	int                     n = 0;
+	int                     i;
+	int                     rc = -ENOMEM;
 
 	TRACE_ENTRY;
 
-	if (sk_sleep(sk) && waitqueue_active(sk_sleep(sk))) {
-		wake_up_interruptible(sk_sleep(sk));
+	if (posted - done > len || npages > XENSOCKET_GREFS_PER_PAGE || first >= PAGE_SIZE
+			|| first + len > npages * PAGE_SIZE) {
+		DPRINTK("error: bad bulk transfer descriptor\n");
+		return -EIO;
+	}
+	src = first + len - (posted - done);
+	size = min_t(size_t, size, posted - done);
+
+	if (!x->bulk_grefs && !(x->bulk_grefs = __get_free_page(GFP_KERNEL))) {
+		goto out;
+	}
+	grefs = (int *)x->bulk_grefs;
+
+	if (!(dpages = kmalloc_array(XENSOCKET_BULK_RECV_PAGES, sizeof(*dpages), GFP_KERNEL))) {
+		goto out;
+	}
+	if (!(ops = kmalloc_array(2 * XENSOCKET_BULK_RECV_PAGES + 2, sizeof(*ops), GFP_KERNEL))) {
+		goto out;
+	}
+
+	if (msg_user_pages(msg)) {
+		bytes = iov_iter_get_pages(&msg->msg_iter, dpages, size, XENSOCKET_BULK_RECV_PAGES, &doff);
+		if (bytes <= 0) {
+			rc = bytes ? bytes : -EFAULT;
+			goto out;
+		}
+		dcount = DIV_ROUND_UP(doff + bytes, PAGE_SIZE);
+	}
+	else {
+		/* kernel buffers (splice) go through a bounce page */
+		if (!(bounce = alloc_page(GFP_KERNEL))) {
+			goto out;
+		}
+		dpages[0] = bounce;
+		doff = 0;
+		bytes = min_t(size_t, size, PAGE_SIZE);
+	}
+
+	/* Fetch the grefs of the source pages this covers */
+	src_page = src / PAGE_SIZE;
+	src_count = DIV_ROUND_UP(src + bytes, PAGE_SIZE) - src_page;
+	memset(&ops[0], 0, sizeof(ops[0]));
+	ops[0].source.u.ref = d->bulk_list_gref;
+	ops[0].source.domid = x->otherend_id;
+	ops[0].source.offset = src_page * sizeof(int);
+	ops[0].dest.u.gmfn = virt_to_frame(grefs);
+	ops[0].dest.domid = DOMID_SELF;
+	ops[0].dest.offset = 0;
+	ops[0].len = src_count * sizeof(int);
+	ops[0].flags = GNTCOPY_source_gref;
+	backend->copy(ops, 1);
+	if (ops[0].status != GNTST_okay) {
+		DPRINTK("error: cannot read bulk list, status %d\n", ops[0].status);
+		rc = -EIO;
+		goto out_put;
+	}
+
+	/* One copy per run that crosses neither a source nor a destination
+	 * page boundary.
+	 */
+	for (dpos = doff; dpos < doff + bytes; n++) {
+		unsigned int chunk = min3((unsigned int)(doff + bytes - dpos),
+				(unsigned int)(PAGE_SIZE - src % PAGE_SIZE),
+				(unsigned int)(PAGE_SIZE - dpos % PAGE_SIZE));
+
+		memset(&ops[n], 0, sizeof(ops[n]));
+		ops[n].source.u.ref = grefs[src / PAGE_SIZE - src_page];
+		ops[n].source.domid = x->otherend_id;
+		ops[n].source.offset = src % PAGE_SIZE;
+		ops[n].dest.u.gmfn = backend->frame(dpages[dpos / PAGE_SIZE]);
+		ops[n].dest.domid = DOMID_SELF;
+		ops[n].dest.offset = dpos % PAGE_SIZE;
+		ops[n].len = chunk;
+		ops[n].flags = GNTCOPY_source_gref;
+		src += chunk;
+		dpos += chunk;
+	}
+	backend->copy(ops, n);
+	for (i = 0; i < n; i++) {
+		if (ops[i].status != GNTST_okay) {
+			DPRINTK("error: grant copy failed, status %d\n", ops[i].status);
+			rc = -EIO;
+			goto out_put;
+		}
+	}
+
+	/* Commit, unless the sender withdrew the transfer meanwhile */
+	if (cmpxchg(&d->bulk_done, done, done + bytes) != done) {
+		rc = 0;
+		goto out_put;
+	}
+
+	if (bounce) {
+		if (copy_to_iter(page_address(bounce), bytes, &msg->msg_iter) != bytes) {
+			rc = -EFAULT;
+			goto out_put;
+		}
+	}
+	else {
+		iov_iter_advance(&msg->msg_iter, bytes);
+	}
+	if (done + bytes == posted) {
+		/* the sender is waiting to unpin */
+		backend->notify(x->evtchn_local_port);
+	}
+	rc = bytes;
+
+out_put:
+	for (i = 0; i < dcount; i++) {
+		if (rc > 0) {
+			set_page_dirty_lock(dpages[i]);
+		}
+		put_page(dpages[i]);
 	}
 
+out:
+	if (bounce) {
+		__free_page(bounce);
+	}
+	kfree(ops);
+	kfree(dpages);
 	TRACE_EXIT;
-	return IRQ_HANDLED;
+	return rc;
+}
+
+static void
+xen_bulk_release (struct xen_sock *x) {
+	if (x->bulk_list_addr) {
+		/* frees the page once the peer no longer maps it */
+		backend->end_grant_page(x->bulk_list_gref, 1, x->bulk_list_addr);
+		x->bulk_list_addr = 0;
+		x->bulk_list_gref = -ENOSPC;
+	}
+	if (x->bulk_grefs) {
+		free_page(x->bulk_grefs);
+		x->bulk_grefs = 0;
+	}
 }
 
 /************************************************************************
- * Data reception functions (server-only in a one-way communication
- * channel, but common to both in a two-way channel).
- ***********************************************************************/
+ * Data transmission functions (common to both ends; each end sends into
+ * its tx ring).
+ ************************************************************************/
 
 static int
-xen_recvmsg (struct socket *sock, struct msghdr *msg, size_t size, int flags) {
+xen_sendmsg (struct socket *sock, struct msghdr *msg, size_t len) {
 	int                     rc = -EINVAL;
 	struct sock            *sk = sock->sk;
 	struct xen_sock        *x = xen_sk(sk);
-	struct descriptor_page *d = x->descriptor_addr;
-	unsigned int            max_offset = (1 << x->buffer_order) * PAGE_SIZE;
+	struct xen_ring        *r = &x->tx;
+	struct descriptor_page *d = r->descriptor_addr;
+	unsigned int            max_offset = (1 << r->buffer_order) * PAGE_SIZE;
 	long                    timeo;
-	int                     copied = 0;
-	int                     target;
+	unsigned int            copied = 0;
+	unsigned int		not_copied = len;
+	unsigned int            notified = 0;
+	int                     zc_requested = 0;
+	int                     zerocopy = 0;
+	int                     zc_deferred = 0;
+	u32                     zc_id = 0;
 
 	TRACE_ENTRY;
     DPRINTK("sock@%p\n", sock);
 
-	target = sock_rcvlowat(sk, flags&MSG_WAITALL, size);
-	timeo = sock_rcvtimeo(sk, flags&MSG_DONTWAIT);
-	while (copied < size) {
-		unsigned int recv_offset = d->recv_offset;
+	if (!d) {
+		rc = -ENOTCONN;
+		goto err;
+	}
+	if (sk->sk_shutdown & SEND_SHUTDOWN) {
+		rc = -EPIPE;
+		goto err;
+	}
+
+	timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
+	notified = x->tx_notify_pending ? x->tx_notify_from : ring_produced(r);
+	x->tx_notify_pending = 0;
+
+	/* An outstanding MSG_ZEROCOPY transfer goes before anything else */
+	if ((rc = xen_zerocopy_wait(x, timeo)) != 0) {
+		goto err;
+	}
+	if (x->zerocopy && (msg->msg_flags & MSG_ZEROCOPY)) {
+		zc_requested = 1;
+		zc_id = x->zc_next_id++;
+		zerocopy = ring_bulk_allowed(r) && msg_user_pages(msg);
+	}
+
+	while(not_copied > 0) {
+		unsigned int send_offset = ring_send_offset(r);
+		unsigned int avail_bytes = ring_writeable(r);
 		unsigned int bytes;
-		unsigned int avail_bytes = max_offset - atomic_read(&d->avail_bytes);  /* bytes available for read */
 
-		/* Determine the maximum amount that can be read */
-		bytes = min((unsigned int)(size - copied), avail_bytes);
+		if (atomic_read(&d->force_sender_shutdown) != 0) {
+			rc = -EPIPE;
+			goto err;
+		}
 
-		if (atomic_read(&d->sender_has_shutdown) != 0) {
-			if (avail_bytes == 0) {
-				copied = 0;
-				break;
+		/* Large sends from user memory are granted rather than copied */
+		if (zerocopy && !ring_bulk_allowed(r)) {
+			/* the receiver mapped the ring; the rest is copied */
+			zerocopy = 0;
+		}
+		if (zerocopy || (ring_bulk_allowed(r) && grant_copy_threshold && timeo
+				&& not_copied >= grant_copy_threshold && msg_user_pages(msg))) {
+			int n = xen_send_bulk(x, msg, not_copied, &timeo, zc_id, zerocopy ? &zc_deferred : NULL);
+
+			if (n < 0) {
+				rc = n;
+				goto err;
 			}
+			copied += n;
+			not_copied -= n;
+			notified = ring_produced(r);
+			continue;
 		}
 
-		/* Block if the buffer is empty */
+		/* Determine the maximum amount that can be written */
+		bytes = not_copied;
+		bytes = min(bytes, avail_bytes);
+
+		/* Block if no space is available */
 		if (bytes == 0) {
-			if (copied > target) {
-				break;
-			}
+			/* Let the receiver see what we have written so far */
+			notify_receiver(x, r, notified);
+			notified = ring_produced(r);
 
-			timeo = receive_data_wait(sk, timeo);
+			if (!timeo) {
+				arm_send_event(r);
+				rc = -EAGAIN;
+				goto err;
+			}
+			timeo = send_data_wait(sk, r, timeo);
 			if (signal_pending(current)) {
 				rc = sock_intr_errno(timeo);
-				DPRINTK("error: signal\n");
 				goto err;
 			}
 			continue;
 		}
 
-		/* Perform the read */
+		if ((send_offset + bytes) > max_offset) {
+			/* wrap around, need to copy twice */
+			unsigned int bytes_segment1 = max_offset - send_offset;
+			unsigned int bytes_segment2 = bytes - bytes_segment1;
+
+			if(copy_from_iter((unsigned char*)(r->buffer_addr + send_offset), bytes_segment1, &(msg->msg_iter)) != bytes_segment1) {
+				DPRINTK("error: copy_from_user failed\n");
+				goto err;
+			}
+			if(copy_from_iter((unsigned char*)(r->buffer_addr), bytes_segment2, &(msg->msg_iter)) != bytes_segment2) {
+				DPRINTK("error: copy_from_user failed\n");
+			}
+
+			/*
+			if (memcpy_fromiovecend((unsigned char *)(r->buffer_addr + send_offset), 
+						msg->msg_iov, copied, bytes_segment1) == -EFAULT) {
+				DPRINTK("error: copy_from_user failed\n");
+				goto err;
+			} 
+			if (memcpy_fromiovecend((unsigned char *)(r->buffer_addr), 
+						msg->msg_iov, copied + bytes_segment1, bytes_segment2) == -EFAULT) {
+				DPRINTK("error: copy_from_user failed\n");
+				goto err;
+			}
+			*/
+		} 
+		else {
+            size_t res_bytes = copy_from_iter((unsigned char *)(r->buffer_addr + send_offset), bytes, &(msg->msg_iter));
+            if(res_bytes != bytes) {
+				DPRINTK("error: copy_from_user failed, res_bytes = %d\n", (int)res_bytes);
+				goto err;
+			}
+			/* no need to wrap around
+			if (memcpy_fromiovecend((unsigned char *)(r->buffer_addr + send_offset), 
+						msg->msg_iov, copied, bytes) == -EFAULT) {
+				DPRINTK("error: copy_from_user failed\n");
+				goto err;
+			}
+			*/
+		}
+
+		/* Update values */
+		copied += bytes;
+		not_copied -= bytes;
+		ring_produce(r, bytes);
+	}
+
+	if (msg->msg_flags & MSG_SENDPAGE_NOTLAST) {
+		/* sendfile()/splice() has another page ready; one notification
+		 * covers them all */
+		x->tx_notify_pending = 1;
+		x->tx_notify_from = notified;
+	}
+	else {
+		notify_receiver(x, r, notified);
+	}
+	if (zc_requested && !zc_deferred) {
+		xen_zerocopy_done(x, zc_id, copied, !zerocopy);
+	}
+
+	TRACE_EXIT;
+	return copied;
+
+err:
+	TRACE_ERROR;
+	if (d) {
+		notify_receiver(x, r, notified);
+	}
+	if (zc_requested && !zc_deferred) {
+		xen_zerocopy_done(x, zc_id, copied, !zerocopy);
+	}
+	return copied ? copied : rc;
+}
+
+static inline int
+is_writeable (struct xen_ring *r) {
+	unsigned int avail_bytes = ring_writeable(r);
+	if (avail_bytes > 0) 
+		return 1;
+
+	return 0;
+}
+
+static long
+send_data_wait (struct sock *sk, struct xen_ring *r, long timeo) {
+	struct descriptor_page *d = r->descriptor_addr;
+	DEFINE_WAIT(wait);
+
+	TRACE_ENTRY;
+
+	if (timeo && xen_busy_poll(sk, r, 1)) {
+		TRACE_EXIT;
+		return timeo;
+	}
+
+	for (;;) {
+		prepare_to_wait(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
+
+		if (arm_send_event(r)
+				|| !skb_queue_empty(&sk->sk_receive_queue)
+				|| sk->sk_err
+				|| (sk->sk_shutdown & RCV_SHUTDOWN)
+				|| signal_pending(current)
+				|| !timeo
+				|| atomic_read(&d->force_sender_shutdown)) {
+			break;
+		}
+
+		timeo = schedule_timeout(timeo);
+	}
+
+	finish_wait(sk_sleep(sk), &wait);
+
+	TRACE_EXIT;
+	return timeo;
+}
+
+static irqreturn_t
+client_interrupt (int irq, void *dev_id) {
+	struct xen_sock *x = dev_id;
+
+	TRACE_ENTRY;
+
+	xen_sock_event(x, irq);
+
+	TRACE_EXIT;
+	return IRQ_HANDLED;
+}
+
+/************************************************************************
+ * Data reception functions (common to both ends; each end receives from
+ * its rx ring).
+ ***********************************************************************/
+
+static int
+xen_recvmsg (struct socket *sock, struct msghdr *msg, size_t size, int flags) {
+	int                     rc = -EINVAL;
+	struct sock            *sk = sock->sk;
+	struct xen_sock        *x = xen_sk(sk);
+	struct xen_ring        *r = &x->rx;
+	struct descriptor_page *d = r->descriptor_addr;
+	unsigned int            max_offset = (1 << r->buffer_order) * PAGE_SIZE;
+	long                    timeo;
+	int                     copied = 0;
+	int                     target;
+
+	TRACE_ENTRY;
+    DPRINTK("sock@%p\n", sock);
+
+	if (!d) {
+		rc = -ENOTCONN;
+		goto err;
+	}
+
+	if (flags & MSG_ERRQUEUE) {
+		return sock_recv_errqueue(sk, msg, size, SOL_XEN, XEN_RECVERR);
+	}
+
+	target = sock_rcvlowat(sk, flags&MSG_WAITALL, size);
+	timeo = sock_rcvtimeo(sk, flags&MSG_DONTWAIT);
+	while (copied < size) {
+		unsigned int recv_offset = ring_recv_offset(r);
+		unsigned int bytes;
+		unsigned int avail_bytes = ring_readable(r);  /* bytes available for read */
+
+		/* A posted bulk transfer only follows an empty ring */
+		if (avail_bytes == 0 && ring_bulk_pending(r)) {
+			int n = xen_recv_bulk(x, msg, size - copied);
+
+			if (n < 0) {
+				rc = n;
+				goto err;
+			}
+			copied += n;
+			continue;
+		}
+
+		/* Determine the maximum amount that can be read */
+		bytes = min((unsigned int)(size - copied), avail_bytes);
+
+		if (atomic_read(&d->sender_has_shutdown) != 0 || (sk->sk_shutdown & RCV_SHUTDOWN)) {
+			if (avail_bytes == 0) {
+				copied = 0;
+				break;
+			}
+		}
+
+		/* Block if the buffer is empty */
+		if (bytes == 0) {
+			if (copied >= target) {
+				break;
+			}
+			if (!timeo) {
+				arm_receive_event(r);
+				rc = -EAGAIN;
+				goto err;
+			}
+
+			timeo = receive_data_wait(sk, timeo);
+			if (signal_pending(current)) {
+				rc = sock_intr_errno(timeo);
+				DPRINTK("error: signal\n");
+				goto err;
+			}
+			continue;
+		}
+
+		/* Perform the read */
 		if ((recv_offset + bytes) > max_offset) {
 			/* wrap around, need to perform the read twice */
 			unsigned int bytes_segment1 = max_offset - recv_offset;
 			unsigned int bytes_segment2 = bytes - bytes_segment1;
-			if (local_memcpy_toiovecend(msg->msg_iter.iov, (unsigned char *)(x->buffer_addr + recv_offset), 
-						copied, bytes_segment1) == -EFAULT) {
+			if (copy_to_iter((unsigned char *)(r->buffer_addr + recv_offset), bytes_segment1,
+						&msg->msg_iter) != bytes_segment1) {
 				DPRINTK("error: copy_to_user failed\n");
+				rc = -EFAULT;
 				goto err;
 			}
-			if (local_memcpy_toiovecend(msg->msg_iter.iov, (unsigned char *)(x->buffer_addr), 
-						copied + bytes_segment1, bytes_segment2) == -EFAULT) {
+			if (copy_to_iter((unsigned char *)(r->buffer_addr), bytes_segment2,
+						&msg->msg_iter) != bytes_segment2) {
 				DPRINTK("error: copy_to_user failed\n");
+				rc = -EFAULT;
 				goto err;
 			}
 		} 
 		else {
 			/* no wrap around, proceed with one copy */
-			if (local_memcpy_toiovecend(msg->msg_iter.iov, (unsigned char *)(x->buffer_addr + recv_offset), 
-						copied, bytes) == -EFAULT) {
+			if (copy_to_iter((unsigned char *)(r->buffer_addr + recv_offset), bytes,
+						&msg->msg_iter) != bytes) {
 				DPRINTK("error: copy_to_user failed\n");
+				rc = -EFAULT;
 				goto err;
 			}
 		}
 
 		/* Update values */
 		copied += bytes;
-		d->recv_offset = (recv_offset + bytes) % max_offset;
-		d->total_bytes_received += bytes;
-		atomic_add(bytes, &d->avail_bytes);
-		if (d->sender_is_blocking) {
-			notify_remote_via_evtchn(x->evtchn_local_port);
-		}
+		ring_consume(r, bytes);
+		notify_sender(x, r, ring_consumed(r) - bytes);
 	}
 
 	TRACE_EXIT;
@@ -1019,30 +2885,40 @@ xen_recvmsg (struct socket *sock, struct msghdr *msg, size_t size, int flags) {
 
 err:
 	TRACE_ERROR;
-	return copied;
+	return copied ? copied : rc;
 }
 
 static inline int
-is_readable (struct descriptor_page *d) {
-	unsigned int max_offset = (1 << d->buffer_order) * PAGE_SIZE;
-	unsigned int avail_bytes = max_offset - atomic_read(&d->avail_bytes);
+is_readable (struct xen_ring *r) {
+	unsigned int avail_bytes = ring_readable(r);
 	if (avail_bytes > 0)
 		return 1;
 
+	if (ring_bulk_pending(r))
+		return 1;
+
 	return 0;
 }
 
 static long
 receive_data_wait (struct sock *sk, long timeo) {
 	struct xen_sock        *x = xen_sk(sk);
-	struct descriptor_page *d = x->descriptor_addr;
+	struct descriptor_page *d = x->rx.descriptor_addr;
 	DEFINE_WAIT(wait);
 
 	TRACE_ENTRY;
 
+	if (timeo && xen_busy_poll(sk, queue_rx(x, xen_rx_queue(x)), 0)) {
+		TRACE_EXIT;
+		return timeo;
+	}
+	if (timeo) {
+		xen_follow_reader(x, xen_rx_queue(x));
+	}
+
 	for (;;) {
 		prepare_to_wait(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
-		if (is_readable(d)
+		if (arm_receive_events(x)
 				|| (atomic_read(&d->sender_has_shutdown) != 0)
 				|| !skb_queue_empty(&sk->sk_receive_queue)
 				|| sk->sk_err
@@ -1052,391 +2928,4642 @@ receive_data_wait (struct sock *sk, long timeo) {
 			break;
 		}
 
-		timeo = schedule_timeout(timeo);
+		timeo = schedule_timeout(timeo);
+	}
+
+	finish_wait(sk_sleep(sk), &wait);
+
+	TRACE_EXIT;
+	return timeo;
+}
+
+static irqreturn_t
+server_interrupt (int irq, void *dev_id) {
+	struct xen_pool_entry *e = dev_id;
+	struct xen_sock       *x = READ_ONCE(e->owner);
+
+	TRACE_ENTRY;
+
+	/* idle pool entries have no one to wake */
+	if (x) {
+		xen_sock_event(x, irq);
+	}
+
+	TRACE_EXIT;
+	return IRQ_HANDLED;
+}
+
+/* Wake everyone sleeping on the socket: blocked senders and receivers as
+ * well as poll/epoll waiters, and let an outstanding MSG_ZEROCOPY
+ * transfer be reaped.  The poll key lets epoll skip waiters that
+ * are not interested, and only one EPOLLEXCLUSIVE waiter is woken.
+ */
+static void
+xen_sock_wake (struct sock *sk) {
+	wait_queue_head_t *wq = sk_sleep(sk);
+
+	if (READ_ONCE(xen_sk(sk)->zc_bulk)) {
+		schedule_work(&xen_sk(sk)->zc_work);
+	}
+
+	smp_mb();
+	if (wq && waitqueue_active(wq)) {
+		wake_up_interruptible_poll(wq, POLLIN | POLLRDNORM | POLLRDHUP |
+				POLLOUT | POLLWRNORM | POLLWRBAND);
+	}
+}
+
+/************************************************************************
+ * Record-oriented sockets (SOCK_SEQPACKET).
+ *
+ * Each record goes into the ring as a 32-bit length header followed by
+ * the payload, padded to XENSOCKET_RECORD_ALIGN so that headers never
+ * straddle the end of the ring.  A record is published with a single
+ * producer update once it is complete, so the receiver sees either all
+ * of it or nothing, and a record must fit in the ring.  recv() returns
+ * one record and discards what does not fit in the buffer, setting
+ * MSG_TRUNC.
+ *
+ * sendmmsg()/recvmmsg() work through the generic paths.  Where the
+ * kernel marks all but the last message of a sendmmsg() batch with
+ * MSG_BATCH, the whole batch costs a single notification.
+ ************************************************************************/
+
+#define XENSOCKET_RECORD_HDR    sizeof(u32)
+#define XENSOCKET_RECORD_ALIGN  sizeof(u32)
+
+static inline unsigned int
+record_space (size_t len) {
+	return XENSOCKET_RECORD_HDR + ALIGN(len, XENSOCKET_RECORD_ALIGN);
+}
+
+/* Copy @bytes from @iter into the ring at @offset, wrapping at the end. */
+static int
+ring_copy_in (struct xen_ring *r, unsigned int offset, struct iov_iter *iter, unsigned int bytes) {
+	unsigned int size = ring_size(r);
+	unsigned int first;
+
+	offset &= size - 1;
+	first = min(bytes, size - offset);
+	if (copy_from_iter((void *)(r->buffer_addr + offset), first, iter) != first) {
+		return -EFAULT;
+	}
+	if (bytes > first && copy_from_iter((void *)r->buffer_addr, bytes - first, iter) != bytes - first) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/* Copy @bytes from the ring at @offset to @iter, wrapping at the end. */
+static int
+ring_copy_out (struct xen_ring *r, unsigned int offset, struct iov_iter *iter, unsigned int bytes) {
+	unsigned int size = ring_size(r);
+	unsigned int first;
+
+	offset &= size - 1;
+	first = min(bytes, size - offset);
+	if (copy_to_iter((void *)(r->buffer_addr + offset), first, iter) != first) {
+		return -EFAULT;
+	}
+	if (bytes > first && copy_to_iter((void *)r->buffer_addr, bytes - first, iter) != bytes - first) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/* First rx queue holding a record, starting with the local one. */
+static struct xen_ring *
+xen_rx_ready (struct xen_sock *x) {
+	int first = xen_rx_queue(x);
+	int i;
+
+	for (i = 0; i < x->nr_queues; i++) {
+		struct xen_ring *r = queue_rx(x, (first + i) % x->nr_queues);
+
+		if (ring_readable(r)) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+static int
+xen_seqpacket_sendmsg (struct socket *sock, struct msghdr *msg, size_t len) {
+	int                     rc;
+	struct sock            *sk = sock->sk;
+	struct xen_sock        *x = xen_sk(sk);
+	struct xen_ring        *r;
+	struct descriptor_page *d;
+	unsigned int            need;
+	unsigned int            offset;
+	unsigned int            notified;
+	long                    timeo;
+	int                     q;
+
+	TRACE_ENTRY;
+
+	if (!x->tx.descriptor_addr) {
+		return -ENOTCONN;
+	}
+	if (sk->sk_shutdown & SEND_SHUTDOWN) {
+		return -EPIPE;
+	}
+	q = xen_tx_queue(x);
+	r = queue_tx(x, q);
+	d = r->descriptor_addr;
+	if (msg->msg_flags & MSG_OOB) {
+		return -EOPNOTSUPP;
+	}
+	if (len > ring_size(r) - XENSOCKET_RECORD_HDR) {
+		return -EMSGSIZE;
+	}
+	need = record_space(len);
+
+	if (x->tx_notify_pending && x->tx_notify_queue != q) {
+		/* the batch moved to another queue; finish off the old one */
+		notify_receiver(x, queue_tx(x, x->tx_notify_queue), x->tx_notify_from);
+		x->tx_notify_pending = 0;
+	}
+
+	timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
+	notified = x->tx_notify_pending ? x->tx_notify_from : ring_produced(r);
+	x->tx_notify_pending = 0;
+
+	/* Wait for room for the whole record */
+	while (ring_writeable(r) < need) {
+		if (atomic_read(&d->force_sender_shutdown)) {
+			rc = -EPIPE;
+			goto err;
+		}
+		notify_receiver(x, r, notified);
+		notified = ring_produced(r);
+		if (!timeo) {
+			arm_send_event(r);
+			rc = -EAGAIN;
+			goto err;
+		}
+		timeo = send_data_wait(sk, r, timeo);
+		if (signal_pending(current)) {
+			rc = sock_intr_errno(timeo);
+			goto err;
+		}
+	}
+	if (atomic_read(&d->force_sender_shutdown)) {
+		rc = -EPIPE;
+		goto err;
+	}
+
+	offset = ring_send_offset(r);
+	*(u32 *)(r->buffer_addr + offset) = len;
+	if ((rc = ring_copy_in(r, offset + XENSOCKET_RECORD_HDR, &msg->msg_iter, len)) != 0) {
+		goto err;
+	}
+	ring_produce(r, need);
+
+#ifdef MSG_BATCH
+	if (msg->msg_flags & MSG_BATCH) {
+		/* more of this sendmmsg() follows; notify once at the end */
+		x->tx_notify_pending = 1;
+		x->tx_notify_from = notified;
+		x->tx_notify_queue = q;
+		TRACE_EXIT;
+		return len;
+	}
+#endif
+	notify_receiver(x, r, notified);
+
+	TRACE_EXIT;
+	return len;
+
+err:
+	TRACE_ERROR;
+	notify_receiver(x, r, notified);
+	return rc;
+}
+
+static int
+xen_seqpacket_recvmsg (struct socket *sock, struct msghdr *msg, size_t size, int flags) {
+	int                     rc;
+	struct sock            *sk = sock->sk;
+	struct xen_sock        *x = xen_sk(sk);
+	struct xen_ring        *r;
+	struct descriptor_page *d = x->rx.descriptor_addr;
+	unsigned int            offset;
+	unsigned int            avail;
+	unsigned int            copy;
+	u32                     len;
+	long                    timeo;
+
+	TRACE_ENTRY;
+
+	if (!d) {
+		return -ENOTCONN;
+	}
+	if (flags & MSG_ERRQUEUE) {
+		return sock_recv_errqueue(sk, msg, size, SOL_XEN, XEN_RECVERR);
+	}
+	if (flags & MSG_OOB) {
+		return -EOPNOTSUPP;
+	}
+
+	timeo = sock_rcvtimeo(sk, flags & MSG_DONTWAIT);
+	while (!(r = xen_rx_ready(x))) {
+		if (atomic_read(&d->sender_has_shutdown) || (sk->sk_shutdown & RCV_SHUTDOWN)) {
+			TRACE_EXIT;
+			return 0;
+		}
+		if (!timeo) {
+			arm_receive_events(x);
+			return -EAGAIN;
+		}
+		timeo = receive_data_wait(sk, timeo);
+		if (signal_pending(current)) {
+			return sock_intr_errno(timeo);
+		}
+	}
+	avail = ring_readable(r);
+
+	offset = ring_recv_offset(r);
+	len = *(u32 *)(r->buffer_addr + offset);
+	if (avail < record_space(len) || len > ring_size(r)) {
+		DPRINTK("error: bad record length %u with %u bytes queued\n", len, avail);
+		return -EIO;
+	}
+
+	copy = min_t(size_t, len, size);
+	if (copy < len) {
+		msg->msg_flags |= MSG_TRUNC;
+	}
+	if ((rc = ring_copy_out(r, offset + XENSOCKET_RECORD_HDR, &msg->msg_iter, copy)) != 0) {
+		return rc;
+	}
+
+	if (!(flags & MSG_PEEK)) {
+		ring_consume(r, record_space(len));
+		notify_sender(x, r, ring_consumed(r) - record_space(len));
+	}
+
+	TRACE_EXIT;
+	return (flags & MSG_TRUNC) ? len : copy;
+}
+
+/************************************************************************
+ * Readiness reporting for poll/select/epoll.
+ ***********************************************************************/
+
+static unsigned int
+xen_poll (struct file *file, struct socket *sock, poll_table *wait) {
+	struct sock            *sk = sock->sk;
+	struct xen_sock        *x = xen_sk(sk);
+	struct descriptor_page *rx = x->rx.descriptor_addr;
+	struct descriptor_page *tx = x->tx.descriptor_addr;
+	unsigned int            mask = 0;
+
+	sock_poll_wait(file, sk_sleep(sk), wait);
+
+	if (sk->sk_err || !skb_queue_empty(&sk->sk_error_queue)) {
+		mask |= POLLERR;
+	}
+
+	/* A listening socket is readable when a connect request is queued */
+	if (x->listen_watch.node) {
+		if (atomic_read(&x->pending_connections) > 0) {
+			mask |= POLLIN | POLLRDNORM;
+		}
+		return mask;
+	}
+
+	if (!rx || !tx || sock->state != SS_CONNECTED) {
+		/* a non-blocking connect() becomes writable once accepted,
+		 * and reports POLLERR if it was refused */
+		return mask;
+	}
+
+	if (arm_receive_events(x)) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+	else {
+		/* the caller is likely to wait for the next interrupt here */
+		xen_follow_reader(x, xen_rx_queue(x));
+	}
+	if (atomic_read(&rx->sender_has_shutdown) || (sk->sk_shutdown & RCV_SHUTDOWN)) {
+		mask |= POLLIN | POLLRDNORM | POLLRDHUP;
+	}
+	if (sk->sk_shutdown == SHUTDOWN_MASK) {
+		mask |= POLLHUP;
+	}
+
+	if (atomic_read(&tx->force_sender_shutdown)) {
+		mask |= POLLOUT | POLLWRNORM;
+		if (mask & POLLRDHUP) {
+			mask |= POLLHUP;
+		}
+	}
+	else if (arm_send_event(queue_tx(x, xen_tx_queue(x)))) {
+		mask |= POLLOUT | POLLWRNORM | POLLWRBAND;
+	}
+
+	return mask;
+}
+
+
+/************************************************************************
+ * Connection teardown functions (common to both server and client).
+ ************************************************************************/
+
+static unsigned int release_timeout_ms = 5000;
+module_param(release_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(release_timeout_ms, "How long close() waits for the peer to unmap rings we granted");
+
+static atomic_long_t release_timeouts = ATOMIC_LONG_INIT(0);
+module_param_cb(release_timeouts, &notify_stat_ops, &release_timeouts, 0444);
+MODULE_PARM_DESC(release_timeouts, "Connections whose rings were leaked because the peer never unmapped them");
+
+static int
+xen_release (struct socket *sock) {
+	struct sock            *sk = sock->sk;
+
+	TRACE_ENTRY;
+    DPRINTK("sock@%p\n", sock);
+	if (!sk) {
+		return 0;
+	}
+
+	sock->sk = NULL;
+	xen_release_sock(sk);
+
+	TRACE_EXIT;
+	return 0;
+}
+
+/* Drop one hold on the rings of a connecting socket; the last one hands
+ * them back to the pool, or leaks them if the peer never let go.
+ */
+static void
+xen_sock_put_rings (struct xen_sock *x) {
+	if (!atomic_dec_and_test(&x->ring_refs)) {
+		return;
+	}
+	if (x->rings_abandoned) {
+		xen_sock_abandon_pool_entry(x);
+	}
+	else {
+		xen_sock_detach_pool_entry(x);
+	}
+}
+
+/* Tear down the connection of @sk and drop its reference.  Also used
+ * for connections still waiting on a listener's accept queue.
+ */
+static void
+xen_release_sock (struct sock *sk) {
+	struct xen_sock        *x = xen_sk(sk);
+	unsigned long           deadline;
+
+	if (x->listen_watch.node) {
+		/* stop taking connections, then close those nobody accepted */
+		backend->unregister_watch(&x->listen_watch);
+		xen_ctrl_unlisten(x);
+		cancel_work_sync(&x->accept_work);
+		kfree(x->listen_watch.node);
+		x->listen_watch.node = NULL;
+		xen_accept_queue_purge(x);
+	}
+
+	if (cancel_work_sync(&x->refuse_work)) {
+		sock_put(sk);
+	}
+	if ((x->connect_watch.node || (x->ctrl && x->ctrl_state != XEN_CTRL_ACCEPTED)) &&
+			xen_connect_abort(x)) {
+		/* closed before anyone accepted; the rings are back in the pool */
+		goto out;
+	}
+
+	// if setup didn't succeed, gracefully exit 
+	if (!x->tx.descriptor_addr || !x->rx.descriptor_addr) 
+		goto out;
+
+	if (x->is_client) {
+		/* We granted both rings.  Tell the peer we stopped sending and
+		 * receiving, then wait until it has unmapped everything, which it
+		 * signals on the descriptor it unmaps last (our rx).
+		 */
+		int i;
+
+		for (i = 0; i < x->nr_queues; i++) {
+			atomic_set(&queue_tx(x, i)->descriptor_addr->sender_has_shutdown, 1);
+			atomic_set(&queue_rx(x, i)->descriptor_addr->force_sender_shutdown, 1);
+		}
+		backend->notify(x->evtchn_local_port);
+
+		/* A peer that died, or never accepted a connection queued on
+		 * its listener, may never answer.  Its mappings must not end
+		 * up in another connection, so the rings are leaked then.
+		 */
+		deadline = jiffies + msecs_to_jiffies(release_timeout_ms);
+		while (atomic_read(&x->rx.descriptor_addr->unmapped) == 0 &&
+				time_before(jiffies, deadline)) {
+			msleep(1);
+		}
+
+		if (!atomic_read(&x->rx.descriptor_addr->unmapped)) {
+			printk(KERN_WARNING "pfxen: domain %d did not unmap our rings, leaking them\n",
+					x->otherend_id);
+			atomic_long_inc(&release_timeouts);
+			x->rings_abandoned = 1;
+		}
+
+		/* rings still mapped by the process go with the last munmap() */
+		xen_sock_put_rings(x);
+	}
+	else {
+		/* We mapped both rings.  The reverse descriptor (our tx) is
+		 * unmapped last, after any other queues, since unmapping it is
+		 * what releases the peer.
+		 */
+		xen_unmap_queues(x);
+		atomic_set(&x->rx.descriptor_addr->force_sender_shutdown, 1);
+		client_unmap_buffer_pages(&x->rx);
+		client_unmap_buffer_pages(&x->tx);
+		client_unmap_descriptor_page(&x->rx);
+		client_unmap_descriptor_page(&x->tx);
+		backend->notify(x->evtchn_local_port);
+
+		if (x->irq != -1) {
+			unbind_evtchn_irq(x->irq, x);
+			x->irq = -1;
+		}
+	}
+
+out:
+	if (x->ctrl) {
+		xen_ctrl_put(x->ctrl);
+		x->ctrl = NULL;
+	}
+	xen_zerocopy_release(x);
+	xen_bulk_release(x);
+	sock_put(sk);
+}
+
+static void
+server_unallocate_buffer_pages (struct xen_ring *r) {
+	if (r->buffer_grefs) {
+		int buffer_num_pages = (1 << r->buffer_order);
+		int i;
+
+		for (i = 0; i < buffer_num_pages; i++) {
+			if (r->buffer_grefs[i] == -ENOSPC) {
+				break;
+			}
+
+			backend->end_grant_page(r->buffer_grefs[i], 0, 0);
+			r->buffer_grefs[i] = -ENOSPC;
+		}
+
+		kfree(r->buffer_grefs);
+		r->buffer_grefs = NULL;
+	}
+
+	if (r->indirect_addr) {
+		int i;
+
+		for (i = 0; i < r->indirect_pages; i++) {
+			if (r->indirect_grefs[i] != -ENOSPC) {
+				backend->end_grant_page(r->indirect_grefs[i], 1, 0);
+				r->indirect_grefs[i] = -ENOSPC;
+			}
+		}
+		free_pages(r->indirect_addr, get_order(r->indirect_pages * PAGE_SIZE));
+		r->indirect_addr = 0;
+		r->indirect_pages = 0;
+	}
+
+	if (r->buffer_addr) {
+		struct descriptor_page *d = r->descriptor_addr;
+
+		free_pages(r->buffer_addr, r->buffer_order);
+		r->buffer_addr = 0;
+		r->buffer_order = -1;
+		if (d) {
+			d->buffer_order = -1;
+		}
+	}
+}
+
+static void
+server_unallocate_descriptor_page (struct xen_ring *r) {
+	if (r->descriptor_gref != -ENOSPC) {
+		backend->end_grant_page(r->descriptor_gref, 0, 0);
+		r->descriptor_gref = -ENOSPC;
+	}
+	if (r->descriptor_addr) {
+		free_page((unsigned long)(r->descriptor_addr));
+		r->descriptor_addr = NULL;
+	}
+}
+
+static void
+client_unmap_buffer_pages (struct xen_ring *r) {
+
+	if (r->buffer_addr) {
+		backend->unmap((void *)r->buffer_addr, r->buffer_area, r->buffer_handles, 1 << r->buffer_order);
+		r->buffer_addr = 0;
+		r->buffer_area = NULL;
+	}
+	if (r->buffer_handles) {
+		kfree(r->buffer_handles);
+		r->buffer_handles = NULL;
+	}
+}
+
+static void
+client_unmap_descriptor_page (struct xen_ring *r) {
+	struct descriptor_page *d;
+
+	d = r->descriptor_addr;
+
+	if (d) {
+		atomic_set(&d->sender_has_shutdown, 1);
+		atomic_set(&d->unmapped, 1);
+		backend->unmap(d, r->descriptor_area, &r->descriptor_handle, 1);
+		r->descriptor_handle = -1;
+		r->descriptor_area = NULL;
+	}
+	r->descriptor_addr = NULL;
+}
+
+/* Map the rings of the connect request @gref from @domid into the fresh
+ * socket @new_x.  The connector's forward ring is our rx; the reverse
+ * ring it points to is our tx.
+ */
+static int
+xen_accept_connection (struct xen_sock *new_x, int gref, domid_t domid) {
+	int    rc;
+	u64    start = ktime_get_ns();
+	u64    bind_start, bind_ns;
+
+	TRACE_ENTRY;
+
+	new_x->rx.descriptor_gref = gref;
+	new_x->otherend_id = domid;
+
+	if (new_x->rx.descriptor_gref < 0) {
+		printk(KERN_CRIT "Gref could not be read!");
+		rc = -EINVAL;
+		goto err;
+	}
+
+	printk(KERN_CRIT "pfxen: mapping descriptor pages...");
+	if ((rc = client_map_descriptor_page(new_x, &new_x->rx)) != 0) {
+		goto err;
+	}
+	/* nothing else in the page means anything before this checks out */
+	if ((rc = descriptor_ring_version(new_x->rx.descriptor_addr)) < 0) {
+		printk(KERN_WARNING "pfxen: domain %d sent an unversioned ring, refusing it\n", domid);
+		goto err_unmap_descriptor;
+	}
+	new_x->rx.version = rc;
+	new_x->tx.descriptor_gref = new_x->rx.descriptor_addr->reverse_descriptor_gref;
+	if ((rc = client_map_descriptor_page(new_x, &new_x->tx)) != 0) {
+		goto err_unmap_descriptor;
+	}
+	if ((rc = descriptor_ring_version(new_x->tx.descriptor_addr)) < 0) {
+		goto err_unmap_descriptor;
+	}
+	new_x->tx.version = rc;
+	printk(KERN_CRIT "pfxen: mapping event channel...");
+	bind_start = ktime_get_ns();
+	if ((rc = client_bind_event_channel(new_x, &new_x->rx, &new_x->tx, &new_x->irq)) != 0) {
+		goto err_unmap_descriptor;
+	}
+	bind_ns = ktime_get_ns() - bind_start;
+	new_x->evtchn_local_port = new_x->rx.evtchn_port;
+	printk(KERN_CRIT "pfxen: mapping buffer pages...");
+	if ((rc = client_map_buffer_pages(new_x, &new_x->rx)) != 0) {
+		goto err_unmap_buffer;
+	}
+	if ((rc = client_map_buffer_pages(new_x, &new_x->tx)) != 0) {
+		goto err_unmap_buffer;
+	}
+	if ((rc = xen_accept_queues(new_x)) != 0) {
+		goto err_unmap_queues;
+	}
+	xen_setup_account(XEN_SETUP_BIND, bind_ns);
+	xen_setup_account(XEN_SETUP_MAP, ktime_get_ns() - start - bind_ns);
+
+	TRACE_EXIT;
+	return 0;
+
+err_unmap_queues:
+	xen_unmap_queues(new_x);
+
+err_unmap_buffer:
+	client_unmap_buffer_pages(&new_x->tx);
+	client_unmap_buffer_pages(&new_x->rx);
+
+err_unmap_descriptor:
+	client_unmap_descriptor_page(&new_x->rx);
+	client_unmap_descriptor_page(&new_x->tx);
+	if (new_x->irq != -1) {
+		xen_defer_cancel(new_x);
+		backend->notify(new_x->evtchn_local_port);
+		unbind_evtchn_irq(new_x->irq, new_x);
+		new_x->irq = -1;
+	}
+
+err:
+	TRACE_ERROR;
+	return rc;
+}
+
+/* Accept queue.
+ *
+ * A listening socket keeps its watch on /xensocket/service/<name> from
+ * listen() to close().  Whenever it fires, xen_accept_work() claims the
+ * connect requests found there, up to the listen backlog, maps their
+ * rings into new sockets and queues them, so accept() only has to take
+ * the first one off the queue.  Requests beyond the backlog stay in
+ * xenstore, and their connectors keep waiting, until accept() makes
+ * room.  Requests that came over a control channel are taken first.
+ * A request whose rings cannot be mapped after it was claimed is
+ * refused in xenstore (see xen_connect_refused()), and the error is
+ * reported to the listener through sk_err.
+ */
+static int
+xen_accept_full (struct xen_sock *x) {
+	int    full;
+
+	/* sk_acceptq_is_full() lets the queue grow to backlog + 1, which
+	 * is what the SYN path wants, but we queue before checking again
+	 */
+	spin_lock(&x->accept_lock);
+	full = x->sk.sk_ack_backlog >= x->sk.sk_max_ack_backlog;
+	spin_unlock(&x->accept_lock);
+	return full;
+}
+
+/* Map the rings of request @gref from @domid into a new socket and queue
+ * it for accept().
+ */
+static int
+xen_accept_one (struct xen_sock *x, int gref, domid_t domid) {
+	struct sock     *sk = &x->sk;
+	struct sock     *new_sk;
+	struct xen_sock *new_x;
+	int              rc;
+
+	if (!(new_sk = sk_alloc(sock_net(sk), PF_XEN, GFP_KERNEL, &xen_proto, 1))) {
+		return -ENOMEM;
+	}
+	sock_init_data(NULL, new_sk);
+	new_sk->sk_family = PF_XEN;
+	new_sk->sk_type = sk->sk_type;
+	new_sk->sk_protocol = sk->sk_protocol;
+	new_x = xen_sk(new_sk);
+	initialize_xen_sock(new_x);
+	strcpy(new_x->service, x->service);
+
+	if ((rc = xen_accept_connection(new_x, gref, domid)) != 0) {
+		sk_free(new_sk);
+		return rc;
+	}
+
+	spin_lock(&x->accept_lock);
+	list_add_tail(&new_x->accept_list, &x->accept_queue);
+	sk_acceptq_added(sk);
+	atomic_set(&x->pending_connections, sk->sk_ack_backlog);
+	spin_unlock(&x->accept_lock);
+	xen_sock_wake(sk);
+	return 0;
+}
+
+/* Tell the connector of claimed request @gref that it failed with @err,
+ * unless it has withdrawn and its gref went into a newer request.
+ */
+static void
+xen_accept_refuse (struct xen_sock *x, const char *node, const char *gref, int err) {
+	struct xenbus_transaction t;
+
+	printk(KERN_WARNING "pfxen: %s: could not accept request %s: %d\n", x->service, gref, err);
+	do {
+		backend->transaction_start(&t);
+		if (!backend->exists(t, node, gref)) {
+			backend->write(t, node, gref, XEN_REQUEST_REFUSED);
+		}
+	} while (backend->transaction_end(t, 0) == -EAGAIN);
+
+	x->sk.sk_err = -err;
+	xen_sock_wake(&x->sk);
+}
+
+static void
+xen_accept_work (struct work_struct *work) {
+	struct xen_sock *x = container_of(work, struct xen_sock, accept_work);
+	const char      *node = x->listen_watch.node;
+	char           **dir;
+	unsigned int     n = 0;
+	unsigned int     i;
+	u64              fired;
+	int              rc;
+
+	TRACE_ENTRY;
+
+	xen_ctrl_accept_requests(x);
+
+	/* runs that only follow an accept() have no watch to account */
+	fired = atomic64_xchg(&x->watch_fired_ns, 0);
+
+	dir = backend->directory(XBT_NIL, node, "", &n);
+	if (IS_ERR(dir)) {
+		TRACE_EXIT;
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct xenbus_transaction t;
+		int              gref, domid;
+
+		if (xen_accept_full(x)) {
+			break;
+		}
+		if (sscanf(dir[i], "%d", &gref) != 1) {
+			continue;
+		}
+
+		/* claim the request; its removal releases the connector */
+		backend->transaction_start(&t);
+		if (store_scanf(t, node, dir[i], "%d", &domid) != 1) {
+			backend->transaction_end(t, 1);
+			continue;
+		}
+		backend->rm(t, node, dir[i]);
+		if (backend->transaction_end(t, 0)) {
+			/* raced with another change; the watch fires again */
+			continue;
+		}
+		if (fired) {
+			xen_setup_account(XEN_SETUP_WATCH, ktime_get_ns() - fired);
+		}
+
+		if ((rc = xen_accept_one(x, gref, domid)) != 0) {
+			xen_accept_refuse(x, node, dir[i], rc);
+		}
+	}
+	kfree(dir);
+
+	TRACE_EXIT;
+}
+
+/* Take the oldest queued connection, or NULL. */
+static struct xen_sock *
+xen_accept_dequeue (struct xen_sock *x) {
+	struct xen_sock *new_x = NULL;
+
+	spin_lock(&x->accept_lock);
+	if (!list_empty(&x->accept_queue)) {
+		new_x = list_first_entry(&x->accept_queue, struct xen_sock, accept_list);
+		list_del_init(&new_x->accept_list);
+		sk_acceptq_removed(&x->sk);
+		atomic_set(&x->pending_connections, x->sk.sk_ack_backlog);
+	}
+	spin_unlock(&x->accept_lock);
+
+	if (new_x && x->listen_watch.node) {
+		/* there is room again for requests left in xenstore */
+		schedule_work(&x->accept_work);
+	}
+	return new_x;
+}
+
+static void
+xen_accept_queue_purge (struct xen_sock *x) {
+	struct xen_sock *new_x;
+
+	while ((new_x = xen_accept_dequeue(x))) {
+		xen_release_sock(&new_x->sk);
+	}
+}
+
+static int xen_accept (struct socket *sock, struct socket *newsock, int flags) {
+	int    rc = -EINVAL;
+	struct sock *sk = sock->sk;
+	struct xen_sock *x = xen_sk(sk);
+	struct xen_sock *new_x;
+	long   timeo;
+	DEFINE_WAIT(wait);
+
+	TRACE_ENTRY;
+    DPRINTK("sock@%p\n", sock);
+    DPRINTK("newsock@%p\n", newsock);
+
+	if (!x->listen_watch.node) {
+		goto err;
+	}
+
+	timeo = sock_rcvtimeo(sk, flags & O_NONBLOCK);
+	for (;;) {
+		prepare_to_wait(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
+		if ((new_x = xen_accept_dequeue(x))) {
+			break;
+		}
+		if (sk->sk_err) {
+			/* a connection that failed after its request was claimed */
+			rc = sock_error(sk);
+			break;
+		}
+		if (!timeo) {
+			rc = -EAGAIN;
+			break;
+		}
+		if (signal_pending(current)) {
+			rc = sock_intr_errno(timeo);
+			DPRINTK("accept got interrupted\n");
+			break;
+		}
+		timeo = schedule_timeout(timeo);
+	}
+	finish_wait(sk_sleep(sk), &wait);
+	if (!new_x) {
+		goto err;
+	}
+
+	sock_graft(&new_x->sk, newsock);
+    newsock->state = SS_CONNECTED;
+
+	TRACE_EXIT;
+	return 0;
+
+err:
+    TRACE_ERROR;
+	return rc;
+}
+
+// accept requires this implementation
+static int xen_getname(struct socket *sock, struct sockaddr *addr, int *sockaddr_len, int peer) {
+	struct sock *sk = sock->sk;
+	struct xen_sock *x = xen_sk(sk);
+    struct sockaddr_xe *sxeaddr = (struct sockaddr_xe*) addr;
+
+    TRACE_ENTRY;
+    DPRINTK("peer = %d\n", peer);
+    sxeaddr->sxe_family = AF_XEN;
+    strcpy(sxeaddr->service, x->service);
+    *sockaddr_len = sizeof(struct sockaddr_xe);
+    TRACE_EXIT;
+    return 0;
+}
+
+static int xen_listen (struct socket *sock, int backlog) {
+    int domid;
+    int rc;
+    struct xenbus_transaction t;
+	struct sock *sk = sock->sk;
+	struct xen_sock *x = xen_sk(sk);
+
+	TRACE_ENTRY;
+    DPRINTK("sock@%p\n", sock);
+    // xenbus transaction
+    backend->transaction_start(&t);
+    // get own domid:
+    store_scanf(t, "domid", "", "%d", &domid);
+    // publish our domid followed by the highest ring version we speak, our socket type and flags:
+    store_printf(t, "/xensocket/service", x->service, "%d %d %d %d", domid, XENSOCKET_RING_VERSION, sock->type, xen_service_flags());
+    backend->transaction_end(t, 0);
+
+    sk->sk_max_ack_backlog = max(backlog, 1);
+
+    // take connect requests as they arrive until close():
+    if (!x->listen_watch.node) {
+        x->listen_watch.node = kasprintf(GFP_KERNEL, "/xensocket/service/%s", x->service);
+        if (!x->listen_watch.node) {
+            TRACE_ERROR;
+            return -ENOMEM;
+        }
+        x->listen_watch.callback = xen_watch_listen;
+        if ((rc = backend->register_watch(&x->listen_watch)) != 0) {
+            kfree(x->listen_watch.node);
+            x->listen_watch.node = NULL;
+            TRACE_ERROR;
+            return rc;
+        }
+        xen_ctrl_listen(x);
+    }
+
+	TRACE_EXIT;
+    return 0;
+}
+
+/* Recount the connect requests below the service node whenever it
+ * changes, so that poll() can report a listening socket as readable.
+ */
+static void xen_watch_listen(struct xenbus_watch *xbw, const char **vec, unsigned int len) {
+    struct xen_sock *x = container_of(xbw, struct xen_sock, listen_watch);
+
+    TRACE_ENTRY;
+    // map new connect requests outside the xenwatch thread:
+    atomic64_cmpxchg(&x->watch_fired_ns, 0, ktime_get_ns());
+    schedule_work(&x->accept_work);
+    TRACE_EXIT;
+}
+
+/************************************************************************
+ * Connection setup timing.
+ *
+ * Setting up a connection takes a service lookup, grants, xenstore
+ * writes and watches on both sides, which is where short-lived sessions
+ * spend most of their time.  Each phase is timed as it completes, and
+ * /proc/net/xensocket_setup lists how often every phase ran and for how
+ * long in total:
+ *   resolve  connector: service lookup, from the cache or xenstore;
+ *   grant    connector: rings, grants and event channel, or a pool entry;
+ *   publish  connector: connect request written to xenstore and watched,
+ *            or sent over the control channel;
+ *   wait     connector: request published until the acceptor claimed it,
+ *            or, over a control channel, until it answered after map
+ *            and bind;
+ *   watch    acceptor: listen watch fired, or control channel request
+ *            arrived, until the request was claimed;
+ *   map      acceptor: descriptor and buffer pages mapped;
+ *   bind     acceptor: event channel bound.
+ * Everything from publish to claim that neither side times, chiefly the
+ * trip through xenstored to the acceptor and the watch back, is what wait
+ * has over watch.  Writing anything to the file clears the counters.
+ ************************************************************************/
+
+static const char *const xen_setup_names[XEN_SETUP_PHASES] = {
+	"resolve", "grant", "publish", "wait", "watch", "map", "bind",
+};
+
+static struct {
+	atomic64_t count;
+	atomic64_t total_ns;
+	atomic64_t max_ns;
+} xen_setup_stats[XEN_SETUP_PHASES];
+
+static void
+xen_setup_account (int phase, u64 ns) {
+	u64 max = atomic64_read(&xen_setup_stats[phase].max_ns);
+
+	atomic64_inc(&xen_setup_stats[phase].count);
+	atomic64_add(ns, &xen_setup_stats[phase].total_ns);
+	while (ns > max) {
+		u64 old = atomic64_cmpxchg(&xen_setup_stats[phase].max_ns, max, ns);
+
+		if (old == max) {
+			break;
+		}
+		max = old;
+	}
+}
+
+static int
+xen_setup_show (struct seq_file *m, void *v) {
+	int    i;
+
+	seq_puts(m, "phase count total_ns max_ns\n");
+	for (i = 0; i < XEN_SETUP_PHASES; i++) {
+		seq_printf(m, "%s %lld %lld %lld\n", xen_setup_names[i],
+				(long long)atomic64_read(&xen_setup_stats[i].count),
+				(long long)atomic64_read(&xen_setup_stats[i].total_ns),
+				(long long)atomic64_read(&xen_setup_stats[i].max_ns));
+	}
+	return 0;
+}
+
+static int
+xen_setup_open (struct inode *inode, struct file *file) {
+	return single_open(file, xen_setup_show, NULL);
+}
+
+static ssize_t
+xen_setup_write (struct file *file, const char __user *buf, size_t len, loff_t *ppos) {
+	int    i;
+
+	for (i = 0; i < XEN_SETUP_PHASES; i++) {
+		atomic64_set(&xen_setup_stats[i].count, 0);
+		atomic64_set(&xen_setup_stats[i].total_ns, 0);
+		atomic64_set(&xen_setup_stats[i].max_ns, 0);
+	}
+	return len;
+}
+
+static const struct file_operations xen_setup_fops = {
+	.owner          = THIS_MODULE,
+	.open           = xen_setup_open,
+	.read           = seq_read,
+	.write          = xen_setup_write,
+	.llseek         = seq_lseek,
+	.release        = single_release,
+};
+
+static void
+xen_setup_init (void) {
+	proc_create("xensocket_setup", 0644, init_net.proc_net, &xen_setup_fops);
+}
+
+static void
+xen_setup_exit (void) {
+	remove_proc_entry("xensocket_setup", init_net.proc_net);
+}
+
+/************************************************************************
+ * Service cache.
+ *
+ * connect() needs the domid, ring version, socket type and flags the
+ * listener published in /xensocket/service/<name>.  Instead of reading
+ * them from xenstore on every connect, the module keeps what it read in
+ * a cache.  Every cached service has a watch of its own on its node:
+ * xenstore fires it once on registration and again whenever the node
+ * is rewritten or removed, and each time the callback reads the node
+ * again.  An entry only answers lookups after that first read, so a
+ * change racing with the lookup that created it is never missed.
+ * Connect requests below the node fire the watch too but are ignored,
+ * and services nobody connects to are not watched at all.
+ *
+ * Watches cannot be unregistered under the cache lock, so dropped
+ * entries go to xen_service_dead and a work item unregisters and frees
+ * them.
+ *
+ * /proc/net/xensocket_services lists the cached entries.
+ ************************************************************************/
+
+struct xen_service {
+	struct hlist_node       node;       /* in xen_services */
+	struct list_head        list;       /* on xen_service_lru, oldest first, or xen_service_dead */
+	struct xenbus_watch     watch;      /* on /xensocket/service/<name> */
+	char                    name[XENSRVLEN];
+	int                     valid;      /* read by the watch at least once */
+	int                     dead;       /* dropped, waiting for xen_service_reap() */
+	int                     fields;     /* as returned by store_scanf() */
+	int                     domid;
+	int                     version;
+	int                     type;
+	int                     flags;
+};
+
+static bool service_cache = 1;
+module_param(service_cache, bool, 0644);
+MODULE_PARM_DESC(service_cache, "Cache service lookups, invalidated by a xenstore watch per service");
+
+static unsigned int service_cache_max = 256;
+module_param(service_cache_max, uint, 0644);
+MODULE_PARM_DESC(service_cache_max, "Services kept in the cache");
+
+static atomic_long_t service_cache_hits = ATOMIC_LONG_INIT(0);
+static atomic_long_t service_cache_misses = ATOMIC_LONG_INIT(0);
+
+module_param_cb(service_cache_hits, &notify_stat_ops, &service_cache_hits, 0444);
+MODULE_PARM_DESC(service_cache_hits, "Connects that found their service in the cache");
+module_param_cb(service_cache_misses, &notify_stat_ops, &service_cache_misses, 0444);
+MODULE_PARM_DESC(service_cache_misses, "Connects that read their service from xenstore");
+
+static DEFINE_HASHTABLE(xen_services, 6);
+static LIST_HEAD(xen_service_lru);
+static LIST_HEAD(xen_service_dead);
+static DEFINE_SPINLOCK(xen_services_lock);
+static unsigned int xen_service_count;
+static int xen_service_closed;  /* module unloading, cache nothing new */
+
+static void xen_watch_service (struct xenbus_watch *xbw, const char **vec, unsigned int len);
+static void xen_service_reap (struct work_struct *work);
+static DECLARE_WORK(xen_service_reap_work, xen_service_reap);
+
+static u32
+xen_service_hash (const char *name) {
+	return jhash(name, strlen(name), 0);
+}
+
+static struct xen_service *
+xen_service_find (const char *name) {
+	struct xen_service *s;
+
+	hash_for_each_possible(xen_services, s, node, xen_service_hash(name)) {
+		if (strcmp(s->name, name) == 0) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static void
+xen_service_free (struct xen_service *s) {
+	kfree(s->watch.node);
+	kfree(s);
+}
+
+/* Unhash @s and hand its watch to xen_service_reap().  Called with
+ * xen_services_lock held.
+ */
+static void
+xen_service_drop (struct xen_service *s) {
+	hash_del(&s->node);
+	list_move_tail(&s->list, &xen_service_dead);
+	s->dead = 1;
+	xen_service_count--;
+	schedule_work(&xen_service_reap_work);
+}
+
+static void
+xen_service_reap (struct work_struct *work) {
+	struct xen_service *s;
+
+	for (;;) {
+		spin_lock(&xen_services_lock);
+		s = list_first_entry_or_null(&xen_service_dead, struct xen_service, list);
+		if (s) {
+			list_del(&s->list);
+		}
+		spin_unlock(&xen_services_lock);
+		if (!s) {
+			break;
+		}
+		/* waits for a callback in progress */
+		backend->unregister_watch(&s->watch);
+		xen_service_free(s);
+	}
+}
+
+/* Forget every service. */
+static void
+xen_service_invalidate (void) {
+	struct xen_service *s, *tmp;
+
+	spin_lock(&xen_services_lock);
+	list_for_each_entry_safe(s, tmp, &xen_service_lru, list) {
+		xen_service_drop(s);
+	}
+	spin_unlock(&xen_services_lock);
+}
+
+static void
+xen_watch_service (struct xenbus_watch *xbw, const char **vec, unsigned int len) {
+	struct xen_service *s = container_of(xbw, struct xen_service, watch);
+	int    domid = 0, version = 0, type = 0, flags = 0;
+	int    rc;
+
+	/* connect requests live below the node */
+	if (strcmp(vec[XS_WATCH_PATH], xbw->node) != 0 || READ_ONCE(s->dead)) {
+		return;
+	}
+
+	rc = store_scanf(XBT_NIL, "/xensocket/service", s->name, "%d %d %d %d", &domid, &version, &type, &flags);
+
+	spin_lock(&xen_services_lock);
+	if (!s->dead) {
+		if (rc < 1 && hash_hashed(&s->node)) {
+			/* gone; the next connect() reads it afresh */
+			xen_service_drop(s);
+		}
+		else if (rc < 1) {
+			/* xen_service_add() has not cached it yet */
+			s->dead = 1;
+		}
+		else {
+			s->fields = rc;
+			s->domid = domid;
+			s->version = version;
+			s->type = type;
+			s->flags = flags;
+			s->valid = 1;
+		}
+	}
+	spin_unlock(&xen_services_lock);
+}
+
+/* Start watching @name, so later lookups can be answered from the
+ * cache.  The entry is filled in by the first watch event.
+ */
+static void
+xen_service_add (const char *name) {
+	struct xen_service *s;
+
+	if (!(s = kzalloc(sizeof(*s), GFP_KERNEL))) {
+		return;
+	}
+	strlcpy(s->name, name, sizeof(s->name));
+	INIT_LIST_HEAD(&s->list);
+	s->watch.callback = xen_watch_service;
+	if (!(s->watch.node = kasprintf(GFP_KERNEL, "/xensocket/service/%s", name))) {
+		kfree(s);
+		return;
+	}
+
+	/* the callback may run as soon as this returns */
+	if (backend->register_watch(&s->watch) != 0) {
+		xen_service_free(s);
+		return;
+	}
+
+	spin_lock(&xen_services_lock);
+	if (xen_service_closed || s->dead || xen_service_find(name)) {
+		spin_unlock(&xen_services_lock);
+		backend->unregister_watch(&s->watch);
+		xen_service_free(s);
+		return;
+	}
+	while (xen_service_count >= service_cache_max && !list_empty(&xen_service_lru)) {
+		xen_service_drop(list_first_entry(&xen_service_lru, struct xen_service, list));
+	}
+	hash_add(xen_services, &s->node, xen_service_hash(name));
+	list_add_tail(&s->list, &xen_service_lru);
+	xen_service_count++;
+	spin_unlock(&xen_services_lock);
+}
+
+/* Read what the listener on @name published, like
+ * store_scanf(..., "%d %d %d %d", ...), from the cache if possible.
+ */
+static int
+xen_service_lookup (const char *name, int *domid, int *version, int *type, int *flags) {
+	struct xen_service *s;
+	int    rc, known = 0;
+
+	spin_lock(&xen_services_lock);
+	if (service_cache && (s = xen_service_find(name))) {
+		known = 1;
+		if (s->valid) {
+			*domid = s->domid;
+			*version = s->version;
+			*type = s->type;
+			*flags = s->flags;
+			rc = s->fields;
+			list_move_tail(&s->list, &xen_service_lru);
+			spin_unlock(&xen_services_lock);
+			atomic_long_inc(&service_cache_hits);
+			return rc;
+		}
+	}
+	spin_unlock(&xen_services_lock);
+
+	atomic_long_inc(&service_cache_misses);
+	rc = store_scanf(XBT_NIL, "/xensocket/service", name, "%d %d %d %d", domid, version, type, flags);
+	if (rc >= 1 && service_cache && service_cache_max && !known) {
+		xen_service_add(name);
+	}
+	return rc;
+}
+
+static int
+xen_service_show (struct seq_file *m, void *v) {
+	struct xen_service *s;
+
+	seq_puts(m, "service domid version type flags\n");
+	spin_lock(&xen_services_lock);
+	list_for_each_entry(s, &xen_service_lru, list) {
+		if (!s->valid) {
+			continue;
+		}
+		seq_printf(m, "%s %d %d %d %d\n", s->name, s->domid,
+				s->fields >= 2 ? s->version : XENSOCKET_RING_V1,
+				s->fields >= 3 ? s->type : SOCK_STREAM,
+				s->fields >= 4 ? s->flags : 0);
+	}
+	spin_unlock(&xen_services_lock);
+	return 0;
+}
+
+static int
+xen_service_open (struct inode *inode, struct file *file) {
+	return single_open(file, xen_service_show, NULL);
+}
+
+static const struct file_operations xen_service_fops = {
+	.owner          = THIS_MODULE,
+	.open           = xen_service_open,
+	.read           = seq_read,
+	.llseek         = seq_lseek,
+	.release        = single_release,
+};
+
+static void
+xen_service_init (void) {
+	proc_create("xensocket_services", 0444, init_net.proc_net, &xen_service_fops);
+}
+
+static void
+xen_service_exit (void) {
+	remove_proc_entry("xensocket_services", init_net.proc_net);
+	spin_lock(&xen_services_lock);
+	xen_service_closed = 1;
+	spin_unlock(&xen_services_lock);
+	xen_service_invalidate();
+	flush_work(&xen_service_reap_work);
+}
+
+/************************************************************************
+ * Control channels.
+ *
+ * Setting up a connection through xenstore costs several transactions
+ * and a watch round trip through xenstored for every connect().  So the
+ * first connect() from one domain to another sets up a control channel
+ * instead: the connecting domain grants one page holding two small
+ * message rings and allocates an event channel, and publishes both once
+ * as /xensocket/control/<peer domid>/<own domid>.  Every domain watches
+ * its own directory there and maps what it finds.
+ *
+ * From then on a connect request is a CONNECT message on the channel,
+ * carrying the service name and the forward descriptor gref, and the
+ * listening domain answers ACCEPT once the rings are mapped, or REFUSE.
+ * A connector that gives up sends WITHDRAW, answered with WITHDRAWN
+ * unless the request was already taken, in which case the ACCEPT or
+ * REFUSE follows.  Listeners that take requests this way say so in their
+ * service node; connects to other listeners, or to a domain that does
+ * not map the channel in time, go through xenstore as before.
+ *
+ * Either side gives up the channel by setting its flag in the page and
+ * kicking the other.  The connecting side also removes its node, and
+ * sets up a new channel on its next connect() if the peer gave up.
+ ************************************************************************/
+
+#define XEN_CTRL_RING_SIZE      16      /* messages, a power of two */
+#define XEN_CTRL_TIMEOUT        (5 * HZ)
+#define XEN_CTRL_SETUP_TIMEOUT  HZ
+
+enum {
+	XEN_CTRL_CONNECT = 1,   /* connector to listener */
+	XEN_CTRL_WITHDRAW,
+	XEN_CTRL_ACCEPT,        /* listener to connector */
+	XEN_CTRL_REFUSE,
+	XEN_CTRL_WITHDRAWN,
+};
+
+struct xen_ctrl_msg {
+	uint32_t        type;
+	uint32_t        id;           /* the connector's forward descriptor gref */
+	char            service[XENSRVLEN];
+};
+
+struct xen_ctrl_ring {
+	unsigned int    prod;         /* written by the sender */
+	unsigned int    cons;         /* written by the receiver */
+	struct xen_ctrl_msg msg[XEN_CTRL_RING_SIZE];
+};
+
+struct xen_ctrl_page {
+	uint32_t        mapper_ready;
+	uint32_t        mapper_gone;
+	uint32_t        owner_gone;
+	struct xen_ctrl_ring req;     /* owner (connecting domain) to mapper */
+	struct xen_ctrl_ring rsp;     /* mapper to owner */
+};
+
+/* struct xen_ctrl:
+ *
+ * One end of a control channel.  @is_owner is set on the connecting
+ * side, which granted @page; the other side mapped it.  The list of
+ * channels holds a reference, and so does every socket and queued
+ * request using the channel.
+ */
+struct xen_ctrl {
+	struct list_head        list;       /* on xen_ctrls */
+	struct kref             kref;
+	domid_t                 otherend_id;
+	int                     is_owner;
+	struct xen_ctrl_page   *page;
+	struct xen_ctrl_ring   *tx;
+	struct xen_ctrl_ring   *rx;
+	int                     gref;
+	grant_handle_t          handle;     /* mapper only */
+	void                   *area;       /* mapper only */
+	unsigned int            evtchn_port;
+	int                     irq;
+	int                     dead;       /* closed on this side */
+	int                     stale;      /* owner: the peer did not map it in time */
+	spinlock_t              lock;       /* owner: protects @pending */
+	struct list_head        pending;    /* owner: sockets waiting for an answer */
+	struct mutex            tx_lock;
+	wait_queue_head_t       wq;
+	struct work_struct      work;
+};
+
+/* A CONNECT waiting on a listener until its accept work takes it. */
+struct xen_ctrl_req {
+	struct list_head        list;       /* on the listener's ctrl_requests */
+	struct xen_ctrl        *ctrl;
+	u32                     id;
+	u64                     arrived_ns;
+};
+
+static bool control_channels = 1;
+module_param(control_channels, bool, 0644);
+MODULE_PARM_DESC(control_channels, "Send connect requests over per-domain control channels when the listener takes them");
+
+static atomic_long_t control_connects = ATOMIC_LONG_INIT(0);
+module_param_cb(control_connects, &notify_stat_ops, &control_connects, 0444);
+MODULE_PARM_DESC(control_connects, "Connect requests sent over a control channel");
+
+static LIST_HEAD(xen_ctrls);
+static DEFINE_MUTEX(xen_ctrl_mutex);
+
+static LIST_HEAD(xen_listeners);        /* listening sockets, through listen_list */
+static DEFINE_SPINLOCK(xen_listeners_lock);
+
+static void xen_ctrl_scan (struct work_struct *work);
+static DECLARE_WORK(xen_ctrl_scan_work, xen_ctrl_scan);
+static struct xenbus_watch xen_ctrl_watch;
+
+static int
+xen_ctrl_peer_gone (struct xen_ctrl *c) {
+	return c->is_owner ? READ_ONCE(c->page->mapper_gone) : READ_ONCE(c->page->owner_gone);
+}
+
+/* Post one message to the peer, waiting for room if the ring is full. */
+static int
+xen_ctrl_send (struct xen_ctrl *c, u32 type, u32 id, const char *service) {
+	struct xen_ctrl_ring *ring = c->tx;
+	struct xen_ctrl_msg  *m;
+	unsigned int          prod;
+	int                   rc = 0;
+
+	mutex_lock(&c->tx_lock);
+	prod = ring->prod;
+	if (!wait_event_timeout(c->wq, c->dead || xen_ctrl_peer_gone(c) ||
+			prod - smp_load_acquire(&ring->cons) < XEN_CTRL_RING_SIZE, XEN_CTRL_TIMEOUT)) {
+		rc = -ETIMEDOUT;
+	}
+	else if (c->dead || xen_ctrl_peer_gone(c)) {
+		rc = -ENOTCONN;
+	}
+	else {
+		m = &ring->msg[prod & (XEN_CTRL_RING_SIZE - 1)];
+		m->type = type;
+		m->id = id;
+		memset(m->service, 0, sizeof(m->service));
+		if (service) {
+			strlcpy(m->service, service, sizeof(m->service));
+		}
+		smp_store_release(&ring->prod, prod + 1);
+		backend->notify(c->evtchn_port);
+	}
+	mutex_unlock(&c->tx_lock);
+	return rc;
+}
+
+static void
+xen_ctrl_free (struct kref *kref) {
+	struct xen_ctrl *c = container_of(kref, struct xen_ctrl, kref);
+
+	if (c->irq > 0) {
+		unbind_evtchn_irq(c->irq, c);
+	}
+	cancel_work_sync(&c->work);
+
+	if (c->is_owner) {
+		if (c->gref >= 0) {
+			/* frees the page once the peer has unmapped it */
+			backend->end_grant_page(c->gref, 0, (unsigned long)c->page);
+		}
+		else if (c->page) {
+			free_page((unsigned long)c->page);
+		}
+	}
+	else if (c->page) {
+		backend->unmap(c->page, c->area, &c->handle, 1);
+	}
+	kfree(c);
+}
+
+static void
+xen_ctrl_put (struct xen_ctrl *c) {
+	kref_put(&c->kref, xen_ctrl_free);
+}
+
+/* Give up channel @c: tell the peer, refuse whatever is still waiting
+ * for an answer and drop the list's reference.  Called with
+ * xen_ctrl_mutex held.
+ */
+static void
+xen_ctrl_close (struct xen_ctrl *c) {
+	struct xen_sock *x;
+
+	list_del(&c->list);
+	WRITE_ONCE(c->dead, 1);
+	wake_up_all(&c->wq);
+
+	if (c->is_owner) {
+		char node[32], name[16];
+
+		WRITE_ONCE(c->page->owner_gone, 1);
+		sprintf(node, "/xensocket/control/%d", c->otherend_id);
+		sprintf(name, "%d", mydomid);
+		backend->rm(XBT_NIL, node, name);
+	}
+	else {
+		WRITE_ONCE(c->page->mapper_gone, 1);
+	}
+	if (c->irq > 0) {
+		backend->notify(c->evtchn_port);
+		unbind_evtchn_irq(c->irq, c);
+		c->irq = -1;
+	}
+	cancel_work_sync(&c->work);
+
+	spin_lock(&c->lock);
+	while (!list_empty(&c->pending)) {
+		x = list_first_entry(&c->pending, struct xen_sock, ctrl_list);
+		list_del_init(&x->ctrl_list);
+		x->ctrl_state = XEN_CTRL_REFUSED;
+		x->sk.sk_err = ECONNREFUSED;
+		if (x->sk.sk_socket) {
+			x->sk.sk_socket->state = SS_UNCONNECTED;
+		}
+		xen_connect_withdraw_refused(x);
+		xen_sock_wake(&x->sk);
+	}
+	spin_unlock(&c->lock);
+
+	xen_ctrl_put(c);
+}
+
+/* Connector side: the listener answered request @id. */
+static void
+xen_ctrl_answered (struct xen_ctrl *c, u32 type, u32 id) {
+	struct xen_sock *x;
+
+	spin_lock(&c->lock);
+	list_for_each_entry(x, &c->pending, ctrl_list) {
+		struct socket *sock = x->sk.sk_socket;
+
+		if (x->ctrl_id != id) {
+			continue;
+		}
+		list_del_init(&x->ctrl_list);
+		if (type == XEN_CTRL_ACCEPT) {
+			xen_setup_account(XEN_SETUP_WAIT, ktime_get_ns() - x->published_ns);
+			x->ctrl_state = XEN_CTRL_ACCEPTED;
+			if (sock) {
+				sock->state = SS_CONNECTED;
+			}
+		}
+		else if (type == XEN_CTRL_REFUSE) {
+			x->ctrl_state = XEN_CTRL_REFUSED;
+			x->sk.sk_err = ECONNREFUSED;
+			if (sock) {
+				sock->state = SS_UNCONNECTED;
+			}
+			xen_connect_withdraw_refused(x);
+		}
+		else {
+			/* xen_connect_abort() is waiting for this */
+			x->ctrl_state = XEN_CTRL_GONE;
+		}
+		xen_sock_wake(&x->sk);
+		break;
+	}
+	spin_unlock(&c->lock);
+}
+
+/* Listener side: queue a CONNECT on the socket listening on @service. */
+static void
+xen_ctrl_request (struct xen_ctrl *c, u32 id, const char *service) {
+	struct xen_ctrl_req *req;
+	struct xen_sock     *x;
+
+	if ((req = kmalloc(sizeof(*req), GFP_KERNEL))) {
+		req->ctrl = c;
+		req->id = id;
+		req->arrived_ns = ktime_get_ns();
+
+		spin_lock(&xen_listeners_lock);
+		list_for_each_entry(x, &xen_listeners, listen_list) {
+			if (strcmp(x->service, service) == 0) {
+				kref_get(&c->kref);
+				spin_lock(&x->accept_lock);
+				list_add_tail(&req->list, &x->ctrl_requests);
+				spin_unlock(&x->accept_lock);
+				schedule_work(&x->accept_work);
+				spin_unlock(&xen_listeners_lock);
+				return;
+			}
+		}
+		spin_unlock(&xen_listeners_lock);
+		kfree(req);
+	}
+
+	xen_ctrl_send(c, XEN_CTRL_REFUSE, id, NULL);
+}
+
+/* Listener side: drop request @id if no accept work has taken it yet.
+ * Otherwise its answer is on the way and says all the connector needs.
+ */
+static void
+xen_ctrl_withdraw_request (struct xen_ctrl *c, u32 id) {
+	struct xen_ctrl_req *req, *found = NULL;
+	struct xen_sock     *x;
+
+	spin_lock(&xen_listeners_lock);
+	list_for_each_entry(x, &xen_listeners, listen_list) {
+		spin_lock(&x->accept_lock);
+		list_for_each_entry(req, &x->ctrl_requests, list) {
+			if (req->ctrl == c && req->id == id) {
+				list_del(&req->list);
+				found = req;
+				break;
+			}
+		}
+		spin_unlock(&x->accept_lock);
+		if (found) {
+			break;
+		}
+	}
+	spin_unlock(&xen_listeners_lock);
+
+	if (found) {
+		xen_ctrl_send(c, XEN_CTRL_WITHDRAWN, id, NULL);
+		xen_ctrl_put(c);
+		kfree(found);
+	}
+}
+
+static void
+xen_ctrl_work (struct work_struct *work) {
+	struct xen_ctrl      *c = container_of(work, struct xen_ctrl, work);
+	struct xen_ctrl_ring *ring = c->rx;
+	struct xen_ctrl_msg   m;
+	unsigned int          cons = ring->cons;
+	int                   consumed = 0;
+
+	while (cons != smp_load_acquire(&ring->prod)) {
+		m = ring->msg[cons & (XEN_CTRL_RING_SIZE - 1)];
+		m.service[XENSRVLEN - 1] = '\0';
+		smp_store_release(&ring->cons, ++cons);
+		consumed = 1;
+
+		if (c->is_owner) {
+			xen_ctrl_answered(c, m.type, m.id);
+		}
+		else if (m.type == XEN_CTRL_CONNECT) {
+			xen_ctrl_request(c, m.id, m.service);
+		}
+		else if (m.type == XEN_CTRL_WITHDRAW) {
+			xen_ctrl_withdraw_request(c, m.id);
+		}
+	}
+	if (consumed) {
+		/* the peer may be waiting for room */
+		backend->notify(c->evtchn_port);
+	}
+
+	if (!c->is_owner && xen_ctrl_peer_gone(c)) {
+		schedule_work(&xen_ctrl_scan_work);
+	}
+	wake_up_all(&c->wq);
+}
+
+static irqreturn_t
+xen_ctrl_interrupt (int irq, void *dev_id) {
+	struct xen_ctrl *c = dev_id;
+
+	wake_up_all(&c->wq);
+	schedule_work(&c->work);
+	return IRQ_HANDLED;
+}
+
+static struct xen_ctrl *
+xen_ctrl_alloc (domid_t otherend_id, int is_owner) {
+	struct xen_ctrl *c;
+
+	if (!(c = kzalloc(sizeof(*c), GFP_KERNEL))) {
+		return NULL;
+	}
+	kref_init(&c->kref);
+	c->otherend_id = otherend_id;
+	c->is_owner = is_owner;
+	c->gref = -ENOSPC;
+	c->handle = -1;
+	c->irq = -1;
+	spin_lock_init(&c->lock);
+	INIT_LIST_HEAD(&c->pending);
+	mutex_init(&c->tx_lock);
+	init_waitqueue_head(&c->wq);
+	INIT_WORK(&c->work, xen_ctrl_work);
+	return c;
+}
+
+/* Connector side: grant a new control page to @otherend_id and publish
+ * it.  Called with xen_ctrl_mutex held.
+ */
+static struct xen_ctrl *
+xen_ctrl_open (domid_t otherend_id) {
+	struct xen_ctrl *c;
+	char   node[32], name[16];
+	int    rc;
+
+	TRACE_ENTRY;
+
+	if (!(c = xen_ctrl_alloc(otherend_id, 1))) {
+		goto err;
+	}
+	if (!(c->page = (struct xen_ctrl_page *)get_zeroed_page(GFP_KERNEL))) {
+		goto err_free;
+	}
+	c->tx = &c->page->req;
+	c->rx = &c->page->rsp;
+
+	if ((c->gref = grant_page(otherend_id, virt_to_frame(c->page), 0)) < 0) {
+		DPRINTK("error: cannot share control page\n");
+		goto err_free;
+	}
+
+	if (backend->alloc_evtchn(otherend_id, &c->evtchn_port) != 0) {
+		DPRINTK("Unable to allocate event channel\n");
+		goto err_free;
+	}
+	if ((rc = backend->bind_irq(c->evtchn_port, xen_ctrl_interrupt, "xensocket-ctrl", c)) <= 0) {
+		DPRINTK("Unable to bind event channel to irqhandler\n");
+		goto err_free;
+	}
+	c->irq = rc;
+
+	sprintf(node, "/xensocket/control/%d", otherend_id);
+	sprintf(name, "%d", mydomid);
+	if (store_printf(XBT_NIL, node, name, "%d %u", c->gref, c->evtchn_port) < 0) {
+		goto err_free;
+	}
+	list_add(&c->list, &xen_ctrls);
+
+	TRACE_EXIT;
+	return c;
+
+err_free:
+	xen_ctrl_put(c);
+
+err:
+	TRACE_ERROR;
+	return NULL;
+}
+
+/* Listener side: map the control page @gref of @otherend_id and bind to
+ * its event channel @port.  Called with xen_ctrl_mutex held.
+ */
+static void
+xen_ctrl_map (domid_t otherend_id, int gref, unsigned int port) {
+	struct xen_ctrl *c;
+	void   *addr;
+	int    rc;
+
+	TRACE_ENTRY;
+
+	if (!(c = xen_ctrl_alloc(otherend_id, 0))) {
+		goto err;
+	}
+	c->gref = gref;
+	addr = backend->map(otherend_id, &c->gref, 1, 0, &c->handle, &c->area);
+	if (IS_ERR(addr)) {
+		goto err_free;
+	}
+	c->page = addr;
+	if (READ_ONCE(c->page->mapper_gone)) {
+		/* left over from before we were loaded; the owner replaces it */
+		goto err_free;
+	}
+	c->tx = &c->page->rsp;
+	c->rx = &c->page->req;
+
+	if (backend->bind_evtchn(otherend_id, port, &c->evtchn_port) != 0) {
+		DPRINTK("Unable to bind to control event channel of domain %d\n", otherend_id);
+		goto err_free;
+	}
+	if ((rc = backend->bind_irq(c->evtchn_port, xen_ctrl_interrupt, "xensocket-ctrl", c)) <= 0) {
+		DPRINTK("Unable to bind event channel to irqhandler\n");
+		goto err_free;
+	}
+	c->irq = rc;
+	list_add(&c->list, &xen_ctrls);
+
+	smp_wmb();
+	WRITE_ONCE(c->page->mapper_ready, 1);
+	backend->notify(c->evtchn_port);
+	/* requests may have been posted before we got here */
+	schedule_work(&c->work);
+
+	TRACE_EXIT;
+	return;
+
+err_free:
+	xen_ctrl_put(c);
+
+err:
+	TRACE_ERROR;
+}
+
+/* Map the channels published for us and drop those whose owner went
+ * away or replaced its page.
+ */
+static void
+xen_ctrl_scan (struct work_struct *work) {
+	struct xen_ctrl *c, *tmp;
+	const char      *node = xen_ctrl_watch.node;
+	char           **dir;
+	unsigned int     n = 0;
+	unsigned int     i;
+	unsigned int     port;
+	int              gref, domid;
+
+	mutex_lock(&xen_ctrl_mutex);
+
+	list_for_each_entry_safe(c, tmp, &xen_ctrls, list) {
+		char name[16];
+
+		if (c->is_owner) {
+			continue;
+		}
+		sprintf(name, "%d", c->otherend_id);
+		if (xen_ctrl_peer_gone(c) ||
+				store_scanf(XBT_NIL, node, name, "%d %u", &gref, &port) != 2 ||
+				gref != c->gref) {
+			xen_ctrl_close(c);
+		}
+	}
+
+	dir = backend->directory(XBT_NIL, node, "", &n);
+	if (IS_ERR(dir)) {
+		mutex_unlock(&xen_ctrl_mutex);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		int mapped = 0;
+
+		if (kstrtoint(dir[i], 10, &domid) != 0 ||
+				store_scanf(XBT_NIL, node, dir[i], "%d %u", &gref, &port) != 2) {
+			continue;
+		}
+		list_for_each_entry(c, &xen_ctrls, list) {
+			if (!c->is_owner && c->otherend_id == domid) {
+				mapped = 1;
+				break;
+			}
+		}
+		if (!mapped) {
+			xen_ctrl_map(domid, gref, port);
+		}
+	}
+	kfree(dir);
+
+	mutex_unlock(&xen_ctrl_mutex);
+}
+
+static void
+xen_watch_ctrl (struct xenbus_watch *xbw, const char **vec, unsigned int len) {
+	schedule_work(&xen_ctrl_scan_work);
+}
+
+/* Connector side: the channel to @otherend_id, set up if need be, or
+ * NULL if there is none the peer has mapped.
+ */
+static struct xen_ctrl *
+xen_ctrl_get (domid_t otherend_id) {
+	struct xen_ctrl *c, *found = NULL;
+
+	if (!control_channels) {
+		return NULL;
+	}
+
+	mutex_lock(&xen_ctrl_mutex);
+	list_for_each_entry(c, &xen_ctrls, list) {
+		if (c->is_owner && c->otherend_id == otherend_id) {
+			found = c;
+			break;
+		}
+	}
+	if (found && xen_ctrl_peer_gone(found)) {
+		xen_ctrl_close(found);
+		found = NULL;
+	}
+	if (!found && !(found = xen_ctrl_open(otherend_id))) {
+		mutex_unlock(&xen_ctrl_mutex);
+		return NULL;
+	}
+	kref_get(&found->kref);
+	mutex_unlock(&xen_ctrl_mutex);
+
+	if (!READ_ONCE(found->page->mapper_ready) && !found->stale) {
+		/* only the first connect() waits for the peer to pick it up */
+		if (!wait_event_timeout(found->wq, READ_ONCE(found->page->mapper_ready) || found->dead,
+				XEN_CTRL_SETUP_TIMEOUT)) {
+			found->stale = 1;
+		}
+	}
+	if (!READ_ONCE(found->page->mapper_ready) || found->dead) {
+		xen_ctrl_put(found);
+		return NULL;
+	}
+	smp_rmb();
+	return found;
+}
+
+/* Send the connect request of @x over @c, whose reference @x takes over
+ * on success.
+ */
+static int
+xen_ctrl_connect (struct xen_sock *x, struct xen_ctrl *c, const char *service) {
+	struct socket *sock = x->sk.sk_socket;
+	int    rc;
+
+	x->ctrl = c;
+	x->ctrl_id = x->tx.descriptor_gref;
+	x->ctrl_state = XEN_CTRL_PENDING;
+	sock->state = SS_CONNECTING;
+
+	spin_lock(&c->lock);
+	list_add_tail(&x->ctrl_list, &c->pending);
+	spin_unlock(&c->lock);
+
+	if ((rc = xen_ctrl_send(c, XEN_CTRL_CONNECT, x->ctrl_id, service)) != 0) {
+		spin_lock(&c->lock);
+		list_del_init(&x->ctrl_list);
+		spin_unlock(&c->lock);
+		x->ctrl = NULL;
+		x->ctrl_state = XEN_CTRL_NONE;
+		sock->state = SS_UNCONNECTED;
+		return rc;
+	}
+
+	atomic_long_inc(&control_connects);
+	return 0;
+}
+
+/* Connector side counterpart of xen_connect_abort(): withdraw a request
+ * that is still pending and drop the channel.  Returns 1 unless the
+ * listener accepted the request.
+ */
+static int
+xen_ctrl_withdraw (struct xen_sock *x) {
+	struct xen_ctrl *c = x->ctrl;
+	int    accepted;
+
+	if (READ_ONCE(x->ctrl_state) == XEN_CTRL_PENDING &&
+			xen_ctrl_send(c, XEN_CTRL_WITHDRAW, x->ctrl_id, NULL) == 0) {
+		wait_event_timeout(c->wq, READ_ONCE(x->ctrl_state) != XEN_CTRL_PENDING, XEN_CTRL_TIMEOUT);
+	}
+
+	spin_lock(&c->lock);
+	if (x->ctrl_state == XEN_CTRL_PENDING) {
+		/* no answer; the peer is not going to map these rings */
+		list_del_init(&x->ctrl_list);
+		x->ctrl_state = XEN_CTRL_GONE;
+	}
+	spin_unlock(&c->lock);
+
+	accepted = x->ctrl_state == XEN_CTRL_ACCEPTED;
+	if (!accepted) {
+		x->ctrl = NULL;
+		x->ctrl_state = XEN_CTRL_NONE;
+		xen_ctrl_put(c);
+	}
+	return !accepted;
+}
+
+/* Listener side: make @x reachable over control channels. */
+static void
+xen_ctrl_listen (struct xen_sock *x) {
+	spin_lock(&xen_listeners_lock);
+	list_add_tail(&x->listen_list, &xen_listeners);
+	spin_unlock(&xen_listeners_lock);
+}
+
+/* Listener side: stop taking requests for @x and refuse those queued. */
+static void
+xen_ctrl_unlisten (struct xen_sock *x) {
+	struct xen_ctrl_req *req, *tmp;
+	LIST_HEAD(refused);
+
+	spin_lock(&xen_listeners_lock);
+	list_del_init(&x->listen_list);
+	spin_lock(&x->accept_lock);
+	list_splice_init(&x->ctrl_requests, &refused);
+	spin_unlock(&x->accept_lock);
+	spin_unlock(&xen_listeners_lock);
+
+	list_for_each_entry_safe(req, tmp, &refused, list) {
+		xen_ctrl_send(req->ctrl, XEN_CTRL_REFUSE, req->id, NULL);
+		xen_ctrl_put(req->ctrl);
+		kfree(req);
+	}
+}
+
+/* Listener side, from the accept work: take queued requests while the
+ * backlog has room and answer each.
+ */
+static void
+xen_ctrl_accept_requests (struct xen_sock *x) {
+	struct xen_ctrl_req *req;
+	int    rc;
+
+	while (!xen_accept_full(x)) {
+		spin_lock(&x->accept_lock);
+		req = list_first_entry_or_null(&x->ctrl_requests, struct xen_ctrl_req, list);
+		if (req) {
+			list_del(&req->list);
+		}
+		spin_unlock(&x->accept_lock);
+		if (!req) {
+			break;
+		}
+		xen_setup_account(XEN_SETUP_WATCH, ktime_get_ns() - req->arrived_ns);
+
+		rc = xen_accept_one(x, req->id, req->ctrl->otherend_id);
+		xen_ctrl_send(req->ctrl, rc ? XEN_CTRL_REFUSE : XEN_CTRL_ACCEPT, req->id, NULL);
+		xen_ctrl_put(req->ctrl);
+		kfree(req);
+	}
+}
+
+static int
+xen_service_flags (void) {
+	return xen_ctrl_watch.node ? XEN_SERVICE_CONTROL : 0;
+}
+
+static void
+xen_ctrl_init (void) {
+	xen_ctrl_watch.node = kasprintf(GFP_KERNEL, "/xensocket/control/%d", mydomid);
+	xen_ctrl_watch.callback = xen_watch_ctrl;
+	if (!xen_ctrl_watch.node || backend->register_watch(&xen_ctrl_watch) != 0) {
+		printk(KERN_CRIT "pfxen: control channels disabled\n");
+		kfree(xen_ctrl_watch.node);
+		xen_ctrl_watch.node = NULL;
+	}
+}
+
+static void
+xen_ctrl_exit (void) {
+	struct xen_ctrl *c, *tmp;
+
+	if (xen_ctrl_watch.node) {
+		backend->unregister_watch(&xen_ctrl_watch);
+		cancel_work_sync(&xen_ctrl_scan_work);
+		kfree(xen_ctrl_watch.node);
+		xen_ctrl_watch.node = NULL;
+	}
+
+	mutex_lock(&xen_ctrl_mutex);
+	list_for_each_entry_safe(c, tmp, &xen_ctrls, list) {
+		xen_ctrl_close(c);
+	}
+	mutex_unlock(&xen_ctrl_mutex);
+}
+
+/************************************************************************
+ * Pre-granted ring pool.
+ *
+ * The connecting side of a connection allocates and grants two
+ * descriptor pages and two buffers and allocates an event channel, all
+ * for one peer domain.  None of that depends on the connection itself.
+ * So when the connector closes, the whole set is reset and kept on a
+ * pool, and the next connect() to the same domain with the same ring
+ * sizes and version takes it instead of starting over.
+ *
+ * A pooled entry keeps its event channel bound to an irq, since
+ * unbinding would close the port; the handler wakes whichever socket
+ * owns the entry at the time.  When the acceptor closes its end, Xen
+ * returns our port to the unbound state, ready for the next acceptor
+ * from the same domain.  Entries whose port is still connected are
+ * passed over until then.
+ *
+ * pool_max_per_domain and pool_max_entries bound the memory and grant
+ * references that idle entries hold, and a shrinker hands them back,
+ * least recently used first, when memory runs short.
+ ************************************************************************/
+
+struct xen_pool_entry {
+	struct list_head        list;       /* on xen_pool while idle */
+	domid_t                 otherend_id;
+	struct xen_ring         tx;
+	struct xen_ring         rx;
+	int                     tx_order;   /* asked for; the rings may be smaller */
+	int                     rx_order;
+	unsigned int            evtchn_local_port;
+	int                     irq;
+	struct xen_sock        *owner;      /* NULL while idle */
+};
+
+static unsigned int pool_max_per_domain = 8;
+module_param(pool_max_per_domain, uint, 0644);
+MODULE_PARM_DESC(pool_max_per_domain, "Idle pre-granted connections kept per peer domain (0 disables the pool)");
+
+static unsigned int pool_max_entries = 64;
+module_param(pool_max_entries, uint, 0644);
+MODULE_PARM_DESC(pool_max_entries, "Idle pre-granted connections kept in total");
+
+static atomic_long_t pool_hits = ATOMIC_LONG_INIT(0);
+static atomic_long_t pool_misses = ATOMIC_LONG_INIT(0);
+
+module_param_cb(pool_hits, &notify_stat_ops, &pool_hits, 0444);
+MODULE_PARM_DESC(pool_hits, "Connects served from the ring pool");
+module_param_cb(pool_misses, &notify_stat_ops, &pool_misses, 0444);
+MODULE_PARM_DESC(pool_misses, "Connects that had to grant new rings");
+
+static LIST_HEAD(xen_pool);             /* most recently used first */
+static DEFINE_SPINLOCK(xen_pool_lock);
+static unsigned int xen_pool_count;
+
+static void
+xen_pool_entry_free (struct xen_pool_entry *e) {
+	if (e->irq >= 0) {
+		unbind_evtchn_irq(e->irq, e);
+	}
+	server_unallocate_buffer_pages(&e->tx);
+	server_unallocate_buffer_pages(&e->rx);
+	server_unallocate_descriptor_page(&e->tx);
+	server_unallocate_descriptor_page(&e->rx);
+	kfree(e);
+}
+
+static struct xen_pool_entry *
+xen_pool_entry_alloc (domid_t otherend_id, int version, int tx_order, int rx_order) {
+	struct xen_pool_entry *e;
+	int    rc = -ENOMEM;
+
+	TRACE_ENTRY;
+
+	if (!(e = kzalloc(sizeof(*e), GFP_KERNEL))) {
+		goto err;
+	}
+	INIT_LIST_HEAD(&e->list);
+	e->otherend_id = otherend_id;
+	e->tx_order = tx_order;
+	e->rx_order = rx_order;
+	initialize_xen_ring(&e->tx);
+	initialize_xen_ring(&e->rx);
+	e->evtchn_local_port = -1;
+	e->irq = -1;
+
+	printk(KERN_CRIT "pfxen: allocating descriptor pages...");
+	if ((rc = server_allocate_descriptor_page(otherend_id, &e->tx)) != 0) {
+		goto err_free;
+	}
+	if ((rc = server_allocate_descriptor_page(otherend_id, &e->rx)) != 0) {
+		goto err_free;
+	}
+	e->tx.descriptor_addr->reverse_descriptor_gref = e->rx.descriptor_gref;
+	e->tx.version = e->rx.version = version;
+	e->tx.descriptor_addr->ring_version = XENSOCKET_RING_MAGIC | version;
+	e->rx.descriptor_addr->ring_version = XENSOCKET_RING_MAGIC | version;
+	printk(KERN_CRIT "pfxen: allocating event channel...");
+	if ((rc = server_allocate_event_channel(e)) != 0) {
+		goto err_free;
+	}
+	printk(KERN_CRIT "pfxen: allocating buffer pages...");
+	if ((rc = server_allocate_buffer_pages(otherend_id, &e->tx, tx_order)) != 0) {
+		goto err_free;
+	}
+	if ((rc = server_allocate_buffer_pages(otherend_id, &e->rx, rx_order)) != 0) {
+		goto err_free;
+	}
+
+	TRACE_EXIT;
+	return e;
+
+err_free:
+	xen_pool_entry_free(e);
+
+err:
+	TRACE_ERROR;
+	return ERR_PTR(rc);
+}
+
+/* Put the shared state of a ring back to how a fresh one starts out,
+ * keeping the grants and everything the acceptor needs to map it.
+ */
+static void
+reset_descriptor_page (struct xen_ring *r) {
+	struct descriptor_page *d = r->descriptor_addr;
+
+	d->send_offset = 0;
+	d->recv_offset = 0;
+	d->total_bytes_sent = 0;
+	d->total_bytes_received = 0;
+	d->send_event = 0;
+	d->recv_event = 1;
+	atomic_set(&d->avail_bytes, ring_size(r));
+	atomic_set(&d->sender_has_shutdown, 0);
+	atomic_set(&d->force_sender_shutdown, 0);
+	atomic_set(&d->unmapped, 0);
+	d->bulk_list_gref = -ENOSPC;
+	d->queue_count = 1;
+	d->prod = 0;
+	d->bulk_posted = 0;
+	d->bulk_len = 0;
+	d->cons = 0;
+	d->bulk_done = 0;
+	d->bulk_refused = 0;
+}
+
+/* The previous acceptor has closed its end of the event channel, so a
+ * new one can bind to it.
+ */
+static int
+xen_pool_entry_unbound (struct xen_pool_entry *e) {
+	return backend->evtchn_unbound(e->evtchn_local_port);
+}
+
+static struct xen_pool_entry *
+xen_pool_take (struct xen_sock *x, int version, int tx_order, int rx_order) {
+	struct xen_pool_entry *e, *found = NULL;
+
+	spin_lock(&xen_pool_lock);
+	list_for_each_entry(e, &xen_pool, list) {
+		if (e->otherend_id == x->otherend_id && e->tx.version == version &&
+				e->tx_order == tx_order && e->rx_order == rx_order &&
+				xen_pool_entry_unbound(e)) {
+			list_del_init(&e->list);
+			xen_pool_count--;
+			found = e;
+			break;
+		}
+	}
+	spin_unlock(&xen_pool_lock);
+
+	if (found) {
+		atomic_long_inc(&pool_hits);
+	}
+	else {
+		atomic_long_inc(&pool_misses);
+		found = xen_pool_entry_alloc(x->otherend_id, version, tx_order, rx_order);
+		if (IS_ERR(found)) {
+			return found;
+		}
+	}
+
+	WRITE_ONCE(found->owner, x);
+	return found;
+}
+
+/* Give a connection back once the peer has unmapped it (or never saw
+ * it).  It is kept if the limits allow and freed otherwise.
+ */
+static void
+xen_pool_put (struct xen_pool_entry *e) {
+	struct xen_pool_entry *p;
+	unsigned int same_domain = 0;
+
+	/* the old owner may be freed as soon as its handler has finished */
+	WRITE_ONCE(e->owner, NULL);
+	backend->sync_irq(e->irq);
+
+	reset_descriptor_page(&e->tx);
+	reset_descriptor_page(&e->rx);
+
+	spin_lock(&xen_pool_lock);
+	list_for_each_entry(p, &xen_pool, list) {
+		if (p->otherend_id == e->otherend_id) {
+			same_domain++;
+		}
+	}
+	if (same_domain < pool_max_per_domain && xen_pool_count < pool_max_entries) {
+		list_add(&e->list, &xen_pool);
+		xen_pool_count++;
+		e = NULL;
+	}
+	spin_unlock(&xen_pool_lock);
+
+	if (e) {
+		xen_pool_entry_free(e);
+	}
+}
+
+static void
+xen_sock_detach_pool_entry (struct xen_sock *x) {
+	int i;
+
+	if (!x->pool_entry) {
+		return;
+	}
+	xen_defer_cancel(x);
+	for (i = 1; i < x->nr_queues; i++) {
+		xen_pool_put(x->queues[i - 1].pool_entry);
+	}
+	kfree(x->queues);
+	x->queues = NULL;
+	x->nr_queues = 1;
+	xen_pool_put(x->pool_entry);
+	x->pool_entry = NULL;
+	initialize_xen_ring(&x->tx);
+	initialize_xen_ring(&x->rx);
+	x->evtchn_local_port = -1;
+}
+
+/* The peer may still have the rings of @e mapped, so they must neither
+ * go back to the pool nor be freed.  End the grants, which Xen finishes
+ * once the peer lets go, close the event channel and leak the pages.
+ */
+static void
+xen_pool_entry_abandon (struct xen_pool_entry *e) {
+	struct xen_ring *rings[2] = { &e->tx, &e->rx };
+	int i, j;
+
+	WRITE_ONCE(e->owner, NULL);
+	if (e->irq >= 0) {
+		unbind_evtchn_irq(e->irq, e);
+	}
+	for (i = 0; i < 2; i++) {
+		struct xen_ring *r = rings[i];
+
+		if (r->buffer_grefs) {
+			for (j = 0; j < (1 << r->buffer_order); j++) {
+				if (r->buffer_grefs[j] == -ENOSPC) {
+					break;
+				}
+				backend->end_grant_page(r->buffer_grefs[j], 0, 0);
+			}
+			kfree(r->buffer_grefs);
+		}
+		for (j = 0; j < r->indirect_pages; j++) {
+			if (r->indirect_grefs[j] != -ENOSPC) {
+				backend->end_grant_page(r->indirect_grefs[j], 1, 0);
+			}
+		}
+		if (r->descriptor_gref != -ENOSPC) {
+			backend->end_grant_page(r->descriptor_gref, 0, 0);
+		}
+	}
+	kfree(e);
+}
+
+/* Like xen_sock_detach_pool_entry(), for rings the peer never released */
+static void
+xen_sock_abandon_pool_entry (struct xen_sock *x) {
+	int i;
+
+	if (!x->pool_entry) {
+		return;
+	}
+	xen_defer_cancel(x);
+	for (i = 1; i < x->nr_queues; i++) {
+		xen_pool_entry_abandon(x->queues[i - 1].pool_entry);
+	}
+	kfree(x->queues);
+	x->queues = NULL;
+	x->nr_queues = 1;
+	xen_pool_entry_abandon(x->pool_entry);
+	x->pool_entry = NULL;
+	initialize_xen_ring(&x->tx);
+	initialize_xen_ring(&x->rx);
+	x->evtchn_local_port = -1;
+}
+
+/* Free up to @nr idle entries, oldest first. */
+static unsigned long
+xen_pool_trim (unsigned long nr) {
+	LIST_HEAD(victims);
+	struct xen_pool_entry *e, *tmp;
+	unsigned long freed = 0;
+
+	spin_lock(&xen_pool_lock);
+	while (freed < nr && !list_empty(&xen_pool)) {
+		e = list_last_entry(&xen_pool, struct xen_pool_entry, list);
+		list_move(&e->list, &victims);
+		xen_pool_count--;
+		freed++;
+	}
+	spin_unlock(&xen_pool_lock);
+
+	list_for_each_entry_safe(e, tmp, &victims, list) {
+		list_del(&e->list);
+		xen_pool_entry_free(e);
+	}
+	return freed;
+}
+
+static unsigned long
+xen_pool_shrink_count (struct shrinker *s, struct shrink_control *sc) {
+	return READ_ONCE(xen_pool_count);
+}
+
+static unsigned long
+xen_pool_shrink_scan (struct shrinker *s, struct shrink_control *sc) {
+	/* unbinding an irq may sleep */
+	if (!gfpflags_allow_blocking(sc->gfp_mask)) {
+		return SHRINK_STOP;
+	}
+	return xen_pool_trim(sc->nr_to_scan);
+}
+
+static struct shrinker xen_pool_shrinker = {
+	.count_objects  = xen_pool_shrink_count,
+	.scan_objects   = xen_pool_shrink_scan,
+	.seeks          = DEFAULT_SEEKS,
+};
+
+/************************************************************************
+ * Multi-queue connections (ring protocol version 4).
+ *
+ * With XEN_QUEUES set, a SOCK_SEQPACKET connection carries up to
+ * XENSOCKET_MAX_QUEUES ring pairs, each with its own event channel and
+ * irq, so that senders on different CPUs do not share a producer index
+ * and interrupts need not all land on one CPU.  The connector takes
+ * each extra pair from the ring pool like the first one, and the
+ * acceptor maps them after the first.  Senders pick a queue with
+ * xen_tx_queue(); receivers drain the queue of their own CPU first.
+ * Records keep their order within a queue only, which is why byte
+ * streams always use a single queue.
+ ************************************************************************/
+
+/* Connecting side: grant the extra queues and list them in the forward
+ * descriptor of the first.  On error the caller gives back whatever was
+ * taken with xen_sock_detach_pool_entry().
+ */
+static int
+xen_connect_queues (struct xen_sock *x, int version) {
+	struct descriptor_page *d = x->tx.descriptor_addr;
+	int n = min_t(int, x->want_queues, num_online_cpus());
+	int i;
+
+	if (n <= 1 || version < XENSOCKET_RING_V4) {
+		return 0;
+	}
+	if (!(x->queues = kcalloc(n - 1, sizeof(*x->queues), GFP_KERNEL))) {
+		return -ENOMEM;
+	}
+
+	for (i = 1; i < n; i++) {
+		struct xen_queue      *q = &x->queues[i - 1];
+		struct xen_pool_entry *e;
+
+		initialize_xen_queue(q);
+		e = xen_pool_take(x, version, x->tx.buffer_order, x->rx.buffer_order);
+		if (IS_ERR(e)) {
+			return PTR_ERR(e);
+		}
+		q->pool_entry = e;
+		q->tx = e->tx;
+		q->rx = e->rx;
+		d->queue_grefs[i - 1] = q->tx.descriptor_gref;
+		x->nr_queues = i + 1;
+	}
+	d->queue_count = n;
+
+	return 0;
+}
+
+/* Accepting side: map the extra queues the connector listed.  On error
+ * the caller unmaps whatever was mapped with xen_unmap_queues().
+ */
+static int
+xen_accept_queues (struct xen_sock *x) {
+	struct descriptor_page *d = x->rx.descriptor_addr;
+	int n, i, rc;
+
+	if (x->rx.version < XENSOCKET_RING_V4 || d->queue_count <= 1) {
+		return 0;
+	}
+	n = min_t(int, d->queue_count, XENSOCKET_MAX_QUEUES);
+	if (!(x->queues = kcalloc(n - 1, sizeof(*x->queues), GFP_KERNEL))) {
+		return -ENOMEM;
+	}
+	for (i = 1; i < n; i++) {
+		initialize_xen_queue(&x->queues[i - 1]);
+	}
+	x->nr_queues = n;
+
+	for (i = 1; i < n; i++) {
+		struct xen_queue *q = &x->queues[i - 1];
+
+		q->rx.descriptor_gref = d->queue_grefs[i - 1];
+		if ((rc = client_map_descriptor_page(x, &q->rx)) != 0) {
+			return rc;
+		}
+		if ((rc = descriptor_ring_version(q->rx.descriptor_addr)) < 0) {
+			return rc;
+		}
+		q->rx.version = rc;
+		q->tx.descriptor_gref = q->rx.descriptor_addr->reverse_descriptor_gref;
+		if ((rc = client_map_descriptor_page(x, &q->tx)) != 0) {
+			return rc;
+		}
+		if ((rc = descriptor_ring_version(q->tx.descriptor_addr)) < 0) {
+			return rc;
+		}
+		q->tx.version = rc;
+		if ((rc = client_bind_event_channel(x, &q->rx, &q->tx, &q->irq)) != 0) {
+			return rc;
+		}
+		if ((rc = client_map_buffer_pages(x, &q->rx)) != 0) {
+			return rc;
+		}
+		if ((rc = client_map_buffer_pages(x, &q->tx)) != 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/* Accepting side: unmap the extra queues and close their event
+ * channels, which hands the pairs back to the connector's pool.
+ */
+static void
+xen_unmap_queues (struct xen_sock *x) {
+	int i;
+
+	xen_defer_cancel(x);
+	for (i = 1; i < x->nr_queues; i++) {
+		struct xen_queue *q = &x->queues[i - 1];
+
+		if (q->rx.descriptor_addr) {
+			atomic_set(&q->rx.descriptor_addr->force_sender_shutdown, 1);
+		}
+		client_unmap_buffer_pages(&q->rx);
+		client_unmap_buffer_pages(&q->tx);
+		client_unmap_descriptor_page(&q->rx);
+		client_unmap_descriptor_page(&q->tx);
+		if (q->irq != -1) {
+			backend->notify(q->rx.evtchn_port);
+			unbind_evtchn_irq(q->irq, x);
+			q->irq = -1;
+		}
+	}
+	kfree(x->queues);
+	x->queues = NULL;
+	x->nr_queues = 1;
+}
+
+/************************************************************************
+ * Interrupt affinity.
+ *
+ * An event channel starts out delivered to whichever vCPU it was bound
+ * on, so the wakeup of a reader pinned elsewhere costs an IPI and the
+ * cache lines of the socket bounce between CPUs.  Instead, whenever a
+ * reader is about to block, the interrupt of the queue it drains is
+ * moved to its CPU, much as SO_INCOMING_CPU lets a TCP server match
+ * threads to receive queues.  Readers that stay put pay for this once;
+ * XEN_INCOMING_CPU reports where the interrupt went.
+ ************************************************************************/
+
+static bool irq_follow_reader = 1;
+module_param(irq_follow_reader, bool, 0644);
+MODULE_PARM_DESC(irq_follow_reader, "Move each queue's interrupt to the CPU of the reader waiting on it");
+
+static atomic_long_t irq_moves = ATOMIC_LONG_INIT(0);
+module_param_cb(irq_moves, &notify_stat_ops, &irq_moves, 0444);
+MODULE_PARM_DESC(irq_moves, "Interrupts moved to a reader's CPU");
+
+/* The irq of queue @q: the pool entry holds it on the connecting side. */
+static int
+queue_irq (struct xen_sock *x, int q) {
+	if (x->is_client) {
+		struct xen_pool_entry *e = q ? x->queues[q - 1].pool_entry : x->pool_entry;
+
+		return e ? e->irq : -1;
+	}
+	return q ? (int)x->queues[q - 1].irq : (int)x->irq;
+}
+
+static void
+xen_follow_reader (struct xen_sock *x, int q) {
+	struct xen_ring *r = queue_rx(x, q);
+	int cpu = raw_smp_processor_id();
+	int irq;
+
+	if (!irq_follow_reader || READ_ONCE(r->irq_cpu) == cpu) {
+		return;
+	}
+	if ((irq = queue_irq(x, q)) < 0) {
+		return;
+	}
+	/* the Xen irq chip rebinds the event channel to the new vCPU */
+	if (backend->set_irq_cpu(irq, cpu) == 0) {
+		WRITE_ONCE(r->irq_cpu, cpu);
+		atomic_long_inc(&irq_moves);
+	}
+}
+
+/* Unbind an event channel irq; the backend drops any affinity hint
+ * first.
+ */
+static void
+unbind_evtchn_irq (unsigned int irq, void *dev_id) {
+	backend->unbind_irq(irq, dev_id);
+}
+
+/************************************************************************
+ * Deferred wakeups.
+ *
+ * By default every event wakes the socket straight from the interrupt
+ * handler.  With defer_wakeups set, the handler instead disables the irq,
+ * which masks the event channel, and queues the socket on a per-CPU list
+ * that a tasklet drains, as NAPI does for network devices.  Events that
+ * arrive for a socket already queued cost nothing, the sockets of one
+ * CPU are woken in a single pass, at most wakeup_budget at a time, and
+ * each irq is enabled again only after its socket has been woken.
+ ************************************************************************/
+
+static bool defer_wakeups = 0;
+module_param(defer_wakeups, bool, 0644);
+MODULE_PARM_DESC(defer_wakeups, "Mask event channels and batch socket wakeups in a tasklet");
+
+static unsigned int wakeup_budget = 64;
+module_param(wakeup_budget, uint, 0644);
+MODULE_PARM_DESC(wakeup_budget, "Sockets woken per tasklet run before yielding");
+
+static atomic_long_t deferred_wakeups = ATOMIC_LONG_INIT(0);
+module_param_cb(deferred_wakeups, &notify_stat_ops, &deferred_wakeups, 0444);
+MODULE_PARM_DESC(deferred_wakeups, "Socket wakeups done from the tasklet");
+
+struct xen_defer_cpu {
+	struct list_head        list;       /* sockets to wake */
+	struct tasklet_struct   tasklet;
+};
+
+static DEFINE_PER_CPU(struct xen_defer_cpu, xen_defer);
+
+/* Queue @x for a deferred wakeup and mask @irq until then.  Returns 0
+ * if the socket has to be woken directly instead.
+ */
+static int
+xen_defer_wake (struct xen_sock *x, int irq) {
+	struct xen_defer_cpu *c;
+	unsigned long flags;
+	int q;
+
+	spin_lock_irqsave(&x->defer_lock, flags);
+	if (x->defer_dead) {
+		spin_unlock_irqrestore(&x->defer_lock, flags);
+		return 0;
+	}
+	for (q = 0; q < x->nr_queues; q++) {
+		if (queue_irq(x, q) == irq) {
+			break;
+		}
+	}
+	if (q == x->nr_queues) {
+		/* not attached to the socket yet */
+		spin_unlock_irqrestore(&x->defer_lock, flags);
+		return 0;
+	}
+
+	backend->mask_irq(irq);
+	x->defer_masked |= 1UL << q;
+	if (!x->defer_queued) {
+		x->defer_queued = 1;
+		sock_hold(&x->sk);
+		c = this_cpu_ptr(&xen_defer);
+		list_add_tail(&x->defer_list, &c->list);
+		tasklet_schedule(&c->tasklet);
+	}
+	spin_unlock_irqrestore(&x->defer_lock, flags);
+	return 1;
+}
+
+static void
+xen_defer_run (unsigned long data) {
+	struct xen_defer_cpu *c = (struct xen_defer_cpu *)data;
+	unsigned int budget = max(wakeup_budget, 1U);
+	LIST_HEAD(work);
+
+	local_irq_disable();
+	list_splice_init(&c->list, &work);
+	local_irq_enable();
+
+	while (!list_empty(&work)) {
+		struct xen_sock *x;
+		unsigned long    masked;
+		unsigned long    flags;
+		int              requeue;
+		int              q;
+
+		if (budget-- == 0) {
+			/* leave the rest for the next run */
+			local_irq_disable();
+			list_splice(&work, &c->list);
+			local_irq_enable();
+			tasklet_schedule(&c->tasklet);
+			break;
+		}
+
+		/* the handler leaves defer_list alone while defer_queued is set */
+		x = list_first_entry(&work, struct xen_sock, defer_list);
+		list_del_init(&x->defer_list);
+
+		spin_lock_irqsave(&x->defer_lock, flags);
+		masked = x->defer_masked;
+		x->defer_masked = 0;
+		spin_unlock_irqrestore(&x->defer_lock, flags);
+
+		xen_sock_wake(&x->sk);
+		atomic_long_inc(&deferred_wakeups);
+
+		/* an event that came in meanwhile is delivered on enable */
+		for_each_set_bit(q, &masked, XENSOCKET_MAX_QUEUES) {
+			backend->unmask_irq(queue_irq(x, q));
+		}
+
+		/* only now may xen_defer_cancel() let the irqs go */
+		spin_lock_irqsave(&x->defer_lock, flags);
+		requeue = x->defer_masked != 0;
+		if (requeue) {
+			/* masked again since; keep it queued */
+			list_add_tail(&x->defer_list, &work);
+		}
+		else {
+			x->defer_queued = 0;
+		}
+		spin_unlock_irqrestore(&x->defer_lock, flags);
+		if (!requeue) {
+			sock_put(&x->sk);
+		}
+	}
+}
+
+static void
+xen_sock_event (struct xen_sock *x, int irq) {
+	if (READ_ONCE(defer_wakeups) && xen_defer_wake(x, irq)) {
+		return;
+	}
+	xen_sock_wake(&x->sk);
+}
+
+/* Stop deferring wakeups for a socket whose irqs are about to go away,
+ * and wait for a wakeup already queued to enable its irqs again.
+ */
+static void
+xen_defer_cancel (struct xen_sock *x) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&x->defer_lock, flags);
+	x->defer_dead = 1;
+	spin_unlock_irqrestore(&x->defer_lock, flags);
+
+	while (READ_ONCE(x->defer_queued)) {
+		msleep(1);
+	}
+}
+
+/* Undo xen_defer_cancel() for the next connection of the socket. */
+static void
+xen_defer_revive (struct xen_sock *x) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&x->defer_lock, flags);
+	x->defer_dead = 0;
+	spin_unlock_irqrestore(&x->defer_lock, flags);
+}
+
+static void
+xen_defer_init (void) {
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct xen_defer_cpu *c = per_cpu_ptr(&xen_defer, cpu);
+
+		INIT_LIST_HEAD(&c->list);
+		tasklet_init(&c->tasklet, xen_defer_run, (unsigned long)c);
+	}
+}
+
+static void
+xen_defer_exit (void) {
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		tasklet_kill(&per_cpu_ptr(&xen_defer, cpu)->tasklet);
+	}
+}
+
+/************************************************************************
+ * sendfile() and splice().
+ *
+ * Pages handed to sendpage() are copied straight into the tx ring, so
+ * sendfile() from the page cache and splice() from a pipe need no
+ * userspace buffer.  Successive pages of one call come with
+ * MSG_SENDPAGE_NOTLAST and share a single notification.  splice() out
+ * of the socket reads the rx ring into pipe pages through
+ * xen_recvmsg().
+ ************************************************************************/
+
+static ssize_t
+xen_sendpage (struct socket *sock, struct page *page, int offset, size_t size, int flags) {
+	struct msghdr msg = { .msg_flags = flags };
+	struct kvec   iov;
+	int           rc;
+
+	iov.iov_base = kmap(page) + offset;
+	iov.iov_len = size;
+	iov_iter_kvec(&msg.msg_iter, WRITE | ITER_KVEC, &iov, 1, size);
+	rc = xen_sendmsg(sock, &msg, size);
+	kunmap(page);
+
+	return rc;
+}
+
+static ssize_t
+xen_splice_read (struct socket *sock, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+	return default_file_splice_read(sock->file, ppos, pipe, len, flags);
+}
+
+/************************************************************************
+ * Zero-copy ring mapping.
+ *
+ * A process can map the rings of a connected socket and work on them in
+ * place: a producer writes at the tx producer index and publishes with
+ * XEN_RING_COMMIT, a consumer reads at the rx consumer index and hands
+ * the space back with XEN_RING_RELEASE, and poll() is used to sleep.
+ * The descriptor pages are mapped read-only, since the peer and this
+ * module trust their contents; the indices only move through the
+ * ioctls, which check them and decide whether the peer needs a kick.
+ *
+ * Only the connecting side can map its rings, as there they are
+ * ordinary local pages.  The accepting side has them grant-mapped from
+ * the peer, which cannot be handed on to a process this way.  Only
+ * version 2 rings are supported, because userspace relies on the
+ * free-running indices.
+ *
+ * Each mapping holds the rings, not just the socket: close() signals
+ * the peer as usual, but the rings only go back to the pool with the
+ * last munmap().
+ ************************************************************************/
+
+static void
+xen_vm_open (struct vm_area_struct *vma) {
+	struct xen_sock *x = vma->vm_private_data;
+
+	sock_hold(&x->sk);
+	atomic_inc(&x->ring_refs);
+	atomic_inc(&x->mmap_count);
+}
+
+static void
+xen_vm_close (struct vm_area_struct *vma) {
+	struct xen_sock *x = vma->vm_private_data;
+
+	if (atomic_dec_and_test(&x->mmap_count) && x->rx.descriptor_addr) {
+		x->rx.descriptor_addr->bulk_refused = 0;
+	}
+	xen_sock_put_rings(x);
+	sock_put(&x->sk);
+}
+
+static const struct vm_operations_struct xen_vm_ops = {
+	.open           = xen_vm_open,
+	.close          = xen_vm_close,
+};
+
+static int
+xen_mmap (struct file *file, struct socket *sock, struct vm_area_struct *vma) {
+	struct sock     *sk = sock->sk;
+	struct xen_sock *x = xen_sk(sk);
+	unsigned long    off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long    size = vma->vm_end - vma->vm_start;
+	struct xen_ring *r = NULL;
+	int              rc;
+
+	TRACE_ENTRY;
+
+	/* a pending connect may still be withdrawn, rings and all */
+	if (!x->tx.descriptor_addr || sock->state != SS_CONNECTED) {
+		return -ENOTCONN;
+	}
+	if (!x->pool_entry || x->tx.version < XENSOCKET_RING_V2) {
+		return -EOPNOTSUPP;
+	}
+
+	switch (off) {
+		case XEN_MMAP_INDEX:
+			if (size != 2 * PAGE_SIZE) {
+				return -EINVAL;
+			}
+			break;
+		case XEN_MMAP_TX_RING:
+			r = &x->tx;
+			break;
+		case XEN_MMAP_RX_RING:
+			r = &x->rx;
+			break;
+		default:
+			return -EINVAL;
+	}
+	if (r && size != ring_size(r)) {
+		return -EINVAL;
+	}
+
+	if (r != &x->tx) {
+		if (vma->vm_flags & VM_WRITE) {
+			return -EPERM;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	/* A process consuming the rx ring through the mapping cannot pull
+	 * bulk transfers, so the peer must not post any while it is mapped.
+	 * One already posted has to be received with recv() first.
+	 */
+	x->rx.descriptor_addr->bulk_refused = 1;
+	smp_mb();
+	if (ring_bulk_pending(&x->rx)) {
+		if (!atomic_read(&x->mmap_count)) {
+			x->rx.descriptor_addr->bulk_refused = 0;
+		}
+		return -EBUSY;
+	}
+
+	if (r) {
+		rc = remap_pfn_range(vma, vma->vm_start, virt_to_phys((void *)r->buffer_addr) >> PAGE_SHIFT,
+				size, vma->vm_page_prot);
+	}
+	else {
+		rc = remap_pfn_range(vma, vma->vm_start, virt_to_phys(x->tx.descriptor_addr) >> PAGE_SHIFT,
+				PAGE_SIZE, vma->vm_page_prot);
+		if (rc == 0) {
+			rc = remap_pfn_range(vma, vma->vm_start + PAGE_SIZE, virt_to_phys(x->rx.descriptor_addr) >> PAGE_SHIFT,
+					PAGE_SIZE, vma->vm_page_prot);
+		}
+	}
+	if (rc) {
+		TRACE_ERROR;
+		return rc;
+	}
+
+	vma->vm_ops = &xen_vm_ops;
+	vma->vm_private_data = x;
+	xen_vm_open(vma);
+
+	TRACE_EXIT;
+	return 0;
+}
+
+static int
+xen_ioctl (struct socket *sock, unsigned int cmd, unsigned long arg) {
+	struct sock     *sk = sock->sk;
+	struct xen_sock *x = xen_sk(sk);
+	struct xen_ring *r;
+	unsigned int     old;
+
+	switch (cmd) {
+		case XEN_RING_COMMIT:
+			r = &x->tx;
+			if (!r->descriptor_addr) {
+				return -ENOTCONN;
+			}
+			if (r->version < XENSOCKET_RING_V2) {
+				return -EOPNOTSUPP;
+			}
+			if (atomic_read(&r->descriptor_addr->force_sender_shutdown)) {
+				return -EPIPE;
+			}
+			if (arg > ring_writeable(r)) {
+				return -EINVAL;
+			}
+			old = ring_produced(r);
+			ring_produce(r, arg);
+			notify_receiver(x, r, old);
+			return 0;
+
+		case XEN_RING_RELEASE:
+			r = &x->rx;
+			if (!r->descriptor_addr) {
+				return -ENOTCONN;
+			}
+			if (r->version < XENSOCKET_RING_V2) {
+				return -EOPNOTSUPP;
+			}
+			if (arg > ring_readable(r)) {
+				return -EINVAL;
+			}
+			old = ring_consumed(r);
+			ring_consume(r, arg);
+			notify_sender(x, r, old);
+			return 0;
+
+		default:
+			return -ENOIOCTLCMD;
+	}
+}
+
+/************************************************************************
+ * Socket options.
+ *
+ * The connecting side sizes both rings of a connection when it calls
+ * connect().  XEN_RING_SIZE (level SOL_XEN) sets both; otherwise a
+ * locked SO_SNDBUF sizes the tx ring and a locked SO_RCVBUF the rx ring,
+ * and everything else gets default_ring_size.  Sizes are rounded up to
+ * a power-of-two number of pages and capped at max_ring_size, which is
+ * kept well below MAX_ORDER by default since each ring is one
+ * contiguous allocation; see server_allocate_buffer_pages() for what
+ * happens when even that is not available.
+ ************************************************************************/
+
+static unsigned int default_ring_size = 32 * PAGE_SIZE;
+module_param(default_ring_size, uint, 0644);
+MODULE_PARM_DESC(default_ring_size, "Ring size in bytes for connections that do not choose one");
+
+static unsigned int max_ring_size = 256 * PAGE_SIZE;
+module_param(max_ring_size, uint, 0644);
+MODULE_PARM_DESC(max_ring_size, "Largest ring size in bytes a socket may ask for");
+
+static int
+ring_order_for_size (unsigned long size) {
+	unsigned long limit = min_t(unsigned long, max_ring_size, PAGE_SIZE << (MAX_ORDER - 1));
+
+	size = clamp_t(unsigned long, size, PAGE_SIZE, max_t(unsigned long, limit, PAGE_SIZE));
+	return get_order(size);
+}
+
+static int
+xen_ring_order (struct xen_sock *x, int for_tx) {
+	struct sock *sk = &x->sk;
+
+	if (x->ring_order >= 0) {
+		return min(x->ring_order, ring_order_for_size(ULONG_MAX));
+	}
+	/* sock_setsockopt() stores twice the requested buffer size */
+	if (for_tx && (sk->sk_userlocks & SOCK_SNDBUF_LOCK)) {
+		return ring_order_for_size(sk->sk_sndbuf / 2);
+	}
+	if (!for_tx && (sk->sk_userlocks & SOCK_RCVBUF_LOCK)) {
+		return ring_order_for_size(sk->sk_rcvbuf / 2);
+	}
+	return ring_order_for_size(default_ring_size);
+}
+
+static int
+xen_setsockopt (struct socket *sock, int level, int optname, char __user *optval, unsigned int optlen) {
+	struct sock     *sk = sock->sk;
+	struct xen_sock *x = xen_sk(sk);
+	int              val;
+	int              rc = 0;
+
+	TRACE_ENTRY;
+
+	if (level != SOL_XEN) {
+		return -ENOPROTOOPT;
+	}
+	if (optlen < sizeof(int)) {
+		return -EINVAL;
+	}
+	if (get_user(val, (int __user *)optval)) {
+		return -EFAULT;
+	}
+
+	lock_sock(sk);
+	switch (optname) {
+		case XEN_RING_SIZE:
+			if (val <= 0) {
+				rc = -EINVAL;
+			}
+			else if (x->tx.descriptor_addr) {
+				rc = -EISCONN;
+			}
+			else {
+				x->ring_order = ring_order_for_size(val);
+			}
+			break;
+		case XEN_ZEROCOPY:
+			x->zerocopy = !!val;
+			break;
+		case XEN_QUEUES:
+			if (val < 1 || val > XENSOCKET_MAX_QUEUES) {
+				rc = -EINVAL;
+			}
+			else if (val > 1 && sock->type != SOCK_SEQPACKET) {
+				/* a byte stream cannot be spread over several rings */
+				rc = -EOPNOTSUPP;
+			}
+			else if (x->tx.descriptor_addr) {
+				rc = -EISCONN;
+			}
+			else {
+				x->want_queues = val;
+			}
+			break;
+		case XEN_QUEUE_STEERING:
+			if (val != XEN_STEER_FLOW && val != XEN_STEER_CPU) {
+				rc = -EINVAL;
+			}
+			else {
+				x->queue_steering = val;
+			}
+			break;
+		default:
+			rc = -ENOPROTOOPT;
+			break;
+	}
+	release_sock(sk);
+
+	TRACE_EXIT;
+	return rc;
+}
+
+static int
+xen_getsockopt (struct socket *sock, int level, int optname, char __user *optval, int __user *optlen) {
+	struct sock     *sk = sock->sk;
+	struct xen_sock *x = xen_sk(sk);
+	int              val;
+	int              len;
+
+	TRACE_ENTRY;
+
+	if (level != SOL_XEN) {
+		return -ENOPROTOOPT;
+	}
+	if (get_user(len, optlen)) {
+		return -EFAULT;
+	}
+
+	if (optname == XEN_RING_MAP) {
+		struct xen_ring_map map;
+
+		if (len < sizeof(map)) {
+			return -EINVAL;
+		}
+		if (!x->tx.descriptor_addr) {
+			return -ENOTCONN;
+		}
+		if (x->tx.version < XENSOCKET_RING_V2) {
+			return -EOPNOTSUPP;
+		}
+		map.tx_size = ring_size(&x->tx);
+		map.rx_size = ring_size(&x->rx);
+		map.tx_prod = offsetof(struct descriptor_page, prod);
+		map.tx_cons = offsetof(struct descriptor_page, cons);
+		map.rx_prod = PAGE_SIZE + offsetof(struct descriptor_page, prod);
+		map.rx_cons = PAGE_SIZE + offsetof(struct descriptor_page, cons);
+		len = sizeof(map);
+		if (put_user(len, optlen) || copy_to_user(optval, &map, len)) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+
+	if (len < sizeof(int)) {
+		return -EINVAL;
+	}
+	len = sizeof(int);
+
+	switch (optname) {
+		case XEN_RING_SIZE:
+			/* the actual size once connected, else what connect() will use */
+			if (x->tx.descriptor_addr && x->tx.buffer_order >= 0) {
+				val = ring_size(&x->tx);
+			}
+			else {
+				val = PAGE_SIZE << xen_ring_order(x, 1);
+			}
+			break;
+		case XEN_ZEROCOPY:
+			val = x->zerocopy;
+			break;
+		case XEN_QUEUES:
+			/* the negotiated count once connected */
+			val = x->tx.descriptor_addr ? x->nr_queues : x->want_queues;
+			break;
+		case XEN_QUEUE_STEERING:
+			val = x->queue_steering;
+			break;
+		case XEN_INCOMING_CPU:
+			val = READ_ONCE(queue_rx(x, xen_rx_queue(x))->irq_cpu);
+			break;
+		default:
+			return -ENOPROTOOPT;
+	}
+
+	if (put_user(len, optlen) || copy_to_user(optval, &val, len)) {
+		return -EFAULT;
+	}
+
+	TRACE_EXIT;
+	return 0;
+}
+
+/************************************************************************
+ * Xen backend.
+ *
+ * Hands every backend call to the grant table, event channel and
+ * xenbus code of the kernel.
+ ************************************************************************/
+
+#ifdef CONFIG_XEN
+
+static int
+xen_be_init (void) {
+	if (!xen_domain()) {
+		printk(KERN_ERR "xensocket: not running under Xen; load with backend=loopback\n");
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static unsigned long
+xen_be_frame (struct page *page) {
+	return pfn_to_mfn(page_to_pfn(page));
+}
+
+/* Reserve every reference in one go, then claim them locally; this
+ * avoids taking the grant table lock once per page.
+ */
+static int
+xen_be_claim_grefs (domid_t domid, int count, int *grefs) {
+	grant_ref_t gref_head;
+	int    i;
+
+	if (gnttab_alloc_grant_references(count, &gref_head) < 0) {
+		return -ENOSPC;
+	}
+	for (i = 0; i < count; i++) {
+		grefs[i] = gnttab_claim_grant_reference(&gref_head);
+	}
+	gnttab_free_grant_references(gref_head);
+	return 0;
+}
+
+static void
+xen_be_grant_ref (int gref, domid_t domid, unsigned long frame, int readonly) {
+	gnttab_grant_foreign_access_ref(gref, domid, frame, readonly);
+}
+
+static int
+xen_be_end_grant (int gref, int readonly) {
+	if (!gnttab_end_foreign_access_ref(gref, readonly)) {
+		return 0;
+	}
+	gnttab_free_grant_reference(gref);
+	return 1;
+}
+
+static void
+xen_be_end_grant_page (int gref, int readonly, unsigned long page) {
+	gnttab_end_foreign_access(gref, readonly, page);
+}
+
+/* Unmap the pages of a xen_be_map() call with one hypercall. */
+static void
+xen_be_unmap (void *addr, void *area, grant_handle_t *handles, int count) {
+	struct gnttab_unmap_grant_ref *ops;
+	int    n = 0;
+	int    i;
+
+	if (!(ops = kcalloc(count, sizeof(*ops), GFP_KERNEL))) {
+		printk("Failure to allocate unmap operations\n");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (handles[i] == -1) {
+			continue;
+		}
+		gnttab_set_unmap_op(&ops[n++], (unsigned long)addr + i * PAGE_SIZE, GNTMAP_host_map, handles[i]);
+		handles[i] = -1;
+	}
+
+	if (n && HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, ops, n)) {
+		printk("Failure to unmap grant references\n");
+	}
+
+	kfree(ops);
+	free_vm_area(area);
+}
+
+/* Map @count grants from @domid at consecutive pages of a fresh vm
+ * area with a single GNTTABOP_map_grant_ref hypercall.
+ */
+static void *
+xen_be_map (domid_t domid, const int *grefs, int count, int readonly, grant_handle_t *handles, void **area) {
+	struct gnttab_map_grant_ref *ops;
+	struct vm_struct *vm;
+	unsigned long addr;
+	int    rc;
+	int    i;
+
+	if (!(vm = alloc_vm_area(count * PAGE_SIZE, NULL))) {
+		return ERR_PTR(-ENOMEM);
+	}
+	addr = (unsigned long)vm->addr;
+
+	if (!(ops = kcalloc(count, sizeof(*ops), GFP_KERNEL))) {
+		free_vm_area(vm);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (i = 0; i < count; i++) {
+		gnttab_set_map_op(&ops[i], addr + i * PAGE_SIZE,
+				GNTMAP_host_map | (readonly ? GNTMAP_readonly : 0), grefs[i], domid);
+	}
+
+	rc = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, ops, count);
+
+	for (i = 0; i < count; i++) {
+		if (rc == 0 && ops[i].status == GNTST_okay) {
+			handles[i] = ops[i].handle;
+		}
+		else {
+			handles[i] = -1;
+			if (rc == 0) {
+				DPRINTK("error: mapping gref %d failed, status %d\n", grefs[i], ops[i].status);
+				rc = -EINVAL;
+			}
+		}
+	}
+	kfree(ops);
+
+	if (rc != 0) {
+		/* unmap whatever succeeded */
+		xen_be_unmap(vm->addr, vm, handles, count);
+		return ERR_PTR(rc);
+	}
+
+	*area = vm;
+	return vm->addr;
+}
+
+static void
+xen_be_copy (struct gnttab_copy *ops, unsigned int count) {
+	gnttab_batch_copy(ops, count);
+}
+
+static int
+xen_be_alloc_evtchn (domid_t domid, unsigned int *port) {
+	struct evtchn_alloc_unbound op;
+	int    rc;
+
+	op.dom = DOMID_SELF;
+	op.remote_dom = domid;
+	if ((rc = HYPERVISOR_event_channel_op(EVTCHNOP_alloc_unbound, &op)) != 0) {
+		return rc;
+	}
+	*port = op.port;
+	return 0;
+}
+
+static int
+xen_be_bind_evtchn (domid_t domid, unsigned int remote_port, unsigned int *port) {
+	struct evtchn_bind_interdomain op;
+	int    rc;
+
+	op.remote_dom = domid;
+	op.remote_port = remote_port;
+	if ((rc = HYPERVISOR_event_channel_op(EVTCHNOP_bind_interdomain, &op)) != 0) {
+		return rc;
+	}
+	*port = op.local_port;
+	return 0;
+}
+
+static int
+xen_be_evtchn_unbound (unsigned int port) {
+	struct evtchn_status status;
+
+	status.dom = DOMID_SELF;
+	status.port = port;
+	if (HYPERVISOR_event_channel_op(EVTCHNOP_status, &status) != 0) {
+		return 0;
+	}
+	return status.status == EVTCHNSTAT_unbound;
+}
+
+static int
+xen_be_bind_irq (unsigned int port, irq_handler_t handler, const char *name, void *dev_id) {
+	return bind_evtchn_to_irqhandler(port, handler, 0, name, dev_id);
+}
+
+/* free_irq() expects the affinity hint to be gone */
+static void
+xen_be_unbind_irq (unsigned int irq, void *dev_id) {
+	irq_set_affinity_hint(irq, NULL);
+	unbind_from_irqhandler(irq, dev_id);
+}
+
+static void
+xen_be_notify (unsigned int port) {
+	notify_remote_via_evtchn(port);
+}
+
+static void
+xen_be_mask_irq (unsigned int irq) {
+	disable_irq_nosync(irq);
+}
+
+static void
+xen_be_unmask_irq (unsigned int irq) {
+	enable_irq(irq);
+}
+
+static int
+xen_be_set_irq_cpu (unsigned int irq, int cpu) {
+	return irq_set_affinity_hint(irq, cpu < 0 ? NULL : cpumask_of(cpu));
+}
+
+static void
+xen_be_sync_irq (unsigned int irq) {
+	synchronize_irq(irq);
+}
+
+#endif /* CONFIG_XEN */
+
+/************************************************************************
+ * Loopback backend.
+ *
+ * Runs both ends of every connection in one kernel, so the whole data
+ * path can be exercised and load tested without a hypervisor; every
+ * socket believes it lives in domain 0.
+ *
+ * A grant is an entry in loop_grefs naming one of our pages; mapping it
+ * vmaps the same page, and a page whose grant ends while it is still
+ * mapped is freed on the last unmap, as Xen defers it.  An event channel
+ * is an entry in loop_ports whose irq number is its port number;
+ * notifying one end runs the handler of the other end from an irq_work,
+ * so handlers still run in hard interrupt context, on the CPU set with
+ * set_irq_cpu() if any.  The store is a flat list of path/value nodes;
+ * a path exists if any node lies at or below it.  Transactions are not
+ * isolated, and watches are delivered one at a time from a work item.
+ *
+ * Grant references and ports are numbered from LOOP_ID_BASE, above
+ * anything Xen hands out, so that the Xen backend can use the grants and
+ * event channels here for connections within its own domain.
+ ************************************************************************/
+
+#define LOOP_ID_BASE    (1 << 30)
+
+static inline int
+loop_id (unsigned int id) {
+	return id >= LOOP_ID_BASE;
+}
+
+struct loop_gref {
+	struct page    *page;
+	int             readonly;
+	int             mapped;     /* mappings and copies in progress */
+	int             ended;
+	unsigned long   free_page;  /* freed with the last mapping */
+};
+
+struct loop_port {
+	unsigned int    port;
+	struct loop_port *peer;
+	irq_handler_t   handler;
+	void           *dev_id;
+	int             masked;     /* mask depth */
+	int             pending;    /* notified while masked */
+	int             cpu;        /* -1 for the notifying CPU */
+	int             direct;     /* run the handler from notify when possible */
+	atomic_t        busy;       /* direct handler calls in progress */
+	struct irq_work work;
+};
+
+struct loop_node {
+	struct list_head list;
+	char           *path;
+	char           *value;
+};
+
+struct loop_watch_event {
+	struct list_head list;
+	struct xenbus_watch *watch;
+	char           *path;
+};
+
+static DEFINE_IDR(loop_grefs);
+static DEFINE_SPINLOCK(loop_gref_lock);
+static DEFINE_IDR(loop_ports);
+static DEFINE_SPINLOCK(loop_port_lock);
+static LIST_HEAD(loop_nodes);
+static LIST_HEAD(loop_watches);
+static DEFINE_MUTEX(loop_store_mutex);
+static LIST_HEAD(loop_watch_events);
+static DEFINE_SPINLOCK(loop_watch_lock);
+static struct task_struct *loop_watch_task;
+
+static void loop_watch_work_fn (struct work_struct *work);
+static DECLARE_WORK(loop_watch_work, loop_watch_work_fn);
+
+static unsigned long
+loop_frame (struct page *page) {
+	return page_to_pfn(page);
+}
+
+static int
+loop_claim_grefs (domid_t domid, int count, int *grefs) {
+	struct loop_gref *g;
+	unsigned long flags;
+	int    gref;
+	int    i;
+
+	for (i = 0; i < count; i++) {
+		if (!(g = kzalloc(sizeof(*g), GFP_KERNEL))) {
+			goto err;
+		}
+		idr_preload(GFP_KERNEL);
+		spin_lock_irqsave(&loop_gref_lock, flags);
+		gref = idr_alloc(&loop_grefs, g, LOOP_ID_BASE, 0, GFP_NOWAIT);
+		spin_unlock_irqrestore(&loop_gref_lock, flags);
+		idr_preload_end();
+		if (gref < 0) {
+			kfree(g);
+			goto err;
+		}
+		grefs[i] = gref;
+	}
+	return 0;
+
+err:
+	/* all or nothing */
+	while (i-- > 0) {
+		spin_lock_irqsave(&loop_gref_lock, flags);
+		g = idr_find(&loop_grefs, grefs[i]);
+		idr_remove(&loop_grefs, grefs[i]);
+		spin_unlock_irqrestore(&loop_gref_lock, flags);
+		kfree(g);
+		grefs[i] = -ENOSPC;
+	}
+	return -ENOSPC;
+}
+
+static void
+loop_grant_ref (int gref, domid_t domid, unsigned long frame, int readonly) {
+	struct loop_gref *g;
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop_gref_lock, flags);
+	if ((g = idr_find(&loop_grefs, gref))) {
+		g->page = pfn_to_page(frame);
+		g->readonly = readonly;
+	}
+	spin_unlock_irqrestore(&loop_gref_lock, flags);
+}
+
+/* Look up @gref for a mapping or copy and pin it. */
+static struct loop_gref *
+loop_gref_get (int gref, int write) {
+	struct loop_gref *g;
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop_gref_lock, flags);
+	g = idr_find(&loop_grefs, gref);
+	if (!g || !g->page || g->ended || (write && g->readonly)) {
+		g = NULL;
+	}
+	else {
+		g->mapped++;
+	}
+	spin_unlock_irqrestore(&loop_gref_lock, flags);
+	return g;
+}
+
+static void
+loop_gref_put (int gref) {
+	struct loop_gref *g;
+	unsigned long flags;
+	unsigned long page = 0;
+
+	spin_lock_irqsave(&loop_gref_lock, flags);
+	g = idr_find(&loop_grefs, gref);
+	if (--g->mapped == 0 && g->ended) {
+		idr_remove(&loop_grefs, gref);
+		page = g->free_page;
+	}
+	else {
+		g = NULL;
+	}
+	spin_unlock_irqrestore(&loop_gref_lock, flags);
+
+	if (g) {
+		if (page) {
+			free_page(page);
+		}
+		kfree(g);
+	}
+}
+
+static int
+loop_end_grant (int gref, int readonly) {
+	struct loop_gref *g;
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop_gref_lock, flags);
+	g = idr_find(&loop_grefs, gref);
+	if (g && g->mapped) {
+		spin_unlock_irqrestore(&loop_gref_lock, flags);
+		return 0;
+	}
+	idr_remove(&loop_grefs, gref);
+	spin_unlock_irqrestore(&loop_gref_lock, flags);
+
+	kfree(g);
+	return 1;
+}
+
+static void
+loop_end_grant_page (int gref, int readonly, unsigned long page) {
+	struct loop_gref *g;
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop_gref_lock, flags);
+	g = idr_find(&loop_grefs, gref);
+	if (g && g->mapped) {
+		g->ended = 1;
+		g->free_page = page;
+		spin_unlock_irqrestore(&loop_gref_lock, flags);
+		return;
+	}
+	idr_remove(&loop_grefs, gref);
+	spin_unlock_irqrestore(&loop_gref_lock, flags);
+
+	kfree(g);
+	if (page) {
+		free_page(page);
+	}
+}
+
+static void
+loop_unmap (void *addr, void *area, grant_handle_t *handles, int count) {
+	int    i;
+
+	if (is_vmalloc_addr(addr)) {
+		vunmap(addr);
+	}
+	for (i = 0; i < count; i++) {
+		if (handles[i] != -1) {
+			loop_gref_put(handles[i]);
+			handles[i] = -1;
+		}
+	}
+}
+
+static void *
+loop_map (domid_t domid, const int *grefs, int count, int readonly, grant_handle_t *handles, void **area) {
+	struct page **pages;
+	struct loop_gref *g;
+	void  *addr = ERR_PTR(-EINVAL);
+	int    i;
+
+	if (!(pages = kmalloc_array(count, sizeof(*pages), GFP_KERNEL))) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!(g = loop_gref_get(grefs[i], !readonly))) {
+			DPRINTK("error: mapping gref %d failed\n", grefs[i]);
+			goto err;
+		}
+		pages[i] = g->page;
+		handles[i] = grefs[i];
+	}
+
+	/* Rings are allocated in one piece; use them where they are */
+	for (i = 1; i < count; i++) {
+		if (pages[i] != pages[0] + i) {
+			break;
+		}
+	}
+	if (i == count && !readonly && !PageHighMem(pages[0])) {
+		addr = page_address(pages[0]);
+	}
+	else if (!(addr = vmap(pages, count, VM_MAP, readonly ? PAGE_KERNEL_RO : PAGE_KERNEL))) {
+		addr = ERR_PTR(-ENOMEM);
+		i = count;
+		goto err;
+	}
+	kfree(pages);
+
+	*area = NULL;
+	return addr;
+
+err:
+	while (i-- > 0) {
+		loop_gref_put(handles[i]);
+	}
+	for (i = 0; i < count; i++) {
+		handles[i] = -1;
+	}
+	kfree(pages);
+	return addr;
+}
+
+/* Resolve one side of a grant copy.  Returns the page, pinning it if
+ * it is named by a gref.
+ */
+static struct page *
+loop_copy_page (unsigned long ref, int is_gref, int write) {
+	struct loop_gref *g;
+
+	if (!is_gref) {
+		return pfn_to_page(ref);
+	}
+	g = loop_gref_get(ref, write);
+	return g ? g->page : NULL;
+}
+
+static void
+loop_copy (struct gnttab_copy *ops, unsigned int count) {
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		struct gnttab_copy *op = &ops[i];
+		int    src_gref = op->flags & GNTCOPY_source_gref;
+		int    dst_gref = op->flags & GNTCOPY_dest_gref;
+		struct page *src, *dst = NULL;
+		void  *s, *d;
+
+		if (op->source.offset + op->len > PAGE_SIZE || op->dest.offset + op->len > PAGE_SIZE) {
+			op->status = GNTST_bad_copy_arg;
+			continue;
+		}
+		src = loop_copy_page(src_gref ? op->source.u.ref : op->source.u.gmfn, src_gref, 0);
+		if (src) {
+			dst = loop_copy_page(dst_gref ? op->dest.u.ref : op->dest.u.gmfn, dst_gref, 1);
+		}
+		if (!src || !dst) {
+			op->status = GNTST_bad_gntref;
+		}
+		else {
+			s = kmap_atomic(src);
+			d = kmap_atomic(dst);
+			memcpy(d + op->dest.offset, s + op->source.offset, op->len);
+			kunmap_atomic(d);
+			kunmap_atomic(s);
+			op->status = GNTST_okay;
+		}
+		if (src && src_gref) {
+			loop_gref_put(op->source.u.ref);
+		}
+		if (dst && dst_gref) {
+			loop_gref_put(op->dest.u.ref);
+		}
+	}
+}
+
+static void
+loop_port_fire (struct irq_work *work) {
+	struct loop_port *p = container_of(work, struct loop_port, work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop_port_lock, flags);
+	if (p->masked) {
+		/* masked after it was queued */
+		p->pending = 1;
+		spin_unlock_irqrestore(&loop_port_lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&loop_port_lock, flags);
+
+	if (p->handler) {
+		p->handler(p->port, p->dev_id);
+	}
+}
+
+/* Called with loop_port_lock held. */
+static void
+loop_port_raise (struct loop_port *p) {
+	if (p->masked) {
+		p->pending = 1;
+	}
+#ifdef CONFIG_SMP
+	else if (p->cpu >= 0 && cpu_online(p->cpu)) {
+		irq_work_queue_on(&p->work, p->cpu);
+	}
+#endif
+	else {
+		irq_work_queue(&p->work);
+	}
+}
+
+static struct loop_port *
+loop_port_new (void) {
+	struct loop_port *p;
+	int    rc;
+
+	if (!(p = kzalloc(sizeof(*p), GFP_KERNEL))) {
+		return ERR_PTR(-ENOMEM);
+	}
+	p->cpu = -1;
+	init_irq_work(&p->work, loop_port_fire);
+
+	idr_preload(GFP_KERNEL);
+	spin_lock_irq(&loop_port_lock);
+	rc = idr_alloc(&loop_ports, p, LOOP_ID_BASE, 0, GFP_NOWAIT);
+	if (rc > 0) {
+		p->port = rc;
+	}
+	spin_unlock_irq(&loop_port_lock);
+	idr_preload_end();
+
+	if (rc < 0) {
+		kfree(p);
+		return ERR_PTR(rc);
+	}
+	return p;
+}
+
+static int
+loop_alloc_evtchn (domid_t domid, unsigned int *port) {
+	struct loop_port *p = loop_port_new();
+
+	if (IS_ERR(p)) {
+		return PTR_ERR(p);
+	}
+	*port = p->port;
+	return 0;
+}
+
+static int
+loop_bind_evtchn (domid_t domid, unsigned int remote_port, unsigned int *port) {
+	struct loop_port *p, *r;
+
+	p = loop_port_new();
+	if (IS_ERR(p)) {
+		return PTR_ERR(p);
+	}
+
+	spin_lock_irq(&loop_port_lock);
+	r = idr_find(&loop_ports, remote_port);
+	if (!r || r->peer) {
+		idr_remove(&loop_ports, p->port);
+		spin_unlock_irq(&loop_port_lock);
+		kfree(p);
+		return -EINVAL;
+	}
+	p->peer = r;
+	r->peer = p;
+	spin_unlock_irq(&loop_port_lock);
+
+	*port = p->port;
+	return 0;
+}
+
+static int
+loop_evtchn_unbound (unsigned int port) {
+	struct loop_port *p;
+	int    rc;
+
+	spin_lock_irq(&loop_port_lock);
+	p = idr_find(&loop_ports, port);
+	rc = p && !p->peer;
+	spin_unlock_irq(&loop_port_lock);
+	return rc;
+}
+
+static int
+loop_bind_irq (unsigned int port, irq_handler_t handler, const char *name, void *dev_id) {
+	struct loop_port *p;
+
+	spin_lock_irq(&loop_port_lock);
+	if ((p = idr_find(&loop_ports, port))) {
+		p->handler = handler;
+		p->dev_id = dev_id;
+	}
+	spin_unlock_irq(&loop_port_lock);
+	return p ? (int)port : -EINVAL;
+}
+
+/* Closes the port; its peer becomes unbound again. */
+static void
+loop_unbind_irq (unsigned int irq, void *dev_id) {
+	struct loop_port *p;
+
+	spin_lock_irq(&loop_port_lock);
+	if ((p = idr_find(&loop_ports, irq))) {
+		idr_remove(&loop_ports, irq);
+		if (p->peer) {
+			p->peer->peer = NULL;
+		}
+	}
+	spin_unlock_irq(&loop_port_lock);
+
+	if (p) {
+		while (atomic_read(&p->busy)) {
+			cpu_relax();
+		}
+		irq_work_sync(&p->work);
+		kfree(p);
+	}
+}
+
+static void
+loop_notify (unsigned int port) {
+	struct loop_port *p, *t = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop_port_lock, flags);
+	if ((p = idr_find(&loop_ports, port)) && p->peer) {
+		/* Called where an interrupt could arrive, a direct port runs
+		 * its handler right here instead of bouncing through an
+		 * irq_work, so the sleeper is woken from the sender's context.
+		 */
+		if (p->peer->direct && !p->peer->masked && p->peer->handler &&
+				!irqs_disabled_flags(flags) && !in_interrupt()) {
+			t = p->peer;
+			atomic_inc(&t->busy);
+		}
+		else {
+			loop_port_raise(p->peer);
+		}
+	}
+	spin_unlock_irqrestore(&loop_port_lock, flags);
+
+	if (t) {
+		local_irq_save(flags);
+		t->handler(t->port, t->dev_id);
+		local_irq_restore(flags);
+		atomic_dec(&t->busy);
+	}
+}
+
+static void
+loop_mask_irq (unsigned int irq) {
+	struct loop_port *p;
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop_port_lock, flags);
+	if ((p = idr_find(&loop_ports, irq))) {
+		p->masked++;
+	}
+	spin_unlock_irqrestore(&loop_port_lock, flags);
+}
+
+/* An event that came in while masked is delivered now. */
+static void
+loop_unmask_irq (unsigned int irq) {
+	struct loop_port *p;
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop_port_lock, flags);
+	if ((p = idr_find(&loop_ports, irq)) && p->masked && --p->masked == 0 && p->pending) {
+		p->pending = 0;
+		loop_port_raise(p);
+	}
+	spin_unlock_irqrestore(&loop_port_lock, flags);
+}
+
+static int
+loop_set_irq_cpu (unsigned int irq, int cpu) {
+	struct loop_port *p;
+
+	spin_lock_irq(&loop_port_lock);
+	if ((p = idr_find(&loop_ports, irq))) {
+		p->cpu = cpu;
+	}
+	spin_unlock_irq(&loop_port_lock);
+	return p ? 0 : -EINVAL;
+}
+
+static void
+loop_sync_irq (unsigned int irq) {
+	struct loop_port *p;
+
+	/* ports are only freed by their owner, who is the caller */
+	spin_lock_irq(&loop_port_lock);
+	p = idr_find(&loop_ports, irq);
+	spin_unlock_irq(&loop_port_lock);
+	if (p) {
+		irq_work_sync(&p->work);
+	}
+}
+
+static char *
+loop_path (const char *dir, const char *node) {
+	if (!node[0]) {
+		return kstrdup(dir, GFP_KERNEL);
+	}
+	return kasprintf(GFP_KERNEL, "%s/%s", dir, node);
+}
+
+/* Whether @path is @prefix or lies below it. */
+static int
+loop_path_under (const char *path, const char *prefix) {
+	size_t len = strlen(prefix);
+
+	return !strncmp(path, prefix, len) && (path[len] == '\0' || path[len] == '/');
+}
+
+static struct loop_node *
+loop_find (const char *path) {
+	struct loop_node *n;
+
+	list_for_each_entry(n, &loop_nodes, list) {
+		if (!strcmp(n->path, path)) {
+			return n;
+		}
+	}
+	return NULL;
+}
+
+/* Queue an event for @w.  Called with loop_store_mutex held. */
+static void
+loop_watch_queue (struct xenbus_watch *w, const char *path) {
+	struct loop_watch_event *e;
+
+	if (!(e = kmalloc(sizeof(*e), GFP_KERNEL))) {
+		return;
+	}
+	if (!(e->path = kstrdup(path, GFP_KERNEL))) {
+		kfree(e);
+		return;
+	}
+	e->watch = w;
+	spin_lock(&loop_watch_lock);
+	list_add_tail(&e->list, &loop_watch_events);
+	spin_unlock(&loop_watch_lock);
+	schedule_work(&loop_watch_work);
+}
+
+/* @path changed: fire the watches on it, above it and, for removals,
+ * below it.  Called with loop_store_mutex held.
+ */
+static void
+loop_watch_fire (const char *path) {
+	struct xenbus_watch *w;
+
+	list_for_each_entry(w, &loop_watches, list) {
+		if (loop_path_under(path, w->node) || loop_path_under(w->node, path)) {
+			loop_watch_queue(w, path);
+		}
+	}
+}
+
+static void
+loop_watch_work_fn (struct work_struct *work) {
+	struct loop_watch_event *e;
+	const char *vec[2];
+
+	loop_watch_task = current;
+	for (;;) {
+		spin_lock(&loop_watch_lock);
+		e = list_first_entry_or_null(&loop_watch_events, struct loop_watch_event, list);
+		if (e) {
+			list_del(&e->list);
+		}
+		spin_unlock(&loop_watch_lock);
+		if (!e) {
+			break;
+		}
+
+		vec[XS_WATCH_PATH] = e->path;
+		vec[XS_WATCH_TOKEN] = "";
+		e->watch->callback(e->watch, vec, 2);
+		kfree(e->path);
+		kfree(e);
 	}
+	loop_watch_task = NULL;
+}
 
-	finish_wait(sk_sleep(sk), &wait);
-
-	TRACE_EXIT;
-	return timeo;
+static int
+loop_transaction_start (struct xenbus_transaction *t) {
+	t->id = 1;
+	return 0;
 }
 
-static irqreturn_t
-server_interrupt (int irq, void *dev_id) {
-	struct xen_sock *x = dev_id;
-	struct sock     *sk = &x->sk;
+static int
+loop_transaction_end (struct xenbus_transaction t, int abort) {
+	return 0;
+}
 
-	TRACE_ENTRY;
+static void *
+loop_read (struct xenbus_transaction t, const char *dir, const char *node, unsigned int *len) {
+	struct loop_node *n;
+	char  *path, *val;
 
-	if (sk_sleep(sk) && waitqueue_active(sk_sleep(sk))) {
-		wake_up_interruptible(sk_sleep(sk));
+	if (!(path = loop_path(dir, node))) {
+		return ERR_PTR(-ENOMEM);
 	}
+	mutex_lock(&loop_store_mutex);
+	if ((n = loop_find(path))) {
+		val = kstrdup(n->value, GFP_KERNEL) ?: ERR_PTR(-ENOMEM);
+	}
+	else {
+		val = ERR_PTR(-ENOENT);
+	}
+	mutex_unlock(&loop_store_mutex);
+	kfree(path);
 
-	TRACE_EXIT;
-	return IRQ_HANDLED;
+	if (len && !IS_ERR(val)) {
+		*len = strlen(val);
+	}
+	return val;
 }
 
 static int
-local_memcpy_toiovecend (const struct iovec *iov, unsigned char *kdata, int offset, int len) {
-	int err = -EFAULT; 
+loop_write (struct xenbus_transaction t, const char *dir, const char *node, const char *string) {
+	struct loop_node *n;
+	char  *path, *val;
 
-	/* Skip over the finished iovecs */
-	while (offset >= iov->iov_len) {
-		offset -= iov->iov_len;
-		iov++;
+	if (!(path = loop_path(dir, node))) {
+		return -ENOMEM;
+	}
+	if (!(val = kstrdup(string, GFP_KERNEL))) {
+		kfree(path);
+		return -ENOMEM;
 	}
 
-	while (len > 0) {
-		u8 *base = iov->iov_base + offset;
-		int copy = min((unsigned int)len, (unsigned int)(iov->iov_len - offset));
-
-		offset = 0;
-		if (copy_to_user(base, kdata, copy)) {
-			goto out;
-		}
-		kdata += copy;
-		len -= copy;
-		iov++;
+	mutex_lock(&loop_store_mutex);
+	if ((n = loop_find(path))) {
+		kfree(n->value);
+		n->value = val;
+		kfree(path);
+	}
+	else if ((n = kmalloc(sizeof(*n), GFP_KERNEL))) {
+		n->path = path;
+		n->value = val;
+		list_add_tail(&n->list, &loop_nodes);
+	}
+	else {
+		mutex_unlock(&loop_store_mutex);
+		kfree(path);
+		kfree(val);
+		return -ENOMEM;
 	}
-	err = 0;
+	loop_watch_fire(n->path);
+	mutex_unlock(&loop_store_mutex);
 
-out:
-	return err;
+	return 0;
 }
 
-/************************************************************************
- * Connection teardown functions (common to both server and client).
- ************************************************************************/
-
+/* Removes the node and everything below it, as xenstore does. */
 static int
-xen_release (struct socket *sock) {
-	struct sock            *sk = sock->sk;
-	struct xen_sock        *x;
-	struct descriptor_page *d;
+loop_rm (struct xenbus_transaction t, const char *dir, const char *node) {
+	struct loop_node *n, *tmp;
+	char  *path;
+	int    found = 0;
 
-	TRACE_ENTRY;
-    DPRINTK("sock@%p\n", sock);
-	if (!sk) {
-		return 0;
+	if (!(path = loop_path(dir, node))) {
+		return -ENOMEM;
 	}
+	mutex_lock(&loop_store_mutex);
+	list_for_each_entry_safe(n, tmp, &loop_nodes, list) {
+		if (loop_path_under(n->path, path)) {
+			list_del(&n->list);
+			kfree(n->path);
+			kfree(n->value);
+			kfree(n);
+			found = 1;
+		}
+	}
+	if (found) {
+		loop_watch_fire(path);
+	}
+	mutex_unlock(&loop_store_mutex);
+	kfree(path);
 
-	sock->sk = NULL;
-	x = xen_sk(sk);
-	d = x->descriptor_addr;
-
-	// if map didn't succeed, gracefully exit 
-	if (x->descriptor_handle == -1) 
-		goto out;
+	return found ? 0 : -ENOENT;
+}
 
-	if (x->is_server) {
-		while (atomic_read(&d->sender_has_shutdown) == 0 ) {
-		}
+static int
+loop_exists (struct xenbus_transaction t, const char *dir, const char *node) {
+	struct loop_node *n;
+	char  *path;
+	int    found = 0;
 
-		server_unallocate_buffer_pages(x);
-		server_unallocate_descriptor_page(x);
+	if (!(path = loop_path(dir, node))) {
+		return 0;
 	}
-
-	if (x->is_client) {
-		if ((atomic_read(&d->sender_has_shutdown)) == 0) {
-			client_unmap_buffer_pages(x);
-			client_unmap_descriptor_page(x);
-			notify_remote_via_evtchn(x->evtchn_local_port);
-		}
-		else {
-			printk(KERN_CRIT "    xen_release: SENDER ALREADY SHUT DOWN!\n");
+	mutex_lock(&loop_store_mutex);
+	list_for_each_entry(n, &loop_nodes, list) {
+		if (loop_path_under(n->path, path)) {
+			found = 1;
+			break;
 		}
 	}
+	mutex_unlock(&loop_store_mutex);
+	kfree(path);
 
-out:
-	sock_put(sk);
-
-	TRACE_EXIT;
-	return 0;
+	return found;
 }
 
-static void
-server_unallocate_buffer_pages (struct xen_sock *x) {
-	if (x->buffer_grefs) {
-		int buffer_num_pages = (1 << x->buffer_order);
-		int i;
+/* The names of the children of a path, packed like xenbus_directory()
+ * does so that a single kfree() releases them.
+ */
+static char **
+loop_directory (struct xenbus_transaction t, const char *dir, const char *node, unsigned int *num) {
+	struct loop_node *n;
+	char  **names = NULL;
+	char  *path, *p = NULL;
+	size_t len, size = 0;
+	unsigned int count = 0;
+	int    found = 0;
+	int    pass;
+
+	if (!(path = loop_path(dir, node))) {
+		return ERR_PTR(-ENOMEM);
+	}
+	len = strlen(path);
 
-		for (i = 0; i < buffer_num_pages; i++) {
-			if (x->buffer_grefs[i] == -ENOSPC) {
+	mutex_lock(&loop_store_mutex);
+	/* the first pass sizes the result, the second fills it in */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass) {
+			if (!(names = kmalloc(count * sizeof(char *) + size + 1, GFP_KERNEL))) {
 				break;
 			}
+			p = (char *)(names + count);
+			count = 0;
+		}
+		list_for_each_entry(n, &loop_nodes, list) {
+			const char *child;
+			size_t clen;
+			unsigned int i;
 
-			gnttab_end_foreign_access(x->buffer_grefs[i], 0, 0);
-			x->buffer_grefs[i] = -ENOSPC;
+			if (!loop_path_under(n->path, path)) {
+				continue;
+			}
+			found = 1;
+			if (!n->path[len]) {
+				continue;
+			}
+			child = n->path + len + 1;
+			clen = strchrnul(child, '/') - child;
+
+			/* grandchildren share the name of their parent */
+			for (i = 0; pass && i < count; i++) {
+				if (strlen(names[i]) == clen && !strncmp(names[i], child, clen)) {
+					break;
+				}
+			}
+			if (pass && i < count) {
+				continue;
+			}
+			if (pass) {
+				memcpy(p, child, clen);
+				p[clen] = '\0';
+				names[count] = p;
+				p += clen + 1;
+			}
+			else {
+				size += clen + 1;
+			}
+			count++;
 		}
+	}
+	mutex_unlock(&loop_store_mutex);
+	kfree(path);
 
-		kfree(x->buffer_grefs);
-		x->buffer_grefs = NULL;
+	if (!found) {
+		kfree(names);
+		return ERR_PTR(-ENOENT);
+	}
+	if (!names) {
+		return ERR_PTR(-ENOMEM);
 	}
+	*num = count;
+	return names;
+}
 
-	if (x->buffer_addr) {
-		struct descriptor_page *d = x->descriptor_addr;
+/* Like xenstore, fires once as soon as it is registered. */
+static int
+loop_register_watch (struct xenbus_watch *watch) {
+	mutex_lock(&loop_store_mutex);
+	list_add(&watch->list, &loop_watches);
+	loop_watch_queue(watch, watch->node);
+	mutex_unlock(&loop_store_mutex);
+	return 0;
+}
 
-		free_pages(x->buffer_addr, x->buffer_order);
-		x->buffer_addr = 0;
-		x->buffer_order = -1;
-		if (d) {
-			d->buffer_order = -1;
+static void
+loop_unregister_watch (struct xenbus_watch *watch) {
+	struct loop_watch_event *e, *tmp;
+
+	mutex_lock(&loop_store_mutex);
+	list_del(&watch->list);
+	mutex_unlock(&loop_store_mutex);
+
+	spin_lock(&loop_watch_lock);
+	list_for_each_entry_safe(e, tmp, &loop_watch_events, list) {
+		if (e->watch == watch) {
+			list_del(&e->list);
+			kfree(e->path);
+			kfree(e);
 		}
 	}
+	spin_unlock(&loop_watch_lock);
+
+	/* wait for a callback in progress, unless we are it */
+	if (loop_watch_task != current) {
+		flush_work(&loop_watch_work);
+	}
+}
+
+static int
+loop_init (void) {
+	return loop_write(XBT_NIL, "domid", "", "0");
 }
 
 static void
-server_unallocate_descriptor_page (struct xen_sock *x) {
-	if (x->descriptor_gref != -ENOSPC) {
-		gnttab_end_foreign_access(x->descriptor_gref, 0, 0);
-		x->descriptor_gref = -ENOSPC;
-	}
-	if (x->descriptor_addr) {
-		free_page((unsigned long)(x->descriptor_addr));
-		x->descriptor_addr = NULL;
+loop_exit (void) {
+	struct loop_node *n, *tmp;
+
+	flush_work(&loop_watch_work);
+	list_for_each_entry_safe(n, tmp, &loop_nodes, list) {
+		list_del(&n->list);
+		kfree(n->path);
+		kfree(n->value);
+		kfree(n);
 	}
+	idr_destroy(&loop_grefs);
+	idr_destroy(&loop_ports);
 }
 
-static void
-client_unmap_buffer_pages (struct xen_sock *x) {
+static const struct xensocket_backend loopback_backend = {
+	.name              = "loopback",
+	.init              = loop_init,
+	.exit              = loop_exit,
+	.frame             = loop_frame,
+	.claim_grefs       = loop_claim_grefs,
+	.grant_ref         = loop_grant_ref,
+	.end_grant         = loop_end_grant,
+	.end_grant_page    = loop_end_grant_page,
+	.map               = loop_map,
+	.unmap             = loop_unmap,
+	.copy              = loop_copy,
+	.alloc_evtchn      = loop_alloc_evtchn,
+	.bind_evtchn       = loop_bind_evtchn,
+	.evtchn_unbound    = loop_evtchn_unbound,
+	.bind_irq          = loop_bind_irq,
+	.unbind_irq        = loop_unbind_irq,
+	.notify            = loop_notify,
+	.mask_irq          = loop_mask_irq,
+	.unmask_irq        = loop_unmask_irq,
+	.set_irq_cpu       = loop_set_irq_cpu,
+	.sync_irq          = loop_sync_irq,
+	.transaction_start = loop_transaction_start,
+	.transaction_end   = loop_transaction_end,
+	.read              = loop_read,
+	.write             = loop_write,
+	.rm                = loop_rm,
+	.exists            = loop_exists,
+	.directory         = loop_directory,
+	.register_watch    = loop_register_watch,
+	.unregister_watch  = loop_unregister_watch,
+};
 
-	if (x->buffer_handles) {
-		struct descriptor_page *d = x->descriptor_addr;
-		int                     buffer_order = d->buffer_order;
-		int                     buffer_num_pages = (1 << buffer_order);
-		int                     i;
-		struct                  gnttab_unmap_grant_ref op;
-		int                     rc = 0;
+/************************************************************************
+ * Same-domain connections.
+ *
+ * When both ends of a connection live in one domain, granting pages to
+ * ourselves, mapping them back through the hypervisor and signalling
+ * through an event channel buys nothing.  With same_domain_fast_path,
+ * the Xen backend hands such connections to the loopback grant table
+ * and ports instead: the acceptor uses the connector's ring pages where
+ * they are, and a notify runs the peer's interrupt handler, and so its
+ * waitqueue wakeup, directly in the sender's context.  Which side of the
+ * split a gref, port or irq belongs to is told by its number, so the
+ * acceptor needs no flag from the connector.
+ ************************************************************************/
 
-		for (i = 0; i < buffer_num_pages; i++) {
-			if (x->buffer_handles[i] == -1) {
-				break;
-			}
+#ifdef CONFIG_XEN
 
-			memset(&op, 0, sizeof(op));
-			op.host_addr = x->buffer_addr + i * PAGE_SIZE;
-			op.handle = x->buffer_handles[i];
-			op.dev_bus_addr = 0;
+static bool same_domain_fast_path = 1;
+module_param(same_domain_fast_path, bool, 0644);
+MODULE_PARM_DESC(same_domain_fast_path, "Connect sockets of the same domain without grants or event channels");
 
-			//lock_vm_area(x->buffer_area);
-			rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &op, 1);
-			//unlock_vm_area(x->buffer_area);
-			if (rc == -ENOSYS) {
-				printk("Failure to unmap grant reference \n");
-			}
-		}
+static inline int
+xen_local (domid_t domid) {
+	return same_domain_fast_path && domid == mydomid;
+}
 
-		kfree(x->buffer_handles);
-		x->buffer_handles = NULL;
-	}
-	if (x->buffer_area) {
-		free_vm_area(x->buffer_area);
-		x->buffer_area = NULL;
+static int
+xen_local_claim_grefs (domid_t domid, int count, int *grefs) {
+	if (xen_local(domid)) {
+		return loop_claim_grefs(domid, count, grefs);
 	}
+	return xen_be_claim_grefs(domid, count, grefs);
 }
 
+/* Frames are machine frames here, the loopback side wants pfns. */
 static void
-client_unmap_descriptor_page (struct xen_sock *x) {
-	struct descriptor_page *d;
-	int                     rc = 0;
+xen_local_grant_ref (int gref, domid_t domid, unsigned long frame, int readonly) {
+	if (loop_id(gref)) {
+		loop_grant_ref(gref, domid, mfn_to_pfn(frame), readonly);
+	}
+	else {
+		xen_be_grant_ref(gref, domid, frame, readonly);
+	}
+}
 
-	d = x->descriptor_addr;
+static int
+xen_local_end_grant (int gref, int readonly) {
+	return loop_id(gref) ? loop_end_grant(gref, readonly) : xen_be_end_grant(gref, readonly);
+}
 
-	if (x->descriptor_handle != -1) {
-		struct gnttab_unmap_grant_ref op;
+static void
+xen_local_end_grant_page (int gref, int readonly, unsigned long page) {
+	if (loop_id(gref)) {
+		loop_end_grant_page(gref, readonly, page);
+	}
+	else {
+		xen_be_end_grant_page(gref, readonly, page);
+	}
+}
 
-		memset(&op, 0, sizeof(op));
-		op.host_addr = (unsigned long)x->descriptor_addr;
-		op.handle = x->descriptor_handle;
-		op.dev_bus_addr = 0;
+static void *
+xen_local_map (domid_t domid, const int *grefs, int count, int readonly, grant_handle_t *handles, void **area) {
+	if (loop_id(grefs[0])) {
+		return loop_map(domid, grefs, count, readonly, handles, area);
+	}
+	return xen_be_map(domid, grefs, count, readonly, handles, area);
+}
 
-		//lock_vm_area(x->descriptor_area);
-		atomic_set(&d->sender_has_shutdown, 1);
-		rc = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &op, 1);
-		//unlock_vm_area(x->descriptor_area);
-		if (rc == -ENOSYS) {
-			printk("Failure to unmap grant reference for descriptor page\n");
-		}
+/* Only Xen mappings come with a vm area. */
+static void
+xen_local_unmap (void *addr, void *area, grant_handle_t *handles, int count) {
+	if (!area) {
+		loop_unmap(addr, area, handles, count);
+	}
+	else {
+		xen_be_unmap(addr, area, handles, count);
+	}
+}
+
+/* A batch of copies always reads from one connection. */
+static void
+xen_local_copy (struct gnttab_copy *ops, unsigned int count) {
+	unsigned int i;
 
-		x->descriptor_handle = -1;
+	if (!count || !(ops[0].flags & GNTCOPY_source_gref) || !loop_id(ops[0].source.u.ref)) {
+		xen_be_copy(ops, count);
+		return;
 	}
-	if (x->descriptor_area) {
-		free_vm_area(x->descriptor_area);
-		x->descriptor_area = NULL;
+	for (i = 0; i < count; i++) {
+		if (!(ops[i].flags & GNTCOPY_dest_gref)) {
+			ops[i].dest.u.gmfn = mfn_to_pfn(ops[i].dest.u.gmfn);
+		}
 	}
+	loop_copy(ops, count);
 }
 
-static void xen_watch_accept(struct xenbus_watch *xbw, const char **vec, unsigned int len) {
-	int    rc = -EINVAL;
-    const char *gref_str;
-    int gref, domid;
-    struct xensocket_xenbus_watch *x = (struct xensocket_xenbus_watch*) xbw;
+static void
+loop_port_set_direct (unsigned int port) {
+	struct loop_port *p;
 
-    TRACE_ENTRY;
-    DPRINTK("xen_watch_service(%p, %p, %d)\n", xbw, vec, len);
-
-    if(len > 0) {
-        /* check if
-         * 1) node is a prefix of the path and
-         * 2) if "path" is longer than "node/"
-         */
-        x->path_len = strlen(xbw->node);
-        DPRINTK("path = %s\n", vec[0]);
-        if(strncmp(vec[0], xbw->node, x->path_len) == 0 && (strlen(vec[0]) - x->path_len > 1)) {
-            x->gref = -2; // dbg
-            gref_str = vec[0] + x->path_len + 1;
-            if(sscanf(gref_str, "%d", &gref) > 0) {
-                xenbus_transaction_start(&(x->xbt));
-                rc = xenbus_scanf(x->xbt, xbw->node, gref_str, "%d", &domid);
-                if(rc > 0) {
-                    // success
-                    x->gref = gref;
-                    x->domid = domid;
-                    // unregister myself:
-                    unregister_xenbus_watch(xbw);
-                    xenbus_rm(x->xbt, xbw->node, gref_str);
-                    xenbus_transaction_end(x->xbt, 0);
-                    // release sem:
-                    up(&(x->sem));
-                } else {
-                    xenbus_transaction_end(x->xbt, 0);
-                }
-            }
-        }
-    }
-    TRACE_EXIT;
+	spin_lock_irq(&loop_port_lock);
+	if ((p = idr_find(&loop_ports, port))) {
+		p->direct = 1;
+	}
+	spin_unlock_irq(&loop_port_lock);
 }
 
-static int xen_accept (struct socket *sock, struct socket *newsock, int flags) {
-	int    rc = -EINVAL;
-	struct sock *sk = sock->sk;
-	struct xen_sock *x = xen_sk(sk);
-    struct sock *new_sk;
-    struct xen_sock *new_x;
-	char   dir[256];
-    struct xensocket_xenbus_watch xsbw;
-	//struct xenbus_transaction t;
+static int
+xen_local_alloc_evtchn (domid_t domid, unsigned int *port) {
+	int    rc;
 
-	TRACE_ENTRY;
-    DPRINTK("sock@%p\n", sock);
-    DPRINTK("newsock@%p\n", newsock);
+	if (!xen_local(domid)) {
+		return xen_be_alloc_evtchn(domid, port);
+	}
+	if ((rc = loop_alloc_evtchn(domid, port)) == 0) {
+		loop_port_set_direct(*port);
+	}
+	return rc;
+}
 
-    sprintf(dir, "/xensocket/service/%s", x->service);
-    xsbw.xbw.node = dir;
-    xsbw.xbw.callback = xen_watch_accept;
-    xsbw.gref = -1;
-
-    // init as locked:
-    sema_init(&(xsbw.sem), 0);
-
-    // start watch:
-    register_xenbus_watch((struct xenbus_watch*)&xsbw);
-
-    // wait for sem release:
-    DPRINTK("");
-    //down(&(xsbw.sem));
-    if(down_interruptible(&(xsbw.sem))) {
-        // e.g. interrupted
-        rc = -EINTR;
-        DPRINTK("accept got interrupted\n");
-        unregister_xenbus_watch((struct xenbus_watch*)&xsbw);
-        goto err;
-    }
-    DPRINTK("");
-    //unregister_xenbus_watch((struct xenbus_watch*)&xsbw);
+static int
+xen_local_bind_evtchn (domid_t domid, unsigned int remote_port, unsigned int *port) {
+	int    rc;
 
-    DPRINTK("xsbw.gref = %d, xsbw.domid = %d\n", xsbw.gref, xsbw.domid);
+	if (!loop_id(remote_port)) {
+		return xen_be_bind_evtchn(domid, remote_port, port);
+	}
+	if ((rc = loop_bind_evtchn(domid, remote_port, port)) == 0) {
+		loop_port_set_direct(*port);
+	}
+	return rc;
+}
 
-    // create child sk for newsock:
-    xen_create(sock_net(sk), newsock, -1, 0);
-    
-    new_sk = newsock->sk;
-    new_x = xen_sk(new_sk);
+static int
+xen_local_evtchn_unbound (unsigned int port) {
+	return loop_id(port) ? loop_evtchn_unbound(port) : xen_be_evtchn_unbound(port);
+}
 
-    strcpy(new_x->service, x->service);
+static int
+xen_local_bind_irq (unsigned int port, irq_handler_t handler, const char *name, void *dev_id) {
+	if (loop_id(port)) {
+		return loop_bind_irq(port, handler, name, dev_id);
+	}
+	return xen_be_bind_irq(port, handler, name, dev_id);
+}
 
-    new_x->descriptor_gref = xsbw.gref;
-    new_x->otherend_id = xsbw.domid;
+static void
+xen_local_unbind_irq (unsigned int irq, void *dev_id) {
+	if (loop_id(irq)) {
+		loop_unbind_irq(irq, dev_id);
+	}
+	else {
+		xen_be_unbind_irq(irq, dev_id);
+	}
+}
 
-	if (new_x->descriptor_gref < 0) {
-		printk(KERN_CRIT "Gref could not be read!");
-		goto err;
+static void
+xen_local_notify (unsigned int port) {
+	if (loop_id(port)) {
+		loop_notify(port);
+	}
+	else {
+		xen_be_notify(port);
 	}
+}
 
-	printk(KERN_CRIT "pfxen: mapping descriptor page...");
-	if ((rc = client_map_descriptor_page(new_x)) != 0) {
-		goto err;
+static void
+xen_local_mask_irq (unsigned int irq) {
+	if (loop_id(irq)) {
+		loop_mask_irq(irq);
 	}
-	printk(KERN_CRIT "pfxen: mapping event channel...");
-	if ((rc = client_bind_event_channel(new_x)) != 0) {
-		goto err_unmap_descriptor;
+	else {
+		xen_be_mask_irq(irq);
 	}
-	printk(KERN_CRIT "pfxen: mapping buffer pages...");
-	if ((rc = client_map_buffer_pages(new_x)) != 0) {
-		goto err_unmap_buffer;
+}
+
+static void
+xen_local_unmask_irq (unsigned int irq) {
+	if (loop_id(irq)) {
+		loop_unmask_irq(irq);
+	}
+	else {
+		xen_be_unmask_irq(irq);
 	}
+}
 
-    newsock->state = SS_CONNECTED;
+static int
+xen_local_set_irq_cpu (unsigned int irq, int cpu) {
+	return loop_id(irq) ? loop_set_irq_cpu(irq, cpu) : xen_be_set_irq_cpu(irq, cpu);
+}
 
-	TRACE_EXIT;
-	return 0;
+static void
+xen_local_sync_irq (unsigned int irq) {
+	if (loop_id(irq)) {
+		loop_sync_irq(irq);
+	}
+	else {
+		xen_be_sync_irq(irq);
+	}
+}
 
-err_unmap_buffer:
-	client_unmap_buffer_pages(new_x);
+static const struct xensocket_backend xen_backend = {
+	.name              = "xen",
+	.init              = xen_be_init,
+	.frame             = xen_be_frame,
+	.claim_grefs       = xen_local_claim_grefs,
+	.grant_ref         = xen_local_grant_ref,
+	.end_grant         = xen_local_end_grant,
+	.end_grant_page    = xen_local_end_grant_page,
+	.map               = xen_local_map,
+	.unmap             = xen_local_unmap,
+	.copy              = xen_local_copy,
+	.alloc_evtchn      = xen_local_alloc_evtchn,
+	.bind_evtchn       = xen_local_bind_evtchn,
+	.evtchn_unbound    = xen_local_evtchn_unbound,
+	.bind_irq          = xen_local_bind_irq,
+	.unbind_irq        = xen_local_unbind_irq,
+	.notify            = xen_local_notify,
+	.mask_irq          = xen_local_mask_irq,
+	.unmask_irq        = xen_local_unmask_irq,
+	.set_irq_cpu       = xen_local_set_irq_cpu,
+	.sync_irq          = xen_local_sync_irq,
+	.transaction_start = xenbus_transaction_start,
+	.transaction_end   = xenbus_transaction_end,
+	.read              = xenbus_read,
+	.write             = xenbus_write,
+	.rm                = xenbus_rm,
+	.exists            = xenbus_exists,
+	.directory         = xenbus_directory,
+	.register_watch    = register_xenbus_watch,
+	.unregister_watch  = unregister_xenbus_watch,
+};
 
-err_unmap_descriptor:
-	client_unmap_descriptor_page(new_x);
-	notify_remote_via_evtchn(new_x->evtchn_local_port);
+#endif /* CONFIG_XEN */
 
-err:
-    TRACE_ERROR;
-	return rc;
-}
+static const struct xensocket_backend *xensocket_backends[] = {
+#ifdef CONFIG_XEN
+	&xen_backend,
+#endif
+	&loopback_backend,
+};
 
-// accept requires this implementation
-static int xen_getname(struct socket *sock, struct sockaddr *addr, int *sockaddr_len, int peer) {
-	struct sock *sk = sock->sk;
-	struct xen_sock *x = xen_sk(sk);
-    struct sockaddr_xe *sxeaddr = (struct sockaddr_xe*) addr;
+#ifdef CONFIG_XEN
+static char *backend_name = "xen";
+#else
+static char *backend_name = "loopback";
+#endif
+module_param_named(backend, backend_name, charp, 0444);
+MODULE_PARM_DESC(backend, "Transport: xen, or loopback to run both ends in this kernel");
 
-    TRACE_ENTRY;
-    DPRINTK("peer = %d\n", peer);
-    sxeaddr->sxe_family = AF_XEN;
-    strcpy(sxeaddr->service, x->service);
-    *sockaddr_len = sizeof(struct sockaddr_xe);
-    TRACE_EXIT;
-    return 0;
-}
+static int
+xensocket_backend_init (void) {
+	int    rc;
+	int    i;
 
-static int xen_listen (struct socket *sock, int backlog) {
-    int domid;
-    struct xenbus_transaction t;
-	struct sock *sk = sock->sk;
-	struct xen_sock *x = xen_sk(sk);
+	for (i = 0; i < ARRAY_SIZE(xensocket_backends); i++) {
+		if (!strcmp(backend_name, xensocket_backends[i]->name)) {
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(xensocket_backends)) {
+		printk(KERN_ERR "xensocket: unknown backend %s\n", backend_name);
+		return -EINVAL;
+	}
 
-	TRACE_ENTRY;
-    DPRINTK("sock@%p\n", sock);
-    // xenbus transaction
-    xenbus_transaction_start(&t);
-    // get own domid:
-    xenbus_scanf(t, "domid", "", "%d", &domid);
-    xenbus_printf(t, "/xensocket/service", x->service, "%d", domid);
-    xenbus_transaction_end(t, 0);
+	backend = xensocket_backends[i];
+	if (backend->init && (rc = backend->init()) != 0) {
+		return rc;
+	}
+	printk(KERN_INFO "xensocket: using the %s backend\n", backend->name);
+	return 0;
+}
 
-	TRACE_EXIT;
-    return 0;
+static void
+xensocket_backend_exit (void) {
+	if (backend->exit) {
+		backend->exit();
+	}
 }
 
 /************************************************************************
  * Functions to interface this module with the rest of the Linux streams
  * code.
  ************************************************************************/
- /*
-static struct xenbus_watch xbwg = {
-    .node = "/xensocket/service",
-    .callback = xen_watch_service
-};
-*/
 
 static int __init
 xensocket_init (void) {
@@ -1445,23 +7572,38 @@ xensocket_init (void) {
 
 	TRACE_ENTRY;
 
+	BUILD_BUG_ON(offsetof(struct descriptor_page, prod) != XENSOCKET_INDEX_ALIGN);
+
+	if ((rc = xensocket_backend_init()) != 0) {
+		goto out;
+	}
+
+	xen_defer_init();
+
 	rc = proto_register(&xen_proto, 1);
 	printk(KERN_CRIT  "pfxen: protocol registered\n");
 	if (rc != 0) {
 		printk(KERN_CRIT "%s: Cannot create xen_sock SLAB cache!\n", __FUNCTION__);
+		xensocket_backend_exit();
+		goto out;
+	}
+
+	if ((rc = register_shrinker(&xen_pool_shrinker)) != 0) {
+		proto_unregister(&xen_proto);
+		xensocket_backend_exit();
 		goto out;
 	}
 
 	printk(KERN_CRIT "pfxen: registering socket family...\n");
 	sock_register(&xen_family_ops);
 	printk(KERN_CRIT "pfxen: xen socket family registered\n");
-	xenbus_transaction_start(&t);
-    xenbus_scanf(t, "domid", "", "%d", &mydomid);
-	xenbus_transaction_end(t, 0);
+	backend->transaction_start(&t);
+    store_scanf(t, "domid", "", "%d", &mydomid);
+	backend->transaction_end(t, 0);
     printk(KERN_CRIT "pfxen: my domid = %d\n", mydomid);
-
-    // this is just for testing xenbus watch!
-    //register_xenbus_watch(&xbwg);
+	xen_ctrl_init();
+	xen_service_init();
+	xen_setup_init();
 
 out:
 	TRACE_EXIT;
@@ -1473,10 +7615,14 @@ xensocket_exit (void) {
 	TRACE_ENTRY;
 
 	sock_unregister(AF_XEN);
+	xen_setup_exit();
+	xen_service_exit();
+	xen_ctrl_exit();
+	unregister_shrinker(&xen_pool_shrinker);
+	xen_pool_trim(ULONG_MAX);
+	xen_defer_exit();
 	proto_unregister(&xen_proto);
-
-    // this is just for testing xenbus watch!
-    //unregister_xenbus_watch(&xbwg);
+	xensocket_backend_exit();
 
 	TRACE_EXIT;
 }
@@ -27,6 +27,72 @@ struct sockaddr_xe {
 #define AF_XEN  21
 #define PF_XEN  AF_XEN
 
+/* setsockopt()/getsockopt() level for AF_XEN specific options */
+#define SOL_XEN 0x5853
+
+/* int, bytes: size of each ring of the connection; set before connect() */
+#define XEN_RING_SIZE   1
+
+/* struct xen_ring_map (getsockopt only): where the ring indices sit in
+ * the XEN_MMAP_INDEX mapping of a connected socket
+ */
+#define XEN_RING_MAP    2
+
+struct xen_ring_map {
+  unsigned int tx_size;   /* bytes, a power of two */
+  unsigned int rx_size;
+  unsigned int tx_prod;   /* byte offsets of the free-running indices */
+  unsigned int tx_cons;
+  unsigned int rx_prod;
+  unsigned int rx_cons;
+};
+
+/* mmap() offsets of the shared areas of a connected socket.  The index
+ * pages and the rx ring can only be mapped read-only.
+ */
+#define XEN_MMAP_INDEX    0x00000000  /* tx then rx descriptor page */
+#define XEN_MMAP_TX_RING  0x10000000
+#define XEN_MMAP_RX_RING  0x20000000
+
+/* ioctl()s for mapped rings; the argument is a byte count.  COMMIT
+ * publishes bytes written at the tx producer index, RELEASE hands back
+ * bytes read at the rx consumer index.  Both notify the peer if needed.
+ */
+#define XEN_RING_COMMIT   0x89E0  /* SIOCPROTOPRIVATE */
+#define XEN_RING_RELEASE  0x89E1
+
+/* int, boolean: honour MSG_ZEROCOPY on send(); completions are read with
+ * recvmsg(MSG_ERRQUEUE) as a cmsg of level SOL_XEN, type XEN_RECVERR
+ */
+#define XEN_ZEROCOPY    3
+#define XEN_RECVERR     4
+
+/* int, 1 to 8: rings per direction of a SOCK_SEQPACKET connection, each
+ * with its own event channel; set before connect().  Records keep their
+ * order within a queue, not across queues.  getsockopt() returns the
+ * count negotiated with the peer.
+ */
+#define XEN_QUEUES          5
+
+/* int: how a send picks its queue */
+#define XEN_QUEUE_STEERING  6
+#define XEN_STEER_FLOW      0   /* by sending thread (default) */
+#define XEN_STEER_CPU       1   /* by current CPU */
+
+/* int (getsockopt only): CPU the interrupt of the caller's rx queue was
+ * last moved to, -1 before any reader has waited on it
+ */
+#define XEN_INCOMING_CPU    7
+
+/* not in older kernel and libc headers */
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY                0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY       5
+#define SO_EE_CODE_ZEROCOPY_COPIED  1
+#endif
+
 #define xen_sk(__sk) ((struct xen_sock *)__sk)
 
 #endif /* __XENSOCKET_H__ */